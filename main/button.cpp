@@ -0,0 +1,145 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include "driver/gpio.h"
+#include "esp_attr.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "button.h"
+#include "task_layout.h"
+
+#define BUTTON_GPIO GPIO_NUM_41  // BtnA, active low
+
+#define BUTTON_TASK_CORE       TASK_LAYOUT_UI_CORE
+#define BUTTON_TASK_PRIORITY   TASK_LAYOUT_UI_PRIORITY
+#define BUTTON_TASK_STACK_SIZE 2048
+#define BUTTON_QUEUE_LEN       4
+
+#define BUTTON_DEBOUNCE_MS     20
+#define BUTTON_LONG_PRESS_MS   500
+#define BUTTON_DOUBLE_CLICK_MS 300
+
+static const char *TAG = "button";
+
+typedef struct {
+    QueueHandle_t events;
+    TaskHandle_t task;
+} button_t;
+
+static button_t s_button;
+
+static void IRAM_ATTR button_isr(void *arg) {
+    (void)arg;
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(s_button.task, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+bool button_is_pressed(void) {
+    return gpio_get_level(BUTTON_GPIO) == 0;
+}
+
+// Wait for an edge, then for the line to settle. False on timeout.
+static bool wait_edge(TickType_t timeout) {
+    if (ulTaskNotifyTake(pdTRUE, timeout) == 0) {
+        return false;
+    }
+    vTaskDelay(pdMS_TO_TICKS(BUTTON_DEBOUNCE_MS));
+    // drop the edges of the bounce itself
+    ulTaskNotifyTake(pdTRUE, 0);
+    return true;
+}
+
+static void post(button_event_t event) {
+    if (xQueueSend(s_button.events, &event, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "event queue full, dropped event %d", event);
+    }
+}
+
+static void button_task(void *arg) {
+    (void)arg;
+    const TickType_t long_press = pdMS_TO_TICKS(BUTTON_LONG_PRESS_MS);
+    const TickType_t double_gap = pdMS_TO_TICKS(BUTTON_DOUBLE_CLICK_MS);
+
+    while (1) {
+        // idle: nothing happens until the button is pressed
+        wait_edge(portMAX_DELAY);
+        if (!button_is_pressed()) {
+            continue;
+        }
+
+        int clicks = 0;
+        while (1) {
+            // pressed: released before the long press time is a click
+            TickType_t pressed_at = xTaskGetTickCount();
+            bool released         = false;
+            while (!released) {
+                TickType_t held = xTaskGetTickCount() - pressed_at;
+                if (held >= long_press || !wait_edge(long_press - held)) {
+                    break;
+                }
+                released = !button_is_pressed();
+            }
+            if (!released) {
+                post(BUTTON_LONG_PRESS);
+                while (button_is_pressed()) {
+                    wait_edge(portMAX_DELAY);
+                }
+                break;
+            }
+
+            if (++clicks == 2) {
+                post(BUTTON_DOUBLE_CLICK);
+                break;
+            }
+            // released: a second press within the gap makes a double click
+            bool again = false;
+            while (!again && wait_edge(double_gap)) {
+                again = button_is_pressed();
+            }
+            if (!again) {
+                post(BUTTON_CLICK);
+                break;
+            }
+        }
+    }
+}
+
+esp_err_t button_init(void) {
+    s_button.events = xQueueCreate(BUTTON_QUEUE_LEN, sizeof(button_event_t));
+    ESP_RETURN_ON_FALSE(s_button.events, ESP_ERR_NO_MEM, TAG,
+                        "could not create event queue");
+    BaseType_t ok = xTaskCreatePinnedToCore(
+        button_task, "button", BUTTON_TASK_STACK_SIZE, NULL,
+        BUTTON_TASK_PRIORITY, &s_button.task, BUTTON_TASK_CORE);
+    ESP_RETURN_ON_FALSE(ok == pdPASS, ESP_ERR_NO_MEM, TAG,
+                        "could not create button task");
+
+    const gpio_config_t io_conf = {
+        .pin_bit_mask = 1ULL << BUTTON_GPIO,
+        .mode         = GPIO_MODE_INPUT,
+        .pull_up_en   = GPIO_PULLUP_ENABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type    = GPIO_INTR_ANYEDGE,
+    };
+    ESP_RETURN_ON_ERROR(gpio_config(&io_conf), TAG, "could not configure %d",
+                        BUTTON_GPIO);
+    // the service may already be installed by another driver
+    esp_err_t ret = gpio_install_isr_service(0);
+    ESP_RETURN_ON_FALSE(ret == ESP_OK || ret == ESP_ERR_INVALID_STATE, ret,
+                        TAG, "could not install the GPIO ISR service");
+    ESP_RETURN_ON_ERROR(gpio_isr_handler_add(BUTTON_GPIO, button_isr, NULL),
+                        TAG, "could not add the button ISR");
+    return ESP_OK;
+}
+
+bool button_wait(button_event_t *event, TickType_t timeout) {
+    return xQueueReceive(s_button.events, event, timeout) == pdTRUE;
+}
@@ -0,0 +1,33 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Interrupt driven BtnA. An edge interrupt wakes a low priority task that
+ * debounces the line and turns presses into click, double click and long
+ * press events on a queue. Nothing runs while the button is left alone, so
+ * the main task can block in button_wait() instead of polling.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+typedef enum {
+    BUTTON_CLICK = 0,
+    BUTTON_DOUBLE_CLICK,
+    BUTTON_LONG_PRESS,  // sent while the button is still held
+} button_event_t;
+
+// Configure the GPIO and start the button task
+esp_err_t button_init(void);
+
+// Wait up to `timeout` ticks for the next event
+bool button_wait(button_event_t *event, TickType_t timeout);
+
+// Level of the button right now, debouncing not applied
+bool button_is_pressed(void);
@@ -0,0 +1,382 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "nvs.h"
+
+#include "M5Unified.h"
+
+#include "card_profile.h"
+#include "msc_config.h"
+#include "msc_pipeline.h"
+#include "msc_pool.h"
+#include "msc_stats.h"
+#include "msc_storage.h"
+#include "sd_card.h"
+#include "sd_recovery.h"
+#include "status_display.h"
+#include "task_layout.h"
+
+#define PROFILE_VERSION         1
+#define PROFILE_TASK_CORE       TASK_LAYOUT_UI_CORE
+#define PROFILE_TASK_PRIORITY   TASK_LAYOUT_SPACE_PRIORITY
+#define PROFILE_TASK_STACK_SIZE 3072
+#define PROFILE_POLL_MS         1000
+#define PROFILE_IDLE_POLLS      3      // quiet polls before the card is read
+#define PROFILE_SAVE_MS         60000  // error history is stored this often
+#define PROFILE_READ_CHUNKS     64     // chunks per read rate sample
+#define PROFILE_SLOW_PCT        CONFIG_EXAMPLE_CARD_PROFILE_SLOW_PCT
+
+#define NVS_NAMESPACE "card_prof"
+#define NVS_KEY_SEQ   "seq"
+
+static const char *TAG = "card_profile";
+
+typedef struct {
+    nvs_handle_t nvs;
+    SemaphoreHandle_t lock;  // the card task and the validation task
+    const sdmmc_card_t *card;
+    card_profile_t cur;
+    bool loaded;     // cur is the profile of the card last looked up
+    bool found;      // cur was in NVS when the card was looked up
+    bool stored;     // cur is in NVS
+    bool attached;   // the card runs at cur.freq_khz
+    bool pending;    // not validated since the last attach
+    bool dirty;      // cur changed since it was stored
+    int64_t saved_us;
+    uint32_t errors_seen;   // sd_recovery errors already in a history
+    uint32_t reinits_seen;  // sd_recovery re-inits already in a history
+} card_profile_store_t;
+
+static card_profile_store_t s_prof;
+
+static void make_key(const sdmmc_cid_t *cid, char *key) {
+    sprintf(key, "c%08lx", esp_rom_crc32_le(0, (const uint8_t *)cid,
+                                            sizeof(*cid)));
+}
+
+// Make room for one more profile: drop the one attached longest ago
+static void evict_oldest(void) {
+    char oldest[NVS_KEY_NAME_MAX_SIZE] = "";
+    uint32_t oldest_seq                = UINT32_MAX;
+    int count                          = 0;
+
+    nvs_iterator_t it = NULL;
+    esp_err_t err     = nvs_entry_find(NVS_DEFAULT_PART_NAME, NVS_NAMESPACE,
+                                       NVS_TYPE_BLOB, &it);
+    while (err == ESP_OK) {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        card_profile_t p;
+        size_t len = sizeof(p);
+        if (nvs_get_blob(s_prof.nvs, info.key, &p, &len) != ESP_OK ||
+            len != sizeof(p)) {
+            p.seq = 0;  // unreadable, goes first
+        }
+        if (p.seq < oldest_seq) {
+            oldest_seq = p.seq;
+            strcpy(oldest, info.key);
+        }
+        count++;
+        err = nvs_entry_next(&it);
+    }
+    nvs_release_iterator(it);
+
+    if (count >= CARD_PROFILE_MAX) {
+        ESP_LOGI(TAG, "dropping profile %s", oldest);
+        nvs_erase_key(s_prof.nvs, oldest);
+    }
+}
+
+static void save(void) {
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    make_key(&s_prof.cur.cid, key);
+    if (!s_prof.stored) {
+        evict_oldest();
+    }
+    if (nvs_set_blob(s_prof.nvs, key, &s_prof.cur, sizeof(s_prof.cur)) !=
+            ESP_OK ||
+        nvs_commit(s_prof.nvs) != ESP_OK) {
+        ESP_LOGW(TAG, "could not store profile %s", key);
+        return;
+    }
+    s_prof.stored   = true;
+    s_prof.dirty    = false;
+    s_prof.saved_us = esp_timer_get_time();
+}
+
+// Add the card errors since the last call to the history
+static void account_errors(void) {
+    sd_recovery_stats_t rec;
+    sd_recovery_get_stats(&rec);
+    uint32_t errors = 0;
+    for (int i = 0; i < SD_ERR_CLASSES; i++) {
+        errors += rec.errors[i];
+    }
+    if (errors != s_prof.errors_seen || rec.reinits != s_prof.reinits_seen) {
+        s_prof.cur.errors += errors - s_prof.errors_seen;
+        s_prof.cur.reinits += rec.reinits - s_prof.reinits_seen;
+        s_prof.errors_seen  = errors;
+        s_prof.reinits_seen = rec.reinits;
+        s_prof.dirty        = true;
+    }
+}
+
+// Error recovery lowered the clock: it is not to be trusted on the next boot
+static void check_clock(void) {
+    if (s_prof.attached && s_prof.cur.freq_khz != 0 &&
+        sd_card_get_freq_khz() < (int)s_prof.cur.freq_khz) {
+        ESP_LOGW(TAG, "clock dropped to %d kHz, renegotiating %lu kHz",
+                 sd_card_get_freq_khz(), s_prof.cur.freq_khz);
+        s_prof.cur.freq_khz = 0;
+        save();
+    }
+}
+
+// Load the profile of the card into cur, or start a new one
+static void lookup(const sdmmc_card_t *card) {
+    if (s_prof.loaded &&
+        memcmp(&s_prof.cur.cid, &card->cid, sizeof(card->cid)) == 0) {
+        return;
+    }
+    // errors since the last poll still belong to the card before
+    if (s_prof.attached) {
+        account_errors();
+    }
+    if (s_prof.loaded && s_prof.dirty) {
+        save();
+    }
+    s_prof.loaded   = true;
+    s_prof.attached = false;
+    s_prof.pending  = false;
+
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    make_key(&card->cid, key);
+    size_t len = sizeof(s_prof.cur);
+    if (nvs_get_blob(s_prof.nvs, key, &s_prof.cur, &len) == ESP_OK &&
+        len == sizeof(s_prof.cur) && s_prof.cur.version == PROFILE_VERSION &&
+        memcmp(&s_prof.cur.cid, &card->cid, sizeof(card->cid)) == 0) {
+        s_prof.found  = true;
+        s_prof.stored = true;
+        return;
+    }
+    memset(&s_prof.cur, 0, sizeof(s_prof.cur));
+    s_prof.cur.version = PROFILE_VERSION;
+    s_prof.cur.cid     = card->cid;
+    s_prof.found       = false;
+    s_prof.stored      = false;
+}
+
+static uint32_t host_chunks(void) {
+    // msc_stats_t is large, keep the snapshot off the stack
+    static msc_stats_t stats;
+    msc_stats_get(&stats);
+    return stats.read_chunks + stats.write_chunks;
+}
+
+/* Sequential read rate in KB/s from the middle of the card, through the SD
+ * worker so host commands still get their turn. 0 if a read failed or the
+ * host came back meanwhile, which would skew the sample. */
+static uint32_t measure_kbps(const sdmmc_card_t *card, uint8_t *buf) {
+    const uint32_t span = PROFILE_READ_CHUNKS * MSC_XFER_SECTORS;
+    uint32_t lba        = 0;
+    if ((uint32_t)card->csd.capacity > 2 * span) {
+        lba = card->csd.capacity / 2 / MSC_XFER_SECTORS * MSC_XFER_SECTORS;
+    }
+
+    const uint32_t chunks = host_chunks();
+    const int64_t start   = esp_timer_get_time();
+    for (int i = 0; i < PROFILE_READ_CHUNKS; i++) {
+        if (msc_pipeline_read(lba + i * MSC_XFER_SECTORS, buf,
+                              MSC_XFER_SECTORS) != ESP_OK) {
+            return 0;
+        }
+    }
+    const int64_t us = esp_timer_get_time() - start;
+    if (host_chunks() != chunks || us <= 0) {
+        return 0;
+    }
+    const uint64_t bytes = (uint64_t)span * MSC_SECTOR_SIZE;
+    return (uint32_t)(bytes * 1000000 / 1024 / us);
+}
+
+static void compare_geometry(const fat_geometry_t *geo) {
+    const fat_geometry_t *old = &s_prof.cur.fat;
+    if (old->fs_type != 0 &&
+        (geo->fs_type != old->fs_type || geo->serial != old->serial ||
+         geo->clusters != old->clusters)) {
+        ESP_LOGI(TAG, "volume %08lx, %lu clusters replaced by %08lx, %lu",
+                 old->serial, old->clusters, geo->serial, geo->clusters);
+    }
+    s_prof.cur.fat = *geo;
+}
+
+static void compare_rate(uint32_t kbps) {
+    card_profile_t *p = &s_prof.cur;
+    const int freq    = sd_card_get_freq_khz();
+    p->last_kbps      = kbps;
+
+    if (p->baseline_kbps == 0 || p->baseline_freq_khz != (uint32_t)freq) {
+        ESP_LOGI(TAG, "baseline %lu KB/s at %d kHz", kbps, freq);
+        p->baseline_kbps     = kbps;
+        p->baseline_freq_khz = freq;
+    } else if ((uint64_t)kbps * 100 <
+               (uint64_t)p->baseline_kbps * PROFILE_SLOW_PCT) {
+        p->slow++;
+        ESP_LOGW(TAG, "card degraded: %lu KB/s, baseline %lu KB/s", kbps,
+                 p->baseline_kbps);
+        char text[16];
+        sprintf(text, "%d MHz slow", freq / 1000);
+        display_set_text(DISPLAY_FIELD_FREQ, text, RED);
+    } else {
+        p->baseline_kbps = (3 * p->baseline_kbps + kbps) / 4;
+    }
+}
+
+// Re-read what probing found out, while the host leaves the card alone
+static bool validate(void) {
+    uint8_t *buf = (uint8_t *)msc_pool_alloc(MSC_XFER_SIZE);
+    if (buf == NULL) {
+        return false;
+    }
+    fat_geometry_t geo;
+    if (fat_geometry_read(buf, &geo) != ESP_OK) {
+        memset(&geo, 0, sizeof(geo));
+    }
+    uint32_t kbps = measure_kbps(s_prof.card, buf);
+    msc_pool_free(buf);
+    if (kbps == 0) {
+        return false;
+    }
+
+    xSemaphoreTake(s_prof.lock, portMAX_DELAY);
+    if (s_prof.pending) {
+        compare_geometry(&geo);
+        compare_rate(kbps);
+        s_prof.pending = false;
+        save();
+    }
+    xSemaphoreGive(s_prof.lock);
+    return true;
+}
+
+static void card_profile_task(void *arg) {
+    (void)arg;
+    uint32_t last_chunks = 0;
+    int idle             = 0;
+
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(PROFILE_POLL_MS));
+
+        xSemaphoreTake(s_prof.lock, portMAX_DELAY);
+        bool pending = s_prof.attached && s_prof.pending;
+        if (s_prof.attached) {
+            account_errors();
+            check_clock();
+            if (s_prof.dirty && esp_timer_get_time() - s_prof.saved_us >=
+                                    PROFILE_SAVE_MS * 1000LL) {
+                save();
+            }
+        }
+        xSemaphoreGive(s_prof.lock);
+
+        uint32_t chunks = host_chunks();
+        idle            = chunks == last_chunks ? idle + 1 : 0;
+        last_chunks     = chunks;
+        // the SD worker is up once the storage published a volume
+        if (pending && idle >= PROFILE_IDLE_POLLS &&
+            msc_storage_volume_generation() != 0 && !validate()) {
+            idle = 0;
+        }
+    }
+}
+
+esp_err_t card_profile_init(void) {
+    ESP_RETURN_ON_ERROR(nvs_open(NVS_NAMESPACE, NVS_READWRITE, &s_prof.nvs),
+                        TAG, "could not open NVS");
+    s_prof.lock = xSemaphoreCreateMutex();
+    ESP_RETURN_ON_FALSE(s_prof.lock, ESP_ERR_NO_MEM, TAG,
+                        "could not create profile lock");
+
+    BaseType_t ok = xTaskCreatePinnedToCore(
+        card_profile_task, "card_profile", PROFILE_TASK_STACK_SIZE, NULL,
+        PROFILE_TASK_PRIORITY, NULL, PROFILE_TASK_CORE);
+    ESP_RETURN_ON_FALSE(ok == pdPASS, ESP_ERR_NO_MEM, TAG,
+                        "could not create profile task");
+    return ESP_OK;
+}
+
+int card_profile_freq_khz(const sdmmc_card_t *card, int max_freq_khz) {
+    if (s_prof.lock == NULL) {
+        return 0;
+    }
+    xSemaphoreTake(s_prof.lock, portMAX_DELAY);
+    check_clock();
+    lookup(card);
+    const card_profile_t *p = &s_prof.cur;
+    int freq_khz            = 0;
+    if (s_prof.found && p->freq_khz != 0 &&
+        p->max_freq_khz == (uint32_t)max_freq_khz &&
+        p->freq_khz <= (uint32_t)card->max_freq_khz) {
+        freq_khz = p->freq_khz;
+    }
+    xSemaphoreGive(s_prof.lock);
+    return freq_khz;
+}
+
+void card_profile_attach(const sdmmc_card_t *card, int max_freq_khz) {
+    if (s_prof.lock == NULL) {
+        return;
+    }
+    xSemaphoreTake(s_prof.lock, portMAX_DELAY);
+    lookup(card);
+    card_profile_t *p = &s_prof.cur;
+    account_errors();
+    if (!s_prof.attached) {
+        p->inits++;
+    }
+    uint32_t seq = 0;
+    nvs_get_u32(s_prof.nvs, NVS_KEY_SEQ, &seq);
+    nvs_set_u32(s_prof.nvs, NVS_KEY_SEQ, ++seq);
+    p->seq          = seq;
+    p->max_freq_khz = max_freq_khz;
+    p->freq_khz     = sd_card_get_freq_khz();
+    p->au_sectors   = sd_card_au_sectors(card);
+
+    if (s_prof.found) {
+        ESP_LOGI(TAG, "card %s seen %lu times, %lu errors, %lu kHz",
+                 card->cid.name, p->inits, p->errors, p->freq_khz);
+    } else {
+        ESP_LOGI(TAG, "new card %s", card->cid.name);
+    }
+    s_prof.card     = card;
+    s_prof.attached = true;
+    s_prof.pending  = true;
+    save();
+    xSemaphoreGive(s_prof.lock);
+}
+
+bool card_profile_known(void) {
+    return s_prof.found;
+}
+
+bool card_profile_get(card_profile_t *profile) {
+    if (s_prof.lock == NULL || !s_prof.attached) {
+        return false;
+    }
+    xSemaphoreTake(s_prof.lock, portMAX_DELAY);
+    *profile = s_prof.cur;
+    xSemaphoreGive(s_prof.lock);
+    return true;
+}
@@ -0,0 +1,101 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Per-card profile in NVS, keyed by the card's CID, enabled with
+ * CONFIG_EXAMPLE_CARD_PROFILE. It keeps what probing a card found out: the
+ * clock it negotiated and under which ceiling, its allocation unit, a baseline
+ * sequential read rate, its error history over all boots and the geometry of
+ * its FAT volume.
+ *
+ * A card seen before skips the clock negotiation and its self-test reads and
+ * starts at the stored clock; its info and file listing are not printed again.
+ * A low priority task then re-validates the profile in the background,
+ * through the SD worker and only while the host leaves the card alone:
+ * - the volume geometry is parsed again, a changed one is logged and stored;
+ * - the sequential read rate is measured. Below
+ *   CONFIG_EXAMPLE_CARD_PROFILE_SLOW_PCT percent of the baseline the card is
+ *   flagged as degraded in the log and on the display;
+ * - card errors are added to the history as they happen. Should error
+ *   recovery lower the clock, the stored one is dropped and the next boot
+ *   negotiates again.
+ * The profiles of the CARD_PROFILE_MAX cards seen last are kept.
+ *
+ * Without CONFIG_EXAMPLE_CARD_PROFILE every card is probed in full.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "sdmmc_cmd.h"
+
+#include "fat_geometry.h"
+
+#define CARD_PROFILE_MAX 8
+
+typedef struct {
+    uint32_t version;
+    sdmmc_cid_t cid;
+    uint32_t seq;                // attach order, the oldest profile goes first
+    uint32_t inits;              // card initializations seen
+    uint32_t max_freq_khz;       // ceiling the clock was negotiated under
+    uint32_t freq_khz;           // negotiated clock, 0 to negotiate again
+    uint32_t au_sectors;         // allocation unit
+    uint32_t baseline_kbps;      // sequential read, 0 until measured
+    uint32_t baseline_freq_khz;  // clock the baseline was measured at
+    uint32_t last_kbps;          // at the last validation
+    uint32_t errors;             // failed card commands, all boots
+    uint32_t reinits;            // re-inits after errors, all boots
+    uint32_t slow;               // validations below the baseline threshold
+    fat_geometry_t fat;          // fs_type 0 if no volume was found
+} card_profile_t;
+
+#if CONFIG_EXAMPLE_CARD_PROFILE
+
+// Open the store and start the validation task. After nvs_flash_init().
+esp_err_t card_profile_init(void);
+
+// Clock a known card negotiated under the same ceiling before, to be used
+// without negotiating; 0 for an unknown card or an untrusted clock
+int card_profile_freq_khz(const sdmmc_card_t *card, int max_freq_khz);
+
+// The card was initialized and clocked under max_freq_khz: load its profile
+// or start a new one, record the clock in use and have the profile validated
+// in the background
+void card_profile_attach(const sdmmc_card_t *card, int max_freq_khz);
+
+// The attached card had a profile
+bool card_profile_known(void);
+
+// Copy of the profile of the attached card. False if none is attached.
+bool card_profile_get(card_profile_t *profile);
+
+#else
+
+static inline esp_err_t card_profile_init(void) {
+    return ESP_OK;
+}
+
+static inline int card_profile_freq_khz(const sdmmc_card_t *card,
+                                        int max_freq_khz) {
+    return 0;
+}
+
+static inline void card_profile_attach(const sdmmc_card_t *card,
+                                       int max_freq_khz) {}
+
+static inline bool card_profile_known(void) {
+    return false;
+}
+
+static inline bool card_profile_get(card_profile_t *profile) {
+    return false;
+}
+
+#endif  // CONFIG_EXAMPLE_CARD_PROFILE
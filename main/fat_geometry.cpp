@@ -0,0 +1,103 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <string.h>
+#include "esp_check.h"
+
+#include "fat_geometry.h"
+#include "msc_pipeline.h"
+
+static const char *TAG = "fat_geometry";
+
+static inline uint16_t le16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool is_exfat(const uint8_t *s) {
+    return memcmp(s + 3, "EXFAT   ", 8) == 0;
+}
+
+// FAT or exFAT boot sector, as opposed to an MBR
+static bool is_volume(const uint8_t *s) {
+    if (le16(s + 510) != 0xAA55 || (s[0] != 0xEB && s[0] != 0xE9)) {
+        return false;
+    }
+    return is_exfat(s) || (le16(s + 11) == 512 && s[13] != 0);
+}
+
+static esp_err_t parse_exfat(const uint8_t *s, fat_geometry_t *geo) {
+    ESP_RETURN_ON_FALSE(s[108] == 9 && s[109] <= 16, ESP_ERR_NOT_SUPPORTED,
+                        TAG, "exFAT with %d byte sectors", 1 << s[108]);
+    const uint32_t vol   = geo->volume_lba;
+    const uint32_t root  = le32(s + 96);
+    geo->fs_type         = FS_EXFAT;
+    geo->nfats           = s[110];
+    geo->percent_in_use  = s[112] <= 100 ? s[112] : 0xFF;
+    geo->fat_lba         = vol + le32(s + 80);
+    geo->fat_sectors     = le32(s + 84);
+    geo->data_lba        = vol + le32(s + 88);
+    geo->cluster_sectors = 1UL << s[109];
+    geo->clusters        = le32(s + 92);
+    geo->root_lba        = geo->data_lba + (root - 2) * geo->cluster_sectors;
+    geo->root_sectors    = geo->cluster_sectors;
+    geo->serial          = le32(s + 100);
+    return ESP_OK;
+}
+
+static esp_err_t parse_fat(const uint8_t *s, fat_geometry_t *geo) {
+    const uint32_t vol   = geo->volume_lba;
+    const uint32_t rsvd  = le16(s + 14);
+    const uint32_t roots = (le16(s + 17) * 32 + 511) / 512;
+    uint32_t sectors     = le16(s + 19) ? le16(s + 19) : le32(s + 32);
+    uint32_t fatsz       = le16(s + 22) ? le16(s + 22) : le32(s + 36);
+    geo->nfats           = s[16];
+    geo->cluster_sectors = s[13];
+    geo->fat_lba         = vol + rsvd;
+    geo->fat_sectors     = fatsz;
+    geo->root_lba        = geo->fat_lba + geo->nfats * fatsz;
+    geo->data_lba        = geo->root_lba + roots;
+
+    const uint32_t meta = geo->data_lba - vol;
+    ESP_RETURN_ON_FALSE(sectors > meta, ESP_ERR_INVALID_SIZE, TAG,
+                        "inconsistent BPB");
+    geo->clusters = (sectors - meta) / geo->cluster_sectors;
+
+    if (le16(s + 22) == 0) {
+        // FAT32: the root directory is a cluster chain starting at offset 44
+        const uint32_t root = le32(s + 44) - 2;
+        geo->fs_type        = FS_FAT32;
+        geo->root_lba       = geo->data_lba + root * geo->cluster_sectors;
+        geo->root_sectors   = geo->cluster_sectors;
+        geo->fsinfo_lba     = le16(s + 48) ? vol + le16(s + 48) : 0;
+        geo->serial         = le32(s + 67);
+    } else {
+        geo->fs_type      = geo->clusters < 4085 ? FS_FAT12 : FS_FAT16;
+        geo->root_sectors = roots;
+        geo->serial       = le32(s + 39);
+    }
+    return ESP_OK;
+}
+
+esp_err_t fat_geometry_read(uint8_t *sector, fat_geometry_t *geo) {
+    memset(geo, 0, sizeof(*geo));
+    geo->percent_in_use = 0xFF;
+    ESP_RETURN_ON_ERROR(msc_pipeline_read(0, sector, 1), TAG,
+                        "could not read sector 0");
+    if (!is_volume(sector)) {
+        // MBR, use the first partition
+        geo->volume_lba = le32(sector + 446 + 8);
+        ESP_RETURN_ON_ERROR(msc_pipeline_read(geo->volume_lba, sector, 1),
+                            TAG, "could not read the boot sector");
+        ESP_RETURN_ON_FALSE(is_volume(sector), ESP_ERR_NOT_FOUND, TAG,
+                            "no FAT volume found");
+    }
+    return is_exfat(sector) ? parse_exfat(sector, geo)
+                            : parse_fat(sector, geo);
+}
@@ -0,0 +1,39 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Layout of the FAT or exFAT volume on the card, parsed straight from the
+ * boot sector through the SD worker, so it works while the host owns the
+ * medium and without FatFs. A card with an MBR is looked at in its first
+ * partition. All LBAs are absolute card sectors of 512 bytes.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "ff.h"
+
+typedef struct {
+    uint8_t fs_type;         // FS_FAT12, FS_FAT16, FS_FAT32 or FS_EXFAT
+    uint8_t nfats;           // copies of the FAT
+    uint8_t percent_in_use;  // exFAT only, 0xFF if unknown
+    uint32_t volume_lba;     // boot sector
+    uint32_t fat_lba;        // first FAT
+    uint32_t fat_sectors;    // per FAT
+    uint32_t root_lba;       // root directory: fixed area, or first cluster
+    uint32_t root_sectors;
+    uint32_t data_lba;  // cluster 2
+    uint32_t cluster_sectors;
+    uint32_t clusters;
+    uint32_t fsinfo_lba;  // FAT32 FSINFO sector, 0 for none
+    uint32_t serial;      // volume serial number
+} fat_geometry_t;
+
+// Parse the volume on the card. `sector` is a word aligned 512 byte buffer
+// for the reads, left holding the boot sector. ESP_ERR_NOT_FOUND without a
+// FAT or exFAT volume.
+esp_err_t fat_geometry_read(uint8_t *sector, fat_geometry_t *geo);
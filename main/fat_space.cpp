@@ -0,0 +1,341 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "nvs.h"
+
+#include "M5Unified.h"
+
+#include "fat_geometry.h"
+#include "fat_space.h"
+#include "msc_config.h"
+#include "msc_pipeline.h"
+#include "msc_pool.h"
+#include "msc_stats.h"
+#include "msc_storage.h"
+#include "status_display.h"
+#include "task_layout.h"
+
+#define FAT_SPACE_TASK_CORE       TASK_LAYOUT_UI_CORE
+#define FAT_SPACE_TASK_PRIORITY   TASK_LAYOUT_SPACE_PRIORITY
+#define FAT_SPACE_TASK_STACK_SIZE 3072
+#define FAT_SPACE_POLL_MS         1000
+
+#define NVS_NAMESPACE "msc"
+#define NVS_KEY_FREE  "fs_free"
+
+static const char *TAG = "fat_space";
+
+// Result of the last full FAT scan, stored in NVS
+typedef struct {
+    uint32_t serial;
+    uint32_t n_fatent;  // clusters + 2, as FatFs counts them
+    uint32_t free_clst;
+} fat_space_cache_t;
+
+typedef struct {
+    nvs_handle_t nvs;
+    uint64_t total_bytes;
+    uint64_t free_bytes;
+} fat_space_t;
+
+// Free clusters counted so far by a scan of the FAT or exFAT bitmap
+typedef struct {
+    uint8_t fs_type;
+    uint32_t entry;      // FAT entry or cluster the next one counted is for
+    uint32_t end;        // first entry past the last cluster
+    uint32_t free_clst;
+    uint8_t fat12[3];    // FAT12 packs two entries into three bytes
+    uint32_t fat12_len;
+} fat_scan_t;
+
+static fat_space_t s_space;
+
+// Word aligned so the card reads straight into it
+static WORD_ALIGNED_ATTR uint8_t s_sector[512];
+
+static void show(const char *free, const char *total) {
+    display_set_text(DISPLAY_FIELD_FREE, free, GREEN);
+    display_set_text(DISPLAY_FIELD_TOTAL, total, 0x4e7f);
+}
+
+static inline uint16_t le16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t host_writes(void) {
+    // msc_stats_t is large, keep the snapshot off the stack
+    static msc_stats_t stats;
+    msc_stats_get(&stats);
+    return stats.write_chunks;
+}
+
+static inline void scan_entry(fat_scan_t *scan, bool free) {
+    if (free && scan->entry >= 2 && scan->entry < scan->end) {
+        scan->free_clst++;
+    }
+    scan->entry++;
+}
+
+static void scan_bytes(fat_scan_t *scan, const uint8_t *p, uint32_t len) {
+    switch (scan->fs_type) {
+        case FS_FAT12:
+            for (uint32_t i = 0; i < len; i++) {
+                scan->fat12[scan->fat12_len++] = p[i];
+                if (scan->fat12_len == 3) {
+                    const uint8_t *b = scan->fat12;
+                    scan_entry(scan, (b[0] | (b[1] & 0x0F) << 8) == 0);
+                    scan_entry(scan, (b[1] >> 4 | b[2] << 4) == 0);
+                    scan->fat12_len = 0;
+                }
+            }
+            break;
+        case FS_FAT16:
+            for (uint32_t i = 0; i < len; i += 2) {
+                scan_entry(scan, le16(p + i) == 0);
+            }
+            break;
+        case FS_FAT32:
+            for (uint32_t i = 0; i < len; i += 4) {
+                scan_entry(scan, (le32(p + i) & 0x0FFFFFFF) == 0);
+            }
+            break;
+        default:
+            // exFAT allocation bitmap, a set bit per cluster in use
+            for (uint32_t i = 0; i < len; i++) {
+                for (int bit = 0; bit < 8; bit++) {
+                    scan_entry(scan, !(p[i] & (1 << bit)));
+                }
+            }
+            break;
+    }
+}
+
+// First sector of the exFAT allocation bitmap, taken from its entry in the
+// root directory. FatFs too expects the bitmap to be contiguous.
+static esp_err_t find_bitmap(const fat_geometry_t *geo, uint8_t *buf,
+                             uint32_t *lba) {
+    for (uint32_t s = 0; s < geo->root_sectors; s++) {
+        ESP_RETURN_ON_ERROR(msc_pipeline_read(geo->root_lba + s, buf, 1), TAG,
+                            "could not read the root directory");
+        for (uint32_t off = 0; off < 512; off += 32) {
+            if (buf[off] == 0x81) {
+                uint32_t clst = le32(buf + off + 20);
+                ESP_RETURN_ON_FALSE(clst >= 2 && clst - 2 < geo->clusters,
+                                    ESP_ERR_INVALID_RESPONSE, TAG,
+                                    "bad allocation bitmap cluster");
+                *lba = geo->data_lba + (clst - 2) * geo->cluster_sectors;
+                return ESP_OK;
+            }
+            if (buf[off] == 0x00) {
+                // end of the directory
+                return ESP_ERR_NOT_FOUND;
+            }
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+/* Count the free clusters straight off the card, through the SD worker and
+ * read-only, so the host is served as usual meanwhile. A host write makes the
+ * count stale: the scan stops with ESP_ERR_INVALID_STATE. */
+static esp_err_t scan(const fat_geometry_t *geo, uint32_t *free_clst) {
+    uint8_t *buf = (uint8_t *)msc_pool_alloc(MSC_XFER_SIZE);
+    if (!buf) {
+        // the spare blocks are in use by someone else, try again later
+        return ESP_ERR_NO_MEM;
+    }
+    fat_scan_t scan = {
+        .fs_type = geo->fs_type,
+        .end     = geo->clusters + 2,
+    };
+    const uint32_t writes = host_writes();
+    uint32_t lba          = geo->fat_lba;
+    uint64_t bytes;
+    esp_err_t ret = ESP_OK;
+    switch (geo->fs_type) {
+        case FS_FAT12:
+            bytes = ((uint64_t)scan.end * 3 + 1) / 2;
+            break;
+        case FS_FAT16:
+            bytes = (uint64_t)scan.end * 2;
+            break;
+        case FS_FAT32:
+            bytes = (uint64_t)scan.end * 4;
+            break;
+        default:
+            // the bitmap starts at cluster 2
+            scan.entry = 2;
+            bytes      = (geo->clusters + 7) / 8;
+            ESP_GOTO_ON_ERROR(find_bitmap(geo, buf, &lba), out, TAG,
+                              "no allocation bitmap");
+            break;
+    }
+
+    for (uint32_t left = (bytes + 511) / 512; left > 0;) {
+        if (host_writes() != writes) {
+            ESP_LOGI(TAG, "host writes, scan stopped");
+            ret = ESP_ERR_INVALID_STATE;
+            goto out;
+        }
+        uint32_t n = left < MSC_XFER_SECTORS ? left : MSC_XFER_SECTORS;
+        ESP_GOTO_ON_ERROR(msc_pipeline_read(lba, buf, n), out, TAG,
+                          "could not read lba=%lu", lba);
+        scan_bytes(&scan, buf, n * 512);
+        lba  += n;
+        left -= n;
+    }
+    *free_clst = scan.free_clst;
+out:
+    msc_pool_free(buf);
+    return ret;
+}
+
+/* Take the free space from what the volume itself keeps, unless the host
+ * wrote since: exFAT's percent in use in the boot sector, FAT32's FSINFO. Then
+ * from the last scan stored in NVS for the same volume. Only failing both is
+ * the FAT scanned. ESP_ERR_INVALID_STATE or ESP_ERR_NO_MEM to be retried. */
+static esp_err_t compute(bool host_wrote, bool *free_known) {
+    fat_geometry_t geo;
+    ESP_RETURN_ON_ERROR(fat_geometry_read(s_sector, &geo), TAG,
+                        "could not parse the volume");
+    const uint64_t clst_bytes = (uint64_t)geo.cluster_sectors * 512;
+    s_space.total_bytes       = geo.clusters * clst_bytes;
+
+    char total[30];
+    sprintf(total, "T: %.1fMB", s_space.total_bytes / 1024.0 / 1024.0);
+    show("F: --", total);
+
+    *free_known = false;
+    if (!host_wrote && geo.fs_type == FS_EXFAT && geo.percent_in_use <= 100) {
+        s_space.free_bytes =
+            s_space.total_bytes * (100 - geo.percent_in_use) / 100;
+        *free_known = true;
+        return ESP_OK;
+    }
+    if (!host_wrote && geo.fsinfo_lba != 0) {
+        ESP_RETURN_ON_ERROR(msc_pipeline_read(geo.fsinfo_lba, s_sector, 1),
+                            TAG, "could not read FSINFO");
+        uint32_t free_clst = le32(s_sector + 488);
+        if (le32(s_sector) == 0x41615252 &&
+            le32(s_sector + 484) == 0x61417272 && free_clst <= geo.clusters) {
+            s_space.free_bytes = free_clst * clst_bytes;
+            *free_known        = true;
+            return ESP_OK;
+        }
+    }
+
+    fat_space_cache_t cache;
+    size_t len = sizeof(cache);
+    if (!host_wrote &&
+        nvs_get_blob(s_space.nvs, NVS_KEY_FREE, &cache, &len) == ESP_OK &&
+        len == sizeof(cache) && cache.serial == geo.serial &&
+        cache.n_fatent == geo.clusters + 2 && cache.free_clst <= geo.clusters) {
+        ESP_LOGI(TAG, "free space of volume %08lx from NVS", geo.serial);
+        s_space.free_bytes = cache.free_clst * clst_bytes;
+        *free_known        = true;
+        return ESP_OK;
+    }
+
+    ESP_LOGI(TAG, "scanning the FAT of volume %08lx", geo.serial);
+    uint32_t free_clst;
+    esp_err_t err = scan(&geo, &free_clst);
+    if (err == ESP_ERR_INVALID_STATE || err == ESP_ERR_NO_MEM) {
+        return err;
+    }
+    if (err != ESP_OK) {
+        // a card error: leave the free space unknown
+        return ESP_OK;
+    }
+    s_space.free_bytes = free_clst * clst_bytes;
+    *free_known        = true;
+
+    cache = {
+        .serial    = geo.serial,
+        .n_fatent  = geo.clusters + 2,
+        .free_clst = free_clst,
+    };
+    if (nvs_set_blob(s_space.nvs, NVS_KEY_FREE, &cache, sizeof(cache)) ==
+        ESP_OK) {
+        nvs_commit(s_space.nvs);
+    }
+    return ESP_OK;
+}
+
+static void fat_space_task(void *arg) {
+    (void)arg;
+    uint32_t done_gen    = 0;
+    uint32_t last_writes = 0;
+    bool stale           = false;  // the host wrote since the last count
+
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(FAT_SPACE_POLL_MS));
+
+        uint32_t writes = host_writes();
+        if (writes != last_writes) {
+            // the host changed the volume, the count is not current anymore.
+            // Wait for it to go quiet before looking again.
+            last_writes = writes;
+            stale       = true;
+            show("F: --", "T: --");
+            continue;
+        }
+
+        uint32_t gen = msc_storage_volume_generation();
+        if (gen == 0 || (gen == done_gen && !stale)) {
+            continue;
+        }
+        if (gen != done_gen && stale) {
+            // the host let go of the volume it wrote to: the volume's own
+            // summaries are up to date again, the count in NVS is not
+            if (nvs_erase_key(s_space.nvs, NVS_KEY_FREE) == ESP_OK) {
+                nvs_commit(s_space.nvs);
+            }
+            stale = false;
+        }
+        bool free_known;
+        if (compute(stale, &free_known) != ESP_OK) {
+            continue;
+        }
+        done_gen = gen;
+        stale    = false;
+
+        char free[30];
+        char total[30];
+        float free_mb  = s_space.free_bytes / 1024.0 / 1024.0;
+        float total_mb = s_space.total_bytes / 1024.0 / 1024.0;
+        if (free_known) {
+            sprintf(free, "F: %.1fMB", free_mb);
+        } else {
+            strcpy(free, "F: --");
+        }
+        sprintf(total, "T: %.1fMB", total_mb);
+        ESP_LOGI(TAG, "%s %s", free, total);
+        show(free, total);
+    }
+}
+
+esp_err_t fat_space_init(void) {
+    ESP_RETURN_ON_ERROR(nvs_open(NVS_NAMESPACE, NVS_READWRITE, &s_space.nvs),
+                        TAG, "could not open NVS");
+
+    BaseType_t ok = xTaskCreatePinnedToCore(
+        fat_space_task, "fat_space", FAT_SPACE_TASK_STACK_SIZE, NULL,
+        FAT_SPACE_TASK_PRIORITY, NULL, FAT_SPACE_TASK_CORE);
+    ESP_RETURN_ON_FALSE(ok == pdPASS, ESP_ERR_NO_MEM, TAG,
+                        "could not create free space task");
+    return ESP_OK;
+}
@@ -0,0 +1,28 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Lazy free/total space of the FAT or exFAT volume for the display. A low
+ * priority task computes it whenever the volume is (re)mounted in the
+ * application, or in raw passthrough mode the card attached, and again after
+ * the host has stopped writing; it shows "--" meanwhile. The volume is parsed
+ * straight off the card, read-only and through the SD worker, so the host is
+ * never kept waiting for it.
+ *
+ * The total comes from the boot sector. The free count is taken from exFAT's
+ * percent in use or FAT32's FSINFO; otherwise from the last full scan stored
+ * in NVS for the same volume serial; only failing both is the FAT, or the
+ * exFAT allocation bitmap, scanned in MSC_XFER_SIZE reads. A host write stops
+ * a scan and makes the volume's own summaries untrusted until the host lets
+ * go of the volume, which also drops the stored count.
+ */
+
+#pragma once
+
+#include "esp_err.h"
+
+// Start the task. nvs_flash_init() must have been called.
+esp_err_t fat_space_init(void);
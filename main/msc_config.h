@@ -0,0 +1,49 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Transfer sizing, in one place for the USB descriptor, TinyUSB's MSC buffer
+ * and the storage path:
+ * - MSC_EP_SIZE: bulk endpoint size, fixed by the bus speed of the PHY.
+ * - MSC_XFER_SIZE: bytes per READ(10)/WRITE(10) chunk. TinyUSB calls the MSC
+ *   callbacks once per chunk, not per packet, and every chunk is one card
+ *   command. It is a whole number of packets and of sectors.
+ * - MSC_ALLOC_UNIT_SIZE: FAT cluster size when the application formats the
+ *   card, a whole number of chunks so that cluster aligned host I/O is
+ *   chunk aligned on the card.
+ */
+
+#pragma once
+
+#include "tusb.h"
+
+#define MSC_SECTOR_SIZE     512
+#define MSC_EP_SIZE         (TUD_OPT_HIGH_SPEED ? 512 : 64)
+#define MSC_XFER_SIZE       CONFIG_EXAMPLE_MSC_XFER_BUF_SIZE
+#define MSC_XFER_SECTORS    (MSC_XFER_SIZE / MSC_SECTOR_SIZE)
+#define MSC_ALLOC_UNIT_SIZE (16 * 1024)
+
+#ifdef CONFIG_EXAMPLE_USB_EXTERNAL_PHY
+#define MSC_EXTERNAL_PHY true
+#else
+#define MSC_EXTERNAL_PHY false
+#endif
+
+#if MSC_XFER_SIZE % MSC_SECTOR_SIZE != 0
+#error "CONFIG_EXAMPLE_MSC_XFER_BUF_SIZE must be a multiple of 512"
+#endif
+
+#if MSC_XFER_SIZE % MSC_EP_SIZE != 0
+#error "CONFIG_EXAMPLE_MSC_XFER_BUF_SIZE must be a multiple of the endpoint size"
+#endif
+
+#if CONFIG_TINYUSB_MSC_BUFSIZE != MSC_XFER_SIZE
+#error "CONFIG_TINYUSB_MSC_BUFSIZE must match CONFIG_EXAMPLE_MSC_XFER_BUF_SIZE"
+#endif
+
+#if MSC_ALLOC_UNIT_SIZE % MSC_XFER_SIZE != 0
+#error "CONFIG_EXAMPLE_MSC_XFER_BUF_SIZE must divide the 16 KB allocation unit"
+#endif
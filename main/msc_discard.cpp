@@ -0,0 +1,93 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include "esp_check.h"
+#include "esp_log.h"
+
+#include "msc_config.h"
+#include "msc_discard.h"
+#include "msc_pipeline.h"
+#include "sd_card.h"
+
+static const char *TAG = "msc_discard";
+
+typedef struct {
+    uint32_t au_sectors;
+    uint32_t start;  // remembered partial range [start, end)
+    uint32_t end;
+    msc_discard_stats_t stats;
+} msc_discard_t;
+
+static msc_discard_t s_discard;
+
+static void forget_pending(void) {
+    s_discard.stats.dropped += s_discard.end - s_discard.start;
+    s_discard.start = s_discard.end = 0;
+}
+
+esp_err_t msc_discard_init(sdmmc_card_t *card) {
+    s_discard.au_sectors       = sd_card_au_sectors(card);
+    s_discard.stats.au_sectors = s_discard.au_sectors;
+    s_discard.start = s_discard.end = 0;
+    ESP_LOGI(TAG, "erase unit %lu KB, %s",
+             s_discard.au_sectors * MSC_SECTOR_SIZE / 1024,
+             sdmmc_can_discard(card) == ESP_OK ? "discard" : "erase");
+    return ESP_OK;
+}
+
+esp_err_t msc_discard_range(uint32_t lba, uint32_t count) {
+    if (count == 0) {
+        return ESP_OK;
+    }
+    s_discard.stats.ranges++;
+    s_discard.stats.requested += count;
+
+    uint32_t start = lba;
+    uint32_t end   = lba + count;
+    if (s_discard.start < s_discard.end && start <= s_discard.end &&
+        end >= s_discard.start) {
+        // touches the remembered range: discard both as one
+        start           = start < s_discard.start ? start : s_discard.start;
+        end             = end > s_discard.end ? end : s_discard.end;
+        s_discard.start = s_discard.end = 0;
+    } else {
+        forget_pending();
+    }
+
+    const uint32_t au    = s_discard.au_sectors;
+    const uint32_t first = (start + au - 1) / au * au;
+    const uint32_t last  = end / au * au;
+    if (first >= last) {
+        s_discard.start = start;
+        s_discard.end   = end;
+        return ESP_OK;
+    }
+
+    ESP_RETURN_ON_ERROR(msc_pipeline_erase(first, last - first), TAG,
+                        "discard lba=%lu count=%lu failed", first,
+                        last - first);
+    s_discard.stats.erases++;
+    s_discard.stats.erased += last - first;
+    // ranges are mostly freed in ascending order: keep the tail
+    s_discard.stats.dropped += first - start;
+    s_discard.start = last;
+    s_discard.end   = end;
+    return ESP_OK;
+}
+
+void msc_discard_written(uint32_t lba, uint32_t count) {
+    if (lba < s_discard.end && lba + count > s_discard.start) {
+        forget_pending();
+    }
+}
+
+void msc_discard_reset(void) {
+    forget_pending();
+}
+
+void msc_discard_get_stats(msc_discard_stats_t *stats) {
+    *stats = s_discard.stats;
+}
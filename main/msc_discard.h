@@ -0,0 +1,71 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Host discards (UNMAP, WRITE SAME with UNMAP) passed on to the SD card's
+ * flash translation layer, enabled with CONFIG_EXAMPLE_MSC_UNMAP. Erase units
+ * (the card's allocation unit from the SD Status register) that a discard
+ * covers completely are erased, with DISCARD where the card supports it.
+ * The unaligned tail of a range is remembered and merged with the next
+ * adjacent discard, so a file freed in several small ranges still gets its
+ * erase units erased; a write into the remembered range forgets it.
+ *
+ * Without CONFIG_EXAMPLE_MSC_UNMAP the functions below are no-ops.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "sdmmc_cmd.h"
+
+typedef struct {
+    uint32_t au_sectors;  // erase unit used for batching
+    uint32_t ranges;      // ranges discarded by the host
+    uint32_t requested;   // sectors discarded by the host
+    uint32_t erases;      // erase commands sent to the card
+    uint32_t erased;      // sectors erased on the card
+    uint32_t dropped;     // sectors never erased: partial units, overwritten
+} msc_discard_stats_t;
+
+#if CONFIG_EXAMPLE_MSC_UNMAP
+
+// Take the erase unit size from the card
+esp_err_t msc_discard_init(sdmmc_card_t *card);
+
+// Hand `count` sectors at `lba` to the card as unused. Called with the host
+// I/O drained; whole erase units are erased before this returns.
+esp_err_t msc_discard_range(uint32_t lba, uint32_t count);
+
+// A write to `count` sectors at `lba` is about to be queued
+void msc_discard_written(uint32_t lba, uint32_t count);
+
+// Forget the remembered range, before anyone but the host writes the card
+void msc_discard_reset(void);
+
+void msc_discard_get_stats(msc_discard_stats_t *stats);
+
+#else
+
+static inline esp_err_t msc_discard_init(sdmmc_card_t *card) {
+    return ESP_OK;
+}
+
+static inline esp_err_t msc_discard_range(uint32_t lba, uint32_t count) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static inline void msc_discard_written(uint32_t lba, uint32_t count) {}
+
+static inline void msc_discard_reset(void) {}
+
+static inline void msc_discard_get_stats(msc_discard_stats_t *stats) {
+    *stats = {};
+}
+
+#endif  // CONFIG_EXAMPLE_MSC_UNMAP
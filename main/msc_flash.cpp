@@ -0,0 +1,193 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <string.h>
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "wear_levelling.h"
+
+#include "msc_config.h"
+#include "msc_flash.h"
+#include "msc_pipeline.h"
+#include "msc_pool.h"
+#include "task_layout.h"
+
+#define FLASH_PARTITION_LABEL   "storage"
+#define FLASH_WORKER_CORE       TASK_LAYOUT_FLASH_CORE
+#define FLASH_WORKER_PRIORITY   TASK_LAYOUT_FLASH_PRIORITY
+#define FLASH_WORKER_STACK_SIZE 3072
+#define FLASH_QUEUE_LEN         2
+
+static const char *TAG = "msc_flash";
+
+typedef struct {
+    wl_handle_t wl;
+    uint32_t sector_size;
+    uint32_t sector_count;
+    QueueHandle_t jobs;            // msc_job_t * handed to the worker
+    msc_job_t write_job;           // owns the transfer buffer
+    SemaphoreHandle_t write_idle;  // given while write_job is not queued
+    SemaphoreHandle_t read_done;   // given by the worker when a read finished
+    esp_err_t write_err;
+    portMUX_TYPE lock;
+} msc_flash_t;
+
+static msc_flash_t s_flash = {
+    .wl   = WL_INVALID_HANDLE,
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static void flash_worker(void *arg) {
+    (void)arg;
+    msc_job_t *job;
+
+    while (1) {
+        xQueueReceive(s_flash.jobs, &job, portMAX_DELAY);
+        const size_t addr = job->lba * s_flash.sector_size;
+        const size_t size = job->count * s_flash.sector_size;
+        if (job->op == MSC_JOB_READ) {
+            job->result = wl_read(s_flash.wl, addr, job->data, size);
+        } else {
+            // in 512 byte sector mode this only touches the written sectors
+            job->result = wl_erase_range(s_flash.wl, addr, size);
+            if (job->result == ESP_OK) {
+                job->result = wl_write(s_flash.wl, addr, job->data, size);
+            }
+        }
+        job->complete(job);
+    }
+}
+
+static void read_complete(msc_job_t *job) {
+    (void)job;
+    xSemaphoreGive(s_flash.read_done);
+}
+
+static void write_complete(msc_job_t *job) {
+    if (job->result != ESP_OK) {
+        ESP_LOGE(TAG, "write lba=%lu count=%lu failed (0x%x)", job->lba,
+                 job->count, job->result);
+        portENTER_CRITICAL(&s_flash.lock);
+        if (s_flash.write_err == ESP_OK) {
+            s_flash.write_err = job->result;
+        }
+        portEXIT_CRITICAL(&s_flash.lock);
+    }
+    xSemaphoreGive(s_flash.write_idle);
+}
+
+esp_err_t msc_flash_init(void) {
+    const esp_partition_t *part = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_FAT,
+        FLASH_PARTITION_LABEL);
+    ESP_RETURN_ON_FALSE(part, ESP_ERR_NOT_FOUND, TAG,
+                        "no '" FLASH_PARTITION_LABEL "' partition");
+
+    wl_handle_t wl = WL_INVALID_HANDLE;
+    ESP_RETURN_ON_ERROR(wl_mount(part, &wl), TAG, "wl_mount failed");
+    s_flash.sector_size  = wl_sector_size(wl);
+    s_flash.sector_count = wl_size(wl) / s_flash.sector_size;
+    ESP_RETURN_ON_FALSE(s_flash.sector_size == MSC_SECTOR_SIZE,
+                        ESP_ERR_NOT_SUPPORTED, TAG,
+                        "unsupported sector size %lu, select "
+                        "CONFIG_WL_SECTOR_SIZE_512",
+                        s_flash.sector_size);
+
+    s_flash.jobs       = xQueueCreate(FLASH_QUEUE_LEN, sizeof(void *));
+    s_flash.write_idle = xSemaphoreCreateBinary();
+    s_flash.read_done  = xSemaphoreCreateBinary();
+    ESP_RETURN_ON_FALSE(s_flash.jobs && s_flash.write_idle &&
+                            s_flash.read_done,
+                        ESP_ERR_NO_MEM, TAG, "could not create flash queues");
+
+    s_flash.write_job.op       = MSC_JOB_WRITE;
+    s_flash.write_job.data     = (uint8_t *)msc_pool_alloc(MSC_XFER_SIZE);
+    s_flash.write_job.complete = write_complete;
+    ESP_RETURN_ON_FALSE(s_flash.write_job.data, ESP_ERR_NO_MEM, TAG,
+                        "could not allocate %u byte transfer buffer",
+                        MSC_XFER_SIZE);
+    xSemaphoreGive(s_flash.write_idle);
+
+    BaseType_t ok = xTaskCreatePinnedToCore(
+        flash_worker, "msc_flash", FLASH_WORKER_STACK_SIZE, NULL,
+        FLASH_WORKER_PRIORITY, NULL, FLASH_WORKER_CORE);
+    ESP_RETURN_ON_FALSE(ok == pdPASS, ESP_ERR_NO_MEM, TAG,
+                        "could not create flash worker task");
+
+    s_flash.wl = wl;
+    ESP_LOGI(TAG, "'%s' partition: %lu sectors of %lu bytes",
+             FLASH_PARTITION_LABEL, s_flash.sector_count,
+             s_flash.sector_size);
+    return ESP_OK;
+}
+
+bool msc_flash_present(void) {
+    return s_flash.wl != WL_INVALID_HANDLE;
+}
+
+uint32_t msc_flash_sector_size(void) {
+    return s_flash.sector_size;
+}
+
+uint32_t msc_flash_sector_count(void) {
+    return s_flash.sector_count;
+}
+
+esp_err_t msc_flash_read(uint32_t lba, uint8_t *dst, uint32_t count) {
+    ESP_RETURN_ON_FALSE(count <= MSC_XFER_SECTORS, ESP_ERR_INVALID_SIZE, TAG,
+                        "read of %lu sectors exceeds buffer", count);
+
+    // queued behind a pending write, so the read sees its data
+    msc_job_t job = {
+        .op       = MSC_JOB_READ,
+        .data     = dst,
+        .lba      = lba,
+        .count    = count,
+        .result   = ESP_OK,
+        .complete = read_complete,
+        .arg      = NULL,
+    };
+    msc_job_t *p = &job;
+    xQueueSend(s_flash.jobs, &p, portMAX_DELAY);
+    xSemaphoreTake(s_flash.read_done, portMAX_DELAY);
+    ESP_RETURN_ON_ERROR(job.result, TAG, "read lba=%lu count=%lu failed", lba,
+                        count);
+    return ESP_OK;
+}
+
+esp_err_t msc_flash_write(uint32_t lba, const uint8_t *src, uint32_t count) {
+    ESP_RETURN_ON_FALSE(count <= MSC_XFER_SECTORS, ESP_ERR_INVALID_SIZE, TAG,
+                        "write of %lu sectors exceeds buffer", count);
+
+    xSemaphoreTake(s_flash.write_idle, portMAX_DELAY);
+    msc_job_t *job = &s_flash.write_job;
+    memcpy(job->data, src, count * s_flash.sector_size);
+    job->lba   = lba;
+    job->count = count;
+    xQueueSend(s_flash.jobs, &job, portMAX_DELAY);
+    return ESP_OK;
+}
+
+void msc_flash_drain(void) {
+    if (!msc_flash_present()) {
+        return;
+    }
+    xSemaphoreTake(s_flash.write_idle, portMAX_DELAY);
+    xSemaphoreGive(s_flash.write_idle);
+}
+
+esp_err_t msc_flash_take_error(void) {
+    portENTER_CRITICAL(&s_flash.lock);
+    esp_err_t err     = s_flash.write_err;
+    s_flash.write_err = ESP_OK;
+    portEXIT_CRITICAL(&s_flash.lock);
+    return err;
+}
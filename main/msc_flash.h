@@ -0,0 +1,88 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Second MSC logical unit on the wear-levelled `storage` flash partition,
+ * enabled with CONFIG_EXAMPLE_MSC_FLASH_LUN. It has its own worker task and
+ * job queue, independent of the SD pipeline, so flash reads never wait behind
+ * queued card writes. Like the SD pipeline, a write returns once the data is
+ * copied into the transfer buffer and a failure is reported later through
+ * msc_flash_take_error().
+ *
+ * The partition is exposed raw to the host and never mounted in the
+ * application. Note that erasing or programming flash suspends the cache on
+ * both cores, which stalls everything not running from IRAM, the SD worker
+ * included.
+ *
+ * Without CONFIG_EXAMPLE_MSC_FLASH_LUN the functions below are stubs.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+#if CONFIG_EXAMPLE_MSC_FLASH_LUN
+
+// Mount wear levelling on the `storage` partition and start the flash worker
+esp_err_t msc_flash_init(void);
+
+// true once msc_flash_init() succeeded
+bool msc_flash_present(void);
+
+uint32_t msc_flash_sector_size(void);
+uint32_t msc_flash_sector_count(void);
+
+// Read `count` sectors at `lba` into dst and wait for the data
+esp_err_t msc_flash_read(uint32_t lba, uint8_t *dst, uint32_t count);
+
+// Queue `count` sectors from src for writing at `lba`. Returns once src has
+// been copied into the transfer buffer.
+esp_err_t msc_flash_write(uint32_t lba, const uint8_t *src, uint32_t count);
+
+// Wait until the queued write reached the flash
+void msc_flash_drain(void);
+
+// Return and clear the first write error since the last call
+esp_err_t msc_flash_take_error(void);
+
+#else
+
+static inline esp_err_t msc_flash_init(void) {
+    return ESP_OK;
+}
+
+static inline bool msc_flash_present(void) {
+    return false;
+}
+
+static inline uint32_t msc_flash_sector_size(void) {
+    return 0;
+}
+
+static inline uint32_t msc_flash_sector_count(void) {
+    return 0;
+}
+
+static inline esp_err_t msc_flash_read(uint32_t lba, uint8_t *dst,
+                                       uint32_t count) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static inline esp_err_t msc_flash_write(uint32_t lba, const uint8_t *src,
+                                        uint32_t count) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static inline void msc_flash_drain(void) {}
+
+static inline esp_err_t msc_flash_take_error(void) {
+    return ESP_OK;
+}
+
+#endif  // CONFIG_EXAMPLE_MSC_FLASH_LUN
@@ -0,0 +1,197 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_check.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include "fat_geometry.h"
+#include "msc_config.h"
+#include "msc_metacache.h"
+
+#define METACACHE_SECTORS CONFIG_EXAMPLE_MSC_METACACHE_SECTORS
+#define METACACHE_REGIONS 3  // MBR, boot sector to data, root directory
+#define METACACHE_CAPS    (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+
+static const char *TAG = "msc_metacache";
+
+typedef struct {
+    uint32_t lba;
+    uint32_t end;
+} meta_region_t;
+
+typedef struct {
+    uint32_t lba;
+    uint32_t used;  // clock of the last access, 0 for a free slot
+} meta_slot_t;
+
+/* Slots are looked up linearly: a few dozen compares per sector cost
+ * nothing next to a card read. Only the TinyUSB task touches the slots;
+ * msc_metacache_invalidate() just marks them stale. */
+typedef struct {
+    uint8_t *data;  // one sector per slot
+    meta_slot_t *slots;
+    uint32_t nslots;
+    meta_region_t regions[METACACHE_REGIONS];
+    int nregions;
+    uint32_t clock;
+    volatile bool stale;  // drop the slots and parse the BPB again
+    msc_metacache_stats_t stats;
+} msc_metacache_t;
+
+static msc_metacache_t s_mc;
+
+static void add_region(uint32_t lba, uint32_t end) {
+    if (end > lba && s_mc.nregions < METACACHE_REGIONS) {
+        s_mc.regions[s_mc.nregions++] = {.lba = lba, .end = end};
+        s_mc.stats.pinned += end - lba;
+    }
+}
+
+// Find the metadata regions, with the first slot as the sector buffer
+static void load(void) {
+    memset(s_mc.slots, 0, s_mc.nslots * sizeof(meta_slot_t));
+    s_mc.nregions     = 0;
+    s_mc.stats.pinned = 0;
+    s_mc.stale        = false;
+
+    fat_geometry_t geo;
+    if (fat_geometry_read(s_mc.data, &geo) != ESP_OK) {
+        ESP_LOGW(TAG, "no FAT volume, nothing cached");
+        return;
+    }
+    if (geo.volume_lba != 0) {
+        add_region(0, 1);  // MBR
+    }
+    add_region(geo.volume_lba, geo.data_lba);
+    if (geo.fs_type == FS_FAT32 || geo.fs_type == FS_EXFAT) {
+        add_region(geo.root_lba, geo.root_lba + geo.root_sectors);
+    }
+    ESP_LOGI(TAG, "%lu metadata sectors, %lu cached at most",
+             s_mc.stats.pinned, s_mc.nslots);
+}
+
+static bool is_metadata(uint32_t lba) {
+    for (int i = 0; i < s_mc.nregions; i++) {
+        if (lba >= s_mc.regions[i].lba && lba < s_mc.regions[i].end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool overlaps_metadata(uint32_t lba, uint32_t count) {
+    for (int i = 0; i < s_mc.nregions; i++) {
+        if (lba < s_mc.regions[i].end && lba + count > s_mc.regions[i].lba) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static meta_slot_t *find(uint32_t lba) {
+    for (uint32_t i = 0; i < s_mc.nslots; i++) {
+        if (s_mc.slots[i].used && s_mc.slots[i].lba == lba) {
+            return &s_mc.slots[i];
+        }
+    }
+    return NULL;
+}
+
+// A free slot, else the least recently used one
+static meta_slot_t *victim(void) {
+    meta_slot_t *lru = &s_mc.slots[0];
+    for (uint32_t i = 0; i < s_mc.nslots && lru->used; i++) {
+        if (s_mc.slots[i].used < lru->used) {
+            lru = &s_mc.slots[i];
+        }
+    }
+    return lru;
+}
+
+static uint8_t *slot_data(const meta_slot_t *slot) {
+    return s_mc.data + (slot - s_mc.slots) * MSC_SECTOR_SIZE;
+}
+
+static void touch(meta_slot_t *slot) {
+    if (++s_mc.clock == 0) {
+        s_mc.clock = 1;  // 0 marks a free slot
+    }
+    slot->used = s_mc.clock;
+}
+
+esp_err_t msc_metacache_init(void) {
+    if (METACACHE_SECTORS == 0) {
+        ESP_LOGI(TAG, "metadata cache disabled");
+        return ESP_OK;
+    }
+    s_mc.data  = (uint8_t *)heap_caps_malloc(
+        METACACHE_SECTORS * MSC_SECTOR_SIZE, METACACHE_CAPS);
+    s_mc.slots = (meta_slot_t *)calloc(METACACHE_SECTORS, sizeof(meta_slot_t));
+    ESP_RETURN_ON_FALSE(s_mc.data && s_mc.slots, ESP_ERR_NO_MEM, TAG,
+                        "could not allocate %d cache sectors",
+                        METACACHE_SECTORS);
+    s_mc.nslots = METACACHE_SECTORS;
+    load();
+    return ESP_OK;
+}
+
+void msc_metacache_invalidate(void) {
+    s_mc.stale = true;
+}
+
+bool msc_metacache_read(uint32_t lba, uint8_t *dst, uint32_t count) {
+    if (s_mc.nslots == 0) {
+        return false;
+    }
+    if (s_mc.stale) {
+        load();
+    }
+    if (!overlaps_metadata(lba, count)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (!find(lba + i)) {
+            s_mc.stats.misses++;
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        meta_slot_t *slot = find(lba + i);
+        memcpy(dst + i * MSC_SECTOR_SIZE, slot_data(slot), MSC_SECTOR_SIZE);
+        touch(slot);
+    }
+    s_mc.stats.hits++;
+    return true;
+}
+
+void msc_metacache_fill(uint32_t lba, const uint8_t *src, uint32_t count) {
+    if (s_mc.nslots == 0 || s_mc.stale || !overlaps_metadata(lba, count)) {
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (!is_metadata(lba + i)) {
+            continue;
+        }
+        meta_slot_t *slot = find(lba + i);
+        if (slot == NULL) {
+            slot = victim();
+            if (slot->used) {
+                s_mc.stats.evicted++;
+            }
+            slot->lba = lba + i;
+            memcpy(slot_data(slot), src + i * MSC_SECTOR_SIZE,
+                   MSC_SECTOR_SIZE);
+        }
+        touch(slot);
+    }
+}
+
+void msc_metacache_get_stats(msc_metacache_stats_t *stats) {
+    *stats = s_mc.stats;
+}
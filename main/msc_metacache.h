@@ -0,0 +1,53 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Sector cache for the file system metadata of the card, used while the card
+ * is exposed read-only. Hosts read the MBR, boot sector, FATs and root
+ * directory over and over, on every mount and directory listing; with the
+ * cache those reads never reach the card.
+ *
+ * Only sectors inside the metadata regions are cached: the MBR, the volume
+ * from its boot sector up to the first data cluster (reserved sectors, FATs,
+ * and the FAT12/16 root directory), and the first cluster of a FAT32 or exFAT
+ * root directory. The regions come from the BPB (fat_geometry), parsed when
+ * the cache is set up and again after the card was away from the host. The
+ * CONFIG_EXAMPLE_MSC_METACACHE_SECTORS slots live in internal RAM and the
+ * least recently used one is replaced.
+ *
+ * The host cannot write in read-only mode, so the only staleness comes from
+ * the application: whoever takes the card from the host calls
+ * msc_metacache_invalidate().
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef struct {
+    uint32_t hits;     // reads served from the cache
+    uint32_t misses;   // reads of metadata sectors that went to the card
+    uint32_t evicted;  // sectors replaced by newer ones
+    uint32_t pinned;   // sectors in the metadata regions
+} msc_metacache_stats_t;
+
+// Allocate the slots and parse the volume. Without a volume nothing is
+// cached until the next msc_metacache_invalidate().
+esp_err_t msc_metacache_init(void);
+
+// Drop every cached sector; the BPB is parsed again on the next read
+void msc_metacache_invalidate(void);
+
+// Copy `count` sectors at `lba` to dst if the cache holds all of them. From
+// the TinyUSB task only.
+bool msc_metacache_read(uint32_t lba, uint8_t *dst, uint32_t count);
+
+// Keep the metadata sectors among `count` sectors just read at `lba`
+void msc_metacache_fill(uint32_t lba, const uint8_t *src, uint32_t count);
+
+void msc_metacache_get_stats(msc_metacache_stats_t *stats);
@@ -0,0 +1,349 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_memory_utils.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "msc_pipeline.h"
+#include "msc_pool.h"
+#include "msc_stats.h"
+#include "msc_trace.h"
+#include "sd_card.h"
+#include "sd_recovery.h"
+#include "task_layout.h"
+
+#define PIPELINE_WORKER_CORE       TASK_LAYOUT_SD_CORE
+#define PIPELINE_WORKER_PRIORITY   TASK_LAYOUT_SD_PRIORITY
+#define PIPELINE_WORKER_STACK_SIZE 3072
+#define PIPELINE_QUEUE_LEN         16
+
+#ifdef CONFIG_EXAMPLE_MSC_ZERO_COPY_WRITE
+#define PIPELINE_ZERO_COPY_WRITE 1
+#else
+#define PIPELINE_ZERO_COPY_WRITE 0
+#endif
+
+static const char *TAG = "msc_pipeline";
+
+typedef enum {
+    SLOT_IDLE = 0,  // free for the TinyUSB task to take
+    SLOT_BUSY,      // queued to or running in the worker
+} slot_state_t;
+
+typedef struct {
+    msc_job_t job;
+    volatile slot_state_t state;
+    SemaphoreHandle_t done;  // given by the worker when a read finished
+} xfer_slot_t;
+
+typedef struct {
+    sdmmc_card_t *card;
+    uint32_t slot_sectors;
+    xfer_slot_t slots[MSC_PIPELINE_SLOTS];
+    QueueHandle_t jobs;            // msc_job_t * handed to the worker
+    SemaphoreHandle_t free_slots;  // counts slots in SLOT_IDLE
+    SemaphoreHandle_t drain_lock;  // serializes msc_pipeline_drain() callers
+    esp_err_t write_err;
+    portMUX_TYPE lock;
+} msc_pipeline_t;
+
+static msc_pipeline_t s_pipe = {.lock = portMUX_INITIALIZER_UNLOCKED};
+
+static esp_err_t run_job(msc_job_t *job) {
+    if (job->op == MSC_JOB_READ) {
+        return sdmmc_read_sectors(s_pipe.card, job->data, job->lba,
+                                  job->count);
+    } else if (job->op == MSC_JOB_WRITE) {
+        return sdmmc_write_sectors(s_pipe.card, job->data, job->lba,
+                                   job->count);
+    } else if (job->op == MSC_JOB_ERASE) {
+        // the card may have been swapped since init: ask every time
+        sdmmc_erase_arg_t arg = sdmmc_can_discard(s_pipe.card) == ESP_OK
+                                    ? SDMMC_DISCARD_ARG
+                                    : SDMMC_ERASE_ARG;
+        return sdmmc_erase_sectors(s_pipe.card, job->lba, job->count, arg);
+    }
+    return sdmmc_get_status(s_pipe.card);
+}
+
+static void pipeline_worker(void *arg) {
+    (void)arg;
+    msc_job_t *job;
+
+    while (1) {
+        xQueueReceive(s_pipe.jobs, &job, portMAX_DELAY);
+        msc_stats_queue_depth(uxQueueMessagesWaiting(s_pipe.jobs) + 1);
+        int64_t t0 = esp_timer_get_time();
+        if (sd_recovery_degraded() && job->op != MSC_JOB_STATUS) {
+            // waiting for the re-init, don't run into the card timeouts
+            job->result = ESP_ERR_INVALID_STATE;
+        } else {
+            job->result = run_job(job);
+            if (job->result != ESP_OK) {
+                job->result =
+                    sd_recovery_handle(s_pipe.card, job, job->result);
+            }
+        }
+        int64_t t1 = esp_timer_get_time();
+        msc_stats_card((uint32_t)(t1 - t0));
+        msc_trace_card(job->queued_us, (uint32_t)t0, (uint32_t)t1);
+        job->complete(job);
+    }
+}
+
+// Once the semaphore is obtained an idle slot is guaranteed to exist
+static xfer_slot_t *slot_acquire(void) {
+    xfer_slot_t *slot = NULL;
+    xSemaphoreTake(s_pipe.free_slots, portMAX_DELAY);
+    portENTER_CRITICAL(&s_pipe.lock);
+    for (int i = 0; i < MSC_PIPELINE_SLOTS; i++) {
+        if (s_pipe.slots[i].state == SLOT_IDLE) {
+            slot        = &s_pipe.slots[i];
+            slot->state = SLOT_BUSY;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_pipe.lock);
+    if (!slot) {
+        abort();
+    }
+    return slot;
+}
+
+static void slot_release(xfer_slot_t *slot) {
+    slot->state = SLOT_IDLE;
+    xSemaphoreGive(s_pipe.free_slots);
+}
+
+static void slot_read_complete(msc_job_t *job) {
+    xSemaphoreGive(((xfer_slot_t *)job->arg)->done);
+}
+
+static void slot_write_complete(msc_job_t *job) {
+    if (job->result != ESP_OK) {
+        ESP_LOGE(TAG, "write lba=%lu count=%lu failed (0x%x)", job->lba,
+                 job->count, job->result);
+        portENTER_CRITICAL(&s_pipe.lock);
+        if (s_pipe.write_err == ESP_OK) {
+            s_pipe.write_err = job->result;
+        }
+        portEXIT_CRITICAL(&s_pipe.lock);
+    }
+    slot_release((xfer_slot_t *)job->arg);
+}
+
+/* The sdmmc driver DMAs straight from/to word aligned internal RAM and
+ * bounces through a sector buffer otherwise. TinyUSB's MSC buffer qualifies,
+ * so such transfers can skip the slot buffer. */
+static bool is_direct(const void *buf) {
+    return esp_ptr_dma_capable(buf) && ((uintptr_t)buf & 3) == 0;
+}
+
+static void slot_submit_write(xfer_slot_t *slot, uint32_t lba,
+                              uint32_t count) {
+    slot->job.op       = MSC_JOB_WRITE;
+    slot->job.lba      = lba;
+    slot->job.count    = count;
+    slot->job.complete = slot_write_complete;
+    msc_pipeline_submit(&slot->job);
+}
+
+esp_err_t msc_pipeline_init(sdmmc_card_t *card, size_t buf_size) {
+    ESP_RETURN_ON_FALSE(card && buf_size >= (size_t)card->csd.sector_size,
+                        ESP_ERR_INVALID_ARG, TAG, "invalid arguments");
+
+    s_pipe.card         = card;
+    s_pipe.slot_sectors = buf_size / card->csd.sector_size;
+    s_pipe.jobs         = xQueueCreate(PIPELINE_QUEUE_LEN, sizeof(void *));
+    s_pipe.free_slots =
+        xSemaphoreCreateCounting(MSC_PIPELINE_SLOTS, MSC_PIPELINE_SLOTS);
+    s_pipe.drain_lock = xSemaphoreCreateMutex();
+    ESP_RETURN_ON_FALSE(s_pipe.jobs && s_pipe.free_slots && s_pipe.drain_lock,
+                        ESP_ERR_NO_MEM, TAG,
+                        "could not create pipeline queues");
+
+    for (int i = 0; i < MSC_PIPELINE_SLOTS; i++) {
+        xfer_slot_t *slot = &s_pipe.slots[i];
+        slot->job.data    = (uint8_t *)msc_pool_alloc(buf_size);
+        slot->job.arg     = slot;
+        slot->done        = xSemaphoreCreateBinary();
+        ESP_RETURN_ON_FALSE(slot->job.data && slot->done, ESP_ERR_NO_MEM, TAG,
+                            "could not allocate %u byte transfer buffer",
+                            buf_size);
+        slot->state = SLOT_IDLE;
+    }
+
+    BaseType_t ok = xTaskCreatePinnedToCore(
+        pipeline_worker, "msc_sd", PIPELINE_WORKER_STACK_SIZE, NULL,
+        PIPELINE_WORKER_PRIORITY, NULL, PIPELINE_WORKER_CORE);
+    ESP_RETURN_ON_FALSE(ok == pdPASS, ESP_ERR_NO_MEM, TAG,
+                        "could not create SD worker task");
+
+    ESP_LOGI(TAG, "%d x %u byte transfer buffers, SD worker on core %d",
+             MSC_PIPELINE_SLOTS, buf_size, PIPELINE_WORKER_CORE);
+    return ESP_OK;
+}
+
+void msc_pipeline_submit(msc_job_t *job) {
+    job->queued_us = msc_trace_now();
+    xQueueSend(s_pipe.jobs, &job, portMAX_DELAY);
+}
+
+esp_err_t msc_pipeline_read(uint32_t lba, uint8_t *dst, uint32_t count) {
+    ESP_RETURN_ON_FALSE(count <= s_pipe.slot_sectors, ESP_ERR_INVALID_SIZE,
+                        TAG, "read of %lu sectors exceeds buffer", count);
+
+    xfer_slot_t *slot  = slot_acquire();
+    uint8_t *buf       = slot->job.data;
+    const bool direct  = is_direct(dst);
+    slot->job.op       = MSC_JOB_READ;
+    slot->job.data     = direct ? dst : buf;
+    slot->job.lba      = lba;
+    slot->job.count    = count;
+    slot->job.complete = slot_read_complete;
+    msc_pipeline_submit(&slot->job);
+
+    xSemaphoreTake(slot->done, portMAX_DELAY);
+    esp_err_t ret  = slot->job.result;
+    slot->job.data = buf;
+    if (ret == ESP_OK) {
+        if (!direct) {
+            memcpy(dst, buf, count * s_pipe.card->csd.sector_size);
+        }
+    } else {
+        ESP_LOGE(TAG, "read lba=%lu count=%lu failed (0x%x)", lba, count, ret);
+    }
+    slot_release(slot);
+    return ret;
+}
+
+// Sectors of [lba, lba + count) before the next erase unit boundary. A card
+// write that spans two allocation units makes the card relocate both.
+static uint32_t unit_run(uint32_t lba, uint32_t count) {
+    const uint32_t au   = sd_card_au_sectors(s_pipe.card);
+    const uint32_t left = au - lba % au;
+    return count < left ? count : left;
+}
+
+static esp_err_t pipeline_write(uint32_t lba, const uint8_t *src,
+                                uint32_t count) {
+    xfer_slot_t *slot = slot_acquire();
+    if (PIPELINE_ZERO_COPY_WRITE && is_direct(src)) {
+        // src is only valid until we return: write from it and wait
+        uint8_t *buf       = slot->job.data;
+        slot->job.op       = MSC_JOB_WRITE;
+        slot->job.data     = (uint8_t *)src;
+        slot->job.lba      = lba;
+        slot->job.count    = count;
+        slot->job.complete = slot_read_complete;
+        msc_pipeline_submit(&slot->job);
+
+        xSemaphoreTake(slot->done, portMAX_DELAY);
+        esp_err_t ret  = slot->job.result;
+        slot->job.data = buf;
+        slot_release(slot);
+        ESP_RETURN_ON_ERROR(ret, TAG, "write lba=%lu count=%lu failed", lba,
+                            count);
+        return ESP_OK;
+    }
+    memcpy(slot->job.data, src, count * s_pipe.card->csd.sector_size);
+    slot_submit_write(slot, lba, count);
+    return ESP_OK;
+}
+
+esp_err_t msc_pipeline_write(uint32_t lba, const uint8_t *src,
+                             uint32_t count) {
+    ESP_RETURN_ON_FALSE(count <= s_pipe.slot_sectors, ESP_ERR_INVALID_SIZE,
+                        TAG, "write of %lu sectors exceeds buffer", count);
+
+    const uint32_t ssize = s_pipe.card->csd.sector_size;
+    while (count > 0) {
+        const uint32_t n = unit_run(lba, count);
+        esp_err_t ret    = pipeline_write(lba, src, n);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        lba += n;
+        src += n * ssize;
+        count -= n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t msc_pipeline_write_gather(uint32_t lba, const uint8_t *const *srcs,
+                                    uint32_t count) {
+    ESP_RETURN_ON_FALSE(count <= s_pipe.slot_sectors, ESP_ERR_INVALID_SIZE,
+                        TAG, "write of %lu sectors exceeds buffer", count);
+
+    const uint32_t ssize = s_pipe.card->csd.sector_size;
+    while (count > 0) {
+        const uint32_t n  = unit_run(lba, count);
+        xfer_slot_t *slot = slot_acquire();
+        for (uint32_t i = 0; i < n; i++) {
+            memcpy(slot->job.data + i * ssize, srcs[i], ssize);
+        }
+        slot_submit_write(slot, lba, n);
+        lba += n;
+        srcs += n;
+        count -= n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t msc_pipeline_check_card(void) {
+    xfer_slot_t *slot  = slot_acquire();
+    slot->job.op       = MSC_JOB_STATUS;
+    slot->job.complete = slot_read_complete;
+    msc_pipeline_submit(&slot->job);
+
+    xSemaphoreTake(slot->done, portMAX_DELAY);
+    esp_err_t ret = slot->job.result;
+    slot_release(slot);
+    return ret;
+}
+
+esp_err_t msc_pipeline_erase(uint32_t lba, uint32_t count) {
+    xfer_slot_t *slot  = slot_acquire();
+    slot->job.op       = MSC_JOB_ERASE;
+    slot->job.lba      = lba;
+    slot->job.count    = count;
+    slot->job.complete = slot_read_complete;
+    msc_pipeline_submit(&slot->job);
+
+    xSemaphoreTake(slot->done, portMAX_DELAY);
+    esp_err_t ret = slot->job.result;
+    slot_release(slot);
+    ESP_RETURN_ON_ERROR(ret, TAG, "erase lba=%lu count=%lu failed", lba,
+                        count);
+    return ESP_OK;
+}
+
+void msc_pipeline_drain(void) {
+    xSemaphoreTake(s_pipe.drain_lock, portMAX_DELAY);
+    for (int i = 0; i < MSC_PIPELINE_SLOTS; i++) {
+        xSemaphoreTake(s_pipe.free_slots, portMAX_DELAY);
+    }
+    for (int i = 0; i < MSC_PIPELINE_SLOTS; i++) {
+        xSemaphoreGive(s_pipe.free_slots);
+    }
+    xSemaphoreGive(s_pipe.drain_lock);
+}
+
+esp_err_t msc_pipeline_take_error(void) {
+    portENTER_CRITICAL(&s_pipe.lock);
+    esp_err_t err    = s_pipe.write_err;
+    s_pipe.write_err = ESP_OK;
+    portEXIT_CRITICAL(&s_pipe.lock);
+    return err;
+}
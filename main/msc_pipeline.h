@@ -0,0 +1,88 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Double-buffered USB <-> SD card pipeline. A dedicated SD worker task, on the
+ * core task_layout.h assigns it, owns all card I/O. The TinyUSB task
+ * only copies between the MSC endpoint buffer and one of two transfer buffers,
+ * so the bulk endpoint and the SPI DMA channel are busy at the same time:
+ * - write: buffer A is written to the card while buffer B receives the next
+ *   chunk from the OUT endpoint.
+ * - read: msc_readahead keeps the worker reading the following chunks while
+ *   the current one is sent to the IN endpoint.
+ *
+ * Writes complete asynchronously. msc_storage fails the next command on the
+ * LUN when msc_pipeline_take_error() returns a failed write, with deferred
+ * sense data (response code 0x71) in its REQUEST SENSE answer.
+ *
+ * A write that crosses an allocation unit boundary of the card is split there,
+ * so no card write command ever spans two erase units.
+ *
+ * Reads into word aligned internal RAM, such as the MSC endpoint buffer, skip
+ * the transfer buffer: the card DMAs straight into the destination. With
+ * CONFIG_EXAMPLE_MSC_ZERO_COPY_WRITE writes do the same from the source and
+ * wait for the card instead of overlapping with the next chunk.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdmmc_cmd.h"
+
+#define MSC_PIPELINE_SLOTS 2
+
+typedef enum {
+    MSC_JOB_READ = 0,
+    MSC_JOB_WRITE,
+    MSC_JOB_STATUS,  // ask the card for its status, no data
+    MSC_JOB_ERASE,   // discard or erase `count` sectors at `lba`, no data
+} msc_job_op_t;
+
+typedef struct msc_job msc_job_t;
+
+// Unit of work for the SD worker. `data` must be DMA-capable.
+struct msc_job {
+    msc_job_op_t op;
+    uint8_t *data;
+    uint32_t lba;
+    uint32_t count;
+    esp_err_t result;
+    void (*complete)(msc_job_t *job);  // called from the SD worker task
+    void *arg;
+    uint32_t queued_us;  // set by msc_pipeline_submit(), for msc_trace
+};
+
+// Allocate the transfer buffers and start the SD worker task
+esp_err_t msc_pipeline_init(sdmmc_card_t *card, size_t buf_size);
+
+// Queue a job for the SD worker. Jobs are executed in submission order.
+void msc_pipeline_submit(msc_job_t *job);
+
+// Read `count` sectors at `lba` into dst and wait for the data
+esp_err_t msc_pipeline_read(uint32_t lba, uint8_t *dst, uint32_t count);
+
+// Queue `count` sectors from src for writing at `lba`. Returns once src has
+// been copied into a transfer buffer, or written for a zero-copy write.
+esp_err_t msc_pipeline_write(uint32_t lba, const uint8_t *src,
+                             uint32_t count);
+
+// Same as msc_pipeline_write() with one source pointer per sector
+esp_err_t msc_pipeline_write_gather(uint32_t lba, const uint8_t *const *srcs,
+                                    uint32_t count);
+
+// Wait until every queued write reached the card
+void msc_pipeline_drain(void);
+
+// Check from the SD worker that the card still answers (CMD13)
+esp_err_t msc_pipeline_check_card(void);
+
+// Erase `count` sectors at `lba` and wait for the card. Uses DISCARD where the
+// card supports it, which needs no erase of the flash blocks, else ERASE.
+esp_err_t msc_pipeline_erase(uint32_t lba, uint32_t count);
+
+// Return and clear the first write error since the last call
+esp_err_t msc_pipeline_take_error(void);
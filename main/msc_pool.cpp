@@ -0,0 +1,113 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <assert.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+#include "msc_config.h"
+#include "msc_pipeline.h"
+#include "msc_pool.h"
+
+#define POOL_BLOCK_SIZE MSC_XFER_SIZE
+#define POOL_ALIGN      CONFIG_ESP32S3_DATA_CACHE_LINE_SIZE
+#define POOL_BLOCKS_FOR(bytes) \
+    (((bytes) + POOL_BLOCK_SIZE - 1) / POOL_BLOCK_SIZE)
+
+// Same rounding as msc_readahead_init(): whole transfer buffers
+#define POOL_READAHEAD_BLOCKS \
+    POOL_BLOCKS_FOR(CONFIG_EXAMPLE_MSC_READAHEAD_SECTORS * MSC_SECTOR_SIZE)
+#if CONFIG_EXAMPLE_MSC_WRITE_BACK
+#define POOL_WRITEBACK_BLOCKS \
+    POOL_BLOCKS_FOR(CONFIG_EXAMPLE_MSC_WRITEBACK_SECTORS * MSC_SECTOR_SIZE)
+#else
+#define POOL_WRITEBACK_BLOCKS 0
+#endif
+#if CONFIG_EXAMPLE_MSC_FLASH_LUN
+#define POOL_FLASH_BLOCKS 1
+#else
+#define POOL_FLASH_BLOCKS 0
+#endif
+#define POOL_SPARE_BLOCKS POOL_BLOCKS_FOR(CONFIG_EXAMPLE_MSC_POOL_SPARE_KB * 1024)
+
+#define POOL_BLOCKS                                \
+    (MSC_PIPELINE_SLOTS + POOL_READAHEAD_BLOCKS + \
+     POOL_WRITEBACK_BLOCKS + POOL_FLASH_BLOCKS + POOL_SPARE_BLOCKS)
+
+static const char *TAG = "msc_pool";
+
+static DRAM_ATTR uint8_t s_arena[POOL_BLOCKS * POOL_BLOCK_SIZE]
+    __attribute__((aligned(POOL_ALIGN)));
+
+typedef struct {
+    // for the first block of an allocation its length in blocks, else 0
+    uint16_t run[POOL_BLOCKS];
+    bool used[POOL_BLOCKS];
+    msc_pool_stats_t stats;
+    portMUX_TYPE lock;
+} msc_pool_t;
+
+static msc_pool_t s_pool = {
+    .stats = {.block_size = POOL_BLOCK_SIZE, .blocks = POOL_BLOCKS},
+    .lock  = portMUX_INITIALIZER_UNLOCKED,
+};
+
+void *msc_pool_alloc(size_t size) {
+    const uint32_t n = POOL_BLOCKS_FOR(size);
+    int start        = -1;
+
+    portENTER_CRITICAL(&s_pool.lock);
+    uint32_t free_run = 0;
+    for (int i = 0; n > 0 && i < POOL_BLOCKS; i++) {
+        free_run = s_pool.used[i] ? 0 : free_run + 1;
+        if (free_run == n) {
+            start = i + 1 - n;
+            break;
+        }
+    }
+    if (start >= 0) {
+        for (uint32_t i = 0; i < n; i++) {
+            s_pool.used[start + i] = true;
+        }
+        s_pool.run[start] = n;
+        s_pool.stats.in_use += n;
+        if (s_pool.stats.in_use > s_pool.stats.high_water) {
+            s_pool.stats.high_water = s_pool.stats.in_use;
+        }
+    } else {
+        s_pool.stats.failures++;
+    }
+    portEXIT_CRITICAL(&s_pool.lock);
+
+    if (start < 0) {
+        ESP_LOGE(TAG, "no run of %lu free blocks for %u bytes", n, size);
+        return NULL;
+    }
+    return s_arena + start * POOL_BLOCK_SIZE;
+}
+
+void msc_pool_free(void *buf) {
+    if (!buf) {
+        return;
+    }
+    const int start = ((uint8_t *)buf - s_arena) / POOL_BLOCK_SIZE;
+    assert(start >= 0 && start < POOL_BLOCKS && s_pool.run[start] > 0);
+
+    portENTER_CRITICAL(&s_pool.lock);
+    for (uint32_t i = 0; i < s_pool.run[start]; i++) {
+        s_pool.used[start + i] = false;
+    }
+    s_pool.stats.in_use -= s_pool.run[start];
+    s_pool.run[start] = 0;
+    portEXIT_CRITICAL(&s_pool.lock);
+}
+
+void msc_pool_get_stats(msc_pool_stats_t *stats) {
+    portENTER_CRITICAL(&s_pool.lock);
+    *stats = s_pool.stats;
+    portEXIT_CRITICAL(&s_pool.lock);
+}
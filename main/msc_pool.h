@@ -0,0 +1,39 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Fixed arena for every buffer that takes part in card I/O: the transfer
+ * slots, the read-ahead ring, the write-back cache, the benchmark and the
+ * clock self-test. The arena is a statically allocated, cache-line aligned
+ * array in internal DRAM, so every buffer is DMA-capable, never fragments the
+ * heap and is accounted for at link time.
+ *
+ * The arena is cut in blocks of MSC_XFER_SIZE bytes (msc_config.h) and
+ * sized for all enabled features plus CONFIG_EXAMPLE_MSC_POOL_SPARE_KB for
+ * temporary users. An allocation takes the first run of free blocks large
+ * enough.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint32_t block_size;
+    uint32_t blocks;      // blocks in the arena
+    uint32_t in_use;      // blocks allocated now
+    uint32_t high_water;  // most blocks ever allocated at once
+    uint32_t failures;    // allocations that did not fit
+} msc_pool_stats_t;
+
+// Allocate `size` bytes, rounded up to whole blocks. NULL if they do not fit.
+void *msc_pool_alloc(size_t size);
+
+// Return a buffer from msc_pool_alloc(). NULL is ignored.
+void msc_pool_free(void *buf);
+
+void msc_pool_get_stats(msc_pool_stats_t *stats);
@@ -0,0 +1,209 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_check.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "msc_pipeline.h"
+#include "msc_pool.h"
+#include "msc_readahead.h"
+
+static const char *TAG = "msc_readahead";
+
+typedef struct {
+    msc_job_t job;
+    SemaphoreHandle_t done;  // given by the worker when the prefetch finished
+    bool pending;            // job queued and `done` not taken yet
+} ra_seg_t;
+
+/* The window is a contiguous LBA range [segs[head].job.lba, window_end)
+ * made of `used` consecutive segments of the ring, oldest first. */
+typedef struct {
+    sdmmc_card_t *card;
+    ra_seg_t *segs;
+    int nsegs;
+    int limit;  // segments the window may use, at most nsegs
+    uint32_t window_sectors;
+    uint32_t seg_sectors;
+    int head;
+    int used;
+    uint32_t window_end;
+    uint32_t next_lba;  // LBA a sequential read would start at
+    msc_readahead_stats_t stats;
+} msc_readahead_t;
+
+static msc_readahead_t s_ra = {
+    .window_sectors = CONFIG_EXAMPLE_MSC_READAHEAD_SECTORS,
+};
+
+static void seg_complete(msc_job_t *job) {
+    xSemaphoreGive(((ra_seg_t *)job->arg)->done);
+}
+
+static esp_err_t seg_wait(ra_seg_t *seg) {
+    if (seg->pending) {
+        xSemaphoreTake(seg->done, portMAX_DELAY);
+        seg->pending = false;
+    }
+    return seg->job.result;
+}
+
+static void window_pop(void) {
+    seg_wait(&s_ra.segs[s_ra.head]);
+    s_ra.head = (s_ra.head + 1) % s_ra.nsegs;
+    s_ra.used--;
+}
+
+// Queue prefetches until the window has all the segments it may use
+static void window_fill(void) {
+    const uint32_t capacity = s_ra.card->csd.capacity;
+    while (s_ra.used < s_ra.limit && s_ra.window_end < capacity) {
+        ra_seg_t *seg = &s_ra.segs[(s_ra.head + s_ra.used) % s_ra.nsegs];
+        uint32_t n    = capacity - s_ra.window_end;
+        if (n > s_ra.seg_sectors) {
+            n = s_ra.seg_sectors;
+        }
+        seg->job.lba   = s_ra.window_end;
+        seg->job.count = n;
+        seg->pending   = true;
+        msc_pipeline_submit(&seg->job);
+
+        s_ra.window_end += n;
+        s_ra.used++;
+        s_ra.stats.prefetched += n;
+    }
+}
+
+// Copy [lba, lba + count) out of the window and retire consumed segments.
+// The caller made sure the range is covered.
+static esp_err_t window_copy(uint32_t lba, uint8_t *dst, uint32_t count) {
+    const uint32_t ssize = s_ra.card->csd.sector_size;
+    const uint32_t end   = lba + count;
+
+    // segments entirely before lba are skipped data
+    while (s_ra.used > 0) {
+        ra_seg_t *seg = &s_ra.segs[s_ra.head];
+        if (seg->job.lba + seg->job.count > lba) {
+            break;
+        }
+        s_ra.stats.discarded += seg->job.count;
+        window_pop();
+    }
+
+    while (lba < end) {
+        ra_seg_t *seg = &s_ra.segs[s_ra.head];
+        ESP_RETURN_ON_ERROR(seg_wait(seg), TAG, "prefetch lba=%lu failed",
+                            seg->job.lba);
+        uint32_t seg_end = seg->job.lba + seg->job.count;
+        uint32_t n       = (seg_end < end ? seg_end : end) - lba;
+        memcpy(dst, seg->job.data + (lba - seg->job.lba) * ssize, n * ssize);
+        dst += n * ssize;
+        lba += n;
+        if (lba == seg_end) {
+            window_pop();
+        }
+    }
+    return ESP_OK;
+}
+
+static int window_limit(void) {
+    int n = (s_ra.window_sectors + s_ra.seg_sectors - 1) / s_ra.seg_sectors;
+    return n < s_ra.nsegs ? n : s_ra.nsegs;
+}
+
+esp_err_t msc_readahead_init(sdmmc_card_t *card, size_t seg_size) {
+    s_ra.card        = card;
+    s_ra.seg_sectors = seg_size / card->csd.sector_size;
+    s_ra.next_lba    = UINT32_MAX;
+    s_ra.nsegs = (CONFIG_EXAMPLE_MSC_READAHEAD_SECTORS + s_ra.seg_sectors - 1) /
+                 s_ra.seg_sectors;
+    if (s_ra.nsegs == 0) {
+        ESP_LOGI(TAG, "read-ahead disabled");
+        return ESP_OK;
+    }
+
+    uint8_t *ring = (uint8_t *)msc_pool_alloc(s_ra.nsegs * seg_size);
+    s_ra.segs = (ra_seg_t *)calloc(s_ra.nsegs, sizeof(ra_seg_t));
+    ESP_RETURN_ON_FALSE(ring && s_ra.segs, ESP_ERR_NO_MEM, TAG,
+                        "could not allocate %u byte read-ahead ring",
+                        s_ra.nsegs * seg_size);
+
+    for (int i = 0; i < s_ra.nsegs; i++) {
+        ra_seg_t *seg     = &s_ra.segs[i];
+        seg->job.op       = MSC_JOB_READ;
+        seg->job.data     = ring + i * seg_size;
+        seg->job.complete = seg_complete;
+        seg->job.arg      = seg;
+        seg->done         = xSemaphoreCreateBinary();
+        ESP_RETURN_ON_FALSE(seg->done, ESP_ERR_NO_MEM, TAG,
+                            "could not create semaphore");
+    }
+    s_ra.limit = window_limit();
+    ESP_LOGI(TAG, "read-ahead ring %lu sectors, window %lu",
+             s_ra.nsegs * s_ra.seg_sectors, s_ra.limit * s_ra.seg_sectors);
+    return ESP_OK;
+}
+
+esp_err_t msc_readahead_read(uint32_t lba, uint8_t *dst, uint32_t count) {
+    if (s_ra.limit == 0) {
+        return msc_pipeline_read(lba, dst, count);
+    }
+
+    bool sequential = lba == s_ra.next_lba;
+    s_ra.next_lba   = lba + count;
+    bool covered    = s_ra.used > 0 && lba >= s_ra.segs[s_ra.head].job.lba &&
+                   lba + count <= s_ra.window_end;
+
+    if (!covered) {
+        msc_readahead_invalidate();
+        s_ra.stats.misses++;
+        if (!sequential) {
+            return msc_pipeline_read(lba, dst, count);
+        }
+        // the stream is sequential: restart the window at this read
+        s_ra.window_end = lba;
+        window_fill();
+    } else {
+        s_ra.stats.hits++;
+    }
+
+    esp_err_t ret = window_copy(lba, dst, count);
+    if (ret != ESP_OK) {
+        msc_readahead_invalidate();
+        return ret;
+    }
+    // keep the card busy while this chunk goes to the host
+    window_fill();
+    return ESP_OK;
+}
+
+void msc_readahead_invalidate(void) {
+    while (s_ra.used > 0) {
+        s_ra.stats.discarded += s_ra.segs[s_ra.head].job.count;
+        window_pop();
+    }
+    s_ra.window_end = 0;
+}
+
+void msc_readahead_set_window(uint32_t sectors) {
+    s_ra.window_sectors = sectors;
+    if (s_ra.segs) {
+        msc_readahead_invalidate();
+        s_ra.limit = window_limit();
+    }
+}
+
+uint32_t msc_readahead_window(void) {
+    return s_ra.limit * s_ra.seg_sectors;
+}
+
+void msc_readahead_get_stats(msc_readahead_stats_t *stats) {
+    *stats = s_ra.stats;
+}
@@ -0,0 +1,46 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Sequential read-ahead for host READ(10) streams. Once a read continues
+ * exactly where the previous one ended, the next
+ * CONFIG_EXAMPLE_MSC_READAHEAD_SECTORS sectors are prefetched by the SD worker
+ * into an internal RAM ring and later reads are served from memory. A read at
+ * any other LBA, or any write, drops the window. The window can be made
+ * smaller than the ring at runtime, down to 0 to turn read-ahead off.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdmmc_cmd.h"
+
+typedef struct {
+    uint32_t hits;        // reads served from the ring
+    uint32_t misses;      // reads that had to wait for the card
+    uint32_t prefetched;  // sectors read ahead
+    uint32_t discarded;   // prefetched sectors dropped before use
+} msc_readahead_stats_t;
+
+// Allocate the ring, split in segments of seg_size bytes
+esp_err_t msc_readahead_init(sdmmc_card_t *card, size_t seg_size);
+
+// Read `count` sectors at `lba` into dst, at most seg_size bytes
+esp_err_t msc_readahead_read(uint32_t lba, uint8_t *dst, uint32_t count);
+
+// Drop the read-ahead window, waiting for prefetches still in flight
+void msc_readahead_invalidate(void);
+
+// Use at most `sectors` of the ring, rounded up to whole segments. Before
+// msc_readahead_init() or from the TinyUSB task; other tasks go through
+// msc_storage_set_readahead().
+void msc_readahead_set_window(uint32_t sectors);
+
+// Sectors the window may currently hold
+uint32_t msc_readahead_window(void);
+
+void msc_readahead_get_stats(msc_readahead_stats_t *stats);
@@ -0,0 +1,106 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include "esp_check.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "msc_settings.h"
+
+#define NVS_NAMESPACE   "msc_cfg"
+#define NVS_KEY_FREQ    "max_freq"
+#define NVS_KEY_RA      "ra_sectors"
+#define NVS_KEY_WB_IDLE "wb_flush_ms"
+
+// Same bounds as the Kconfig options
+#define SETTINGS_MIN_FREQ_KHZ 400
+#define SETTINGS_MAX_FREQ_KHZ 40000
+#define SETTINGS_MIN_FLUSH_MS 10
+#define SETTINGS_MAX_FLUSH_MS 60000
+
+#ifdef CONFIG_EXAMPLE_MSC_WRITEBACK_FLUSH_MS
+#define SETTINGS_FLUSH_MS CONFIG_EXAMPLE_MSC_WRITEBACK_FLUSH_MS
+#else
+#define SETTINGS_FLUSH_MS 1000
+#endif
+
+static const char *TAG = "msc_settings";
+
+static const msc_settings_t s_defaults = {
+    .max_freq_khz       = CONFIG_EXAMPLE_SD_MAX_FREQ_KHZ,
+    .readahead_sectors  = CONFIG_EXAMPLE_MSC_READAHEAD_SECTORS,
+    .writeback_flush_ms = SETTINGS_FLUSH_MS,
+};
+
+typedef struct {
+    nvs_handle_t nvs;
+    msc_settings_t settings;
+} msc_settings_store_t;
+
+static msc_settings_store_t s_store;
+
+static bool valid(const msc_settings_t *s) {
+    return s->max_freq_khz >= SETTINGS_MIN_FREQ_KHZ &&
+           s->max_freq_khz <= SETTINGS_MAX_FREQ_KHZ &&
+           s->readahead_sectors <= CONFIG_EXAMPLE_MSC_READAHEAD_SECTORS &&
+           s->writeback_flush_ms >= SETTINGS_MIN_FLUSH_MS &&
+           s->writeback_flush_ms <= SETTINGS_MAX_FLUSH_MS;
+}
+
+// Keep the default for a key that is missing
+static void load(const char *key, uint32_t *value) {
+    uint32_t stored;
+    if (nvs_get_u32(s_store.nvs, key, &stored) == ESP_OK) {
+        *value = stored;
+    }
+}
+
+esp_err_t msc_settings_init(void) {
+    ESP_RETURN_ON_ERROR(nvs_open(NVS_NAMESPACE, NVS_READWRITE, &s_store.nvs),
+                        TAG, "could not open NVS");
+
+    msc_settings_t s = s_defaults;
+    load(NVS_KEY_FREQ, &s.max_freq_khz);
+    load(NVS_KEY_RA, &s.readahead_sectors);
+    load(NVS_KEY_WB_IDLE, &s.writeback_flush_ms);
+    if (!valid(&s)) {
+        // written by a build with other limits
+        ESP_LOGW(TAG, "stored settings out of range, using the defaults");
+        s = s_defaults;
+    }
+    s_store.settings = s;
+    ESP_LOGI(TAG, "clock <= %lu kHz, read-ahead %lu sectors, flush %lu ms",
+             s.max_freq_khz, s.readahead_sectors, s.writeback_flush_ms);
+    return ESP_OK;
+}
+
+const msc_settings_t *msc_settings_get(void) {
+    return &s_store.settings;
+}
+
+esp_err_t msc_settings_set(const msc_settings_t *settings) {
+    ESP_RETURN_ON_FALSE(valid(settings), ESP_ERR_INVALID_ARG, TAG,
+                        "setting out of range");
+    ESP_RETURN_ON_ERROR(
+        nvs_set_u32(s_store.nvs, NVS_KEY_FREQ, settings->max_freq_khz), TAG,
+        "could not store %s", NVS_KEY_FREQ);
+    ESP_RETURN_ON_ERROR(
+        nvs_set_u32(s_store.nvs, NVS_KEY_RA, settings->readahead_sectors), TAG,
+        "could not store %s", NVS_KEY_RA);
+    ESP_RETURN_ON_ERROR(nvs_set_u32(s_store.nvs, NVS_KEY_WB_IDLE,
+                                    settings->writeback_flush_ms),
+                        TAG, "could not store %s", NVS_KEY_WB_IDLE);
+    ESP_RETURN_ON_ERROR(nvs_commit(s_store.nvs), TAG, "NVS commit failed");
+    s_store.settings = *settings;
+    return ESP_OK;
+}
+
+esp_err_t msc_settings_reset(void) {
+    ESP_RETURN_ON_ERROR(nvs_erase_all(s_store.nvs), TAG, "NVS erase failed");
+    ESP_RETURN_ON_ERROR(nvs_commit(s_store.nvs), TAG, "NVS commit failed");
+    s_store.settings = s_defaults;
+    return ESP_OK;
+}
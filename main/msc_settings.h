@@ -0,0 +1,35 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Runtime tuning of a unit without reflashing: the card clock ceiling, the
+ * read-ahead window and the write-back flush delay. The Kconfig values are
+ * the defaults; values changed from the console are stored in NVS and loaded
+ * again at boot. Buffer sizes stay as configured, the window can only be made
+ * smaller than the ring allocated for it.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef struct {
+    uint32_t max_freq_khz;        // ceiling for the card clock negotiation
+    uint32_t readahead_sectors;   // read-ahead window, 0 turns it off
+    uint32_t writeback_flush_ms;  // idle time before the write-back flush
+} msc_settings_t;
+
+// Load the stored settings. nvs_flash_init() must have been called.
+esp_err_t msc_settings_init(void);
+
+const msc_settings_t *msc_settings_get(void);
+
+// Check and store new settings; ESP_ERR_INVALID_ARG if a value is out of range
+esp_err_t msc_settings_set(const msc_settings_t *settings);
+
+// Forget the stored settings and go back to the Kconfig defaults
+esp_err_t msc_settings_reset(void);
@@ -0,0 +1,207 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "card_profile.h"
+#include "msc_discard.h"
+#include "msc_metacache.h"
+#include "msc_pool.h"
+#include "msc_readahead.h"
+#include "msc_stats.h"
+#include "msc_writeback.h"
+#include "sd_recovery.h"
+#include "usb_telemetry.h"
+
+static const char *TAG = "msc_stats";
+
+static volatile msc_stats_t s_stats;
+
+void msc_stats_cmd(uint8_t opcode) {
+    s_stats.cmds[opcode]++;
+}
+
+void msc_stats_read(uint32_t bytes, uint32_t us) {
+    if (s_stats.first_read_ms == 0) {
+        s_stats.first_read_ms = (uint32_t)(esp_timer_get_time() / 1000);
+        ESP_LOGI(TAG, "first read %lu ms after boot", s_stats.first_read_ms);
+    }
+    s_stats.read_bytes += bytes;
+    s_stats.read_chunks++;
+    s_stats.cb_us += us;
+    if (us > s_stats.cb_max_us) {
+        s_stats.cb_max_us = us;
+    }
+}
+
+void msc_stats_write(uint32_t bytes, uint32_t us) {
+    s_stats.write_bytes += bytes;
+    s_stats.write_chunks++;
+    s_stats.cb_us += us;
+    if (us > s_stats.cb_max_us) {
+        s_stats.cb_max_us = us;
+    }
+}
+
+void msc_stats_stall(void) {
+    s_stats.stalls++;
+}
+
+void msc_stats_enumerated(void) {
+    if (s_stats.enum_ms == 0) {
+        s_stats.enum_ms = (uint32_t)(esp_timer_get_time() / 1000);
+        ESP_LOGI(TAG, "enumerated %lu ms after boot", s_stats.enum_ms);
+    }
+}
+
+void msc_stats_card(uint32_t us) {
+    s_stats.card_us += us;
+}
+
+void msc_stats_queue_depth(uint32_t depth) {
+    if (depth > s_stats.queue_max) {
+        s_stats.queue_max = depth;
+    }
+}
+
+void msc_stats_get(msc_stats_t *stats) {
+    memcpy(stats, (const void *)&s_stats, sizeof(*stats));
+}
+
+#if CONFIG_EXAMPLE_MSC_STATS_LOG_MS > 0
+static void stats_log_cb(void *arg) {
+    (void)arg;
+    static msc_stats_t prev;
+    static msc_readahead_stats_t prev_ra;
+    static int64_t prev_us;
+
+    msc_stats_t cur;
+    msc_readahead_stats_t ra;
+    msc_stats_get(&cur);
+    msc_readahead_get_stats(&ra);
+    int64_t now_us = esp_timer_get_time();
+    float dt_us    = (float)(now_us - prev_us);
+
+    ESP_LOGI(TAG,
+             "rd %.2f MB/s wr %.2f MB/s cb %.0f%% card %.0f%% stalls %lu "
+             "qmax %lu ra hit %lu miss %lu",
+             (cur.read_bytes - prev.read_bytes) / dt_us,
+             (cur.write_bytes - prev.write_bytes) / dt_us,
+             (float)(cur.cb_us - prev.cb_us) * 100 / dt_us,
+             (float)(cur.card_us - prev.card_us) * 100 / dt_us,
+             cur.stalls - prev.stalls, cur.queue_max, ra.hits - prev_ra.hits,
+             ra.misses - prev_ra.misses);
+
+    prev    = cur;
+    prev_ra = ra;
+    prev_us = now_us;
+}
+#endif  // CONFIG_EXAMPLE_MSC_STATS_LOG_MS > 0
+
+esp_err_t msc_stats_init(void) {
+#if CONFIG_EXAMPLE_MSC_STATS_LOG_MS > 0
+    const esp_timer_create_args_t timer_args = {
+        .callback = stats_log_cb,
+        .name     = "msc_stats",
+    };
+    esp_timer_handle_t timer;
+    ESP_RETURN_ON_ERROR(esp_timer_create(&timer_args, &timer), TAG,
+                        "could not create log timer");
+    ESP_RETURN_ON_ERROR(
+        esp_timer_start_periodic(timer,
+                                 CONFIG_EXAMPLE_MSC_STATS_LOG_MS * 1000ULL),
+        TAG, "could not start log timer");
+#endif
+    return ESP_OK;
+}
+
+void msc_stats_print(FILE *out) {
+    msc_stats_t st;
+    msc_stats_get(&st);
+
+    fprintf(out, "read:   %lu bytes in %lu chunks\n", st.read_bytes,
+            st.read_chunks);
+    fprintf(out, "write:  %lu bytes in %lu chunks\n", st.write_bytes,
+            st.write_chunks);
+    fprintf(out, "cb:     %lu us, max %lu us\n", st.cb_us, st.cb_max_us);
+    fprintf(out, "card:   %lu us\n", st.card_us);
+    fprintf(out, "stalls: %lu\n", st.stalls);
+    fprintf(out, "queue:  max %lu\n", st.queue_max);
+    fprintf(out, "boot:   enumerated %lu ms, first read %lu ms\n",
+            st.enum_ms, st.first_read_ms);
+
+    msc_pool_stats_t pool;
+    msc_pool_get_stats(&pool);
+    fprintf(out,
+            "pool:   %lu/%lu x %lu byte blocks, high water %lu, failed %lu\n",
+            pool.in_use, pool.blocks, pool.block_size, pool.high_water,
+            pool.failures);
+
+    msc_discard_stats_t discard;
+    msc_discard_get_stats(&discard);
+    fprintf(out,
+            "unmap:  %lu ranges, %lu sectors, %lu erased in %lu commands, "
+            "%lu dropped, unit %lu\n",
+            discard.ranges, discard.requested, discard.erased, discard.erases,
+            discard.dropped, discard.au_sectors);
+
+    msc_readahead_stats_t ra;
+    msc_readahead_get_stats(&ra);
+    fprintf(out,
+            "ahead:  %lu hits, %lu misses, %lu prefetched, %lu discarded\n",
+            ra.hits, ra.misses, ra.prefetched, ra.discarded);
+
+#if CONFIG_EXAMPLE_MSC_WRITE_BACK
+    msc_writeback_stats_t wb;
+    msc_writeback_get_stats(&wb);
+    fprintf(out,
+            "wback:  %lu sectors cached, %lu flushes, %lu sectors in %lu "
+            "writes\n",
+            wb.cached, wb.flushes, wb.flushed, wb.writes);
+#endif
+
+    msc_metacache_stats_t meta;
+    msc_metacache_get_stats(&meta);
+    fprintf(out,
+            "meta:   %lu hits, %lu misses, %lu evicted, %lu sectors pinned\n",
+            meta.hits, meta.misses, meta.evicted, meta.pinned);
+
+    sd_recovery_stats_t rec;
+    sd_recovery_get_stats(&rec);
+    fprintf(out, "errors: timeout %lu, crc %lu, response %lu, other %lu\n",
+            rec.errors[SD_ERR_TIMEOUT], rec.errors[SD_ERR_CRC],
+            rec.errors[SD_ERR_RESPONSE], rec.errors[SD_ERR_OTHER]);
+    fprintf(out,
+            "recov:  %lu retries, %lu recovered, %lu clock drops, %lu failed, "
+            "%lu re-inits\n",
+            rec.retries, rec.recovered, rec.clock_drops, rec.failed,
+            rec.reinits);
+
+    card_profile_t prof;
+    if (card_profile_get(&prof)) {
+        fprintf(out,
+                "prof:   %lu inits, %lu errors, %lu re-inits, %lu KB/s, "
+                "baseline %lu KB/s, %lu slow\n",
+                prof.inits, prof.errors, prof.reinits, prof.last_kbps,
+                prof.baseline_kbps, prof.slow);
+    }
+
+#if CONFIG_EXAMPLE_USB_CDC_TELEMETRY
+    usb_telemetry_stats_t tel;
+    usb_telemetry_get_stats(&tel);
+    fprintf(out, "cdc:    %lu bytes queued, %lu sent, %lu dropped\n",
+            tel.queued, tel.sent, tel.dropped);
+#endif
+    for (int op = 0; op < 256; op++) {
+        if (st.cmds[op]) {
+            fprintf(out, "scsi 0x%02x: %lu\n", op, st.cmds[op]);
+        }
+    }
+}
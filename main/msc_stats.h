@@ -0,0 +1,56 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * MSC instrumentation. The MSC callbacks and the SD worker feed plain 32-bit
+ * counters. Each counter has one writer task, so updates need no lock and
+ * readers on the other core never see a torn value. Byte counters wrap; rates
+ * are computed from the difference of two snapshots.
+ *
+ * Every CONFIG_EXAMPLE_MSC_STATS_LOG_MS a summary line is logged. The console
+ * `stats` command prints the full set, including per-opcode command counts.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include "esp_err.h"
+
+typedef struct {
+    uint32_t read_bytes;     // sent to the host, wraps
+    uint32_t write_bytes;    // received from the host, wraps
+    uint32_t read_chunks;    // read10 callbacks served
+    uint32_t write_chunks;   // write10 callbacks served
+    uint32_t cb_us;          // time spent in read10/write10 callbacks, wraps
+    uint32_t cb_max_us;      // longest single read10/write10 callback
+    uint32_t card_us;        // time the SD worker spent in card I/O, wraps
+    uint32_t stalls;         // commands failed back to the host (STALL)
+    uint32_t queue_max;      // deepest SD worker queue seen
+    uint32_t enum_ms;        // boot to USB configured, 0 until then
+    uint32_t first_read_ms;  // boot to the first sector sent to the host
+    uint32_t cmds[256];      // commands by SCSI opcode
+} msc_stats_t;
+
+// Start the periodic log line
+esp_err_t msc_stats_init(void);
+
+// Hooks, called from the MSC callbacks (TinyUSB task)
+void msc_stats_cmd(uint8_t opcode);
+void msc_stats_read(uint32_t bytes, uint32_t us);
+void msc_stats_write(uint32_t bytes, uint32_t us);
+void msc_stats_stall(void);
+void msc_stats_enumerated(void);
+
+// Hooks, called from the SD worker
+void msc_stats_card(uint32_t us);
+void msc_stats_queue_depth(uint32_t depth);
+
+// Copy of the counters
+void msc_stats_get(msc_stats_t *stats);
+
+// Print every counter, for the console
+void msc_stats_print(FILE *out);
@@ -0,0 +1,936 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Implements the TinyUSB MSC callbacks on top of an sdmmc card. Because these
+ * callbacks live here, the stock `tusb_msc_storage` object of esp_tinyusb is
+ * never referenced and stays out of the link.
+ *
+ * TinyUSB delivers a READ(10)/WRITE(10) in chunks of MSC_XFER_SIZE bytes (see
+ * msc_config.h). Each chunk is serviced with one multi-block card command
+ * through the DMA-capable transfer buffers of msc_pipeline, so the SPI driver
+ * never has to fall back to its per-sector bounce path.
+ *
+ * With CONFIG_EXAMPLE_MSC_FLASH_LUN the device has two logical units: LUN0 is
+ * the SD card, LUN1 the `storage` flash partition served by msc_flash. Every
+ * callback dispatches on the LUN, and draining one never waits for the other.
+ *
+ * In read-only mode, chosen by CONFIG_EXAMPLE_MSC_READ_ONLY or by holding
+ * BtnA at boot, every LUN is reported write-protected: MODE SENSE sets the WP
+ * bit, and TinyUSB fails WRITE(10) with DATA PROTECT before the data phase.
+ * Card reads then go through msc_metacache first.
+ */
+
+#include <string.h>
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "diskio_impl.h"
+#include "diskio_sdmmc.h"
+#include "ff.h"
+#include "tinyusb.h"
+
+#include "msc_config.h"
+#include "msc_discard.h"
+#include "msc_flash.h"
+#include "msc_metacache.h"
+#include "msc_pipeline.h"
+#include "msc_readahead.h"
+#include "msc_stats.h"
+#include "msc_storage.h"
+#include "msc_trace.h"
+#include "msc_writeback.h"
+#include "power.h"
+#include "sd_recovery.h"
+
+#if CONFIG_EXAMPLE_MSC_RAW_PASSTHROUGH
+#define STORAGE_RAW_PASSTHROUGH 1
+#else
+#define STORAGE_RAW_PASSTHROUGH 0
+#endif
+
+#if CONFIG_EXAMPLE_MSC_UNMAP
+#define STORAGE_UNMAP 1
+#else
+#define STORAGE_UNMAP 0
+#endif
+
+#if CONFIG_EXAMPLE_MSC_FLASH_LUN
+#define STORAGE_LUNS 2
+#else
+#define STORAGE_LUNS 1
+#endif
+
+#define LUN_SD    0
+#define LUN_FLASH 1
+
+static const char *TAG = "msc_storage";
+
+/* SCSI opcodes and sense codes not provided by TinyUSB's msc.h */
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10 0x35
+#define SCSI_CMD_UNMAP                0x42
+#define SCSI_CMD_MODE_SENSE_10        0x5A
+#define SCSI_CMD_WRITE_SAME_16        0x93
+#define SCSI_CMD_SERVICE_ACTION_IN_16 0x9E
+#define SCSI_SAI_READ_CAPACITY_16     0x10
+
+#define SCSI_ASC_WRITE_FAULT             0x03
+#define SCSI_ASC_NOT_READY               0x04  // ASCQ 0x01: becoming ready
+#define SCSI_ASC_UNRECOVERED_READ_ERROR  0x11
+#define SCSI_ASC_INVALID_COMMAND_OPCODE  0x20
+#define SCSI_ASC_LBA_OUT_OF_RANGE        0x21
+#define SCSI_ASC_INVALID_FIELD_IN_CDB    0x24
+#define SCSI_ASC_INVALID_FIELD_IN_PARAM  0x26
+#define SCSI_ASC_WRITE_PROTECTED         0x27
+#define SCSI_ASC_MEDIUM_CHANGED          0x28
+#define SCSI_ASC_MEDIUM_NOT_PRESENT      0x3A
+
+#define SCSI_RESP_DEFERRED 0x71  // fixed format, deferred error
+
+typedef struct {
+    sdmmc_card_t *card;
+    volatile bool media_present;   // false after the card stopped answering
+    volatile bool unit_attention;  // medium changed, not yet told to the host
+    SemaphoreHandle_t lock;        // serializes mount/unmount
+    SemaphoreHandle_t io_lock;     // held by MSC callbacks that reach the card
+    volatile uint32_t fences;      // storage_fence() calls not yet undone
+    volatile bool no_card;         // no card answered at boot
+    bool read_only;                // the host may not write any LUN
+    bool is_fat_mounted;
+    volatile uint32_t volume_gen;
+    BYTE pdrv;
+    const char *base_path;
+    esp_vfs_fat_mount_config_t mount_config;
+    uint32_t wb_epoch;   // write-back epoch the read-ahead window belongs to
+    bool sd_write_tail;  // a WRITE(10) to the card may still be in flight
+    bool deferred[2];    // per LUN, the sense data is for an earlier command
+} msc_storage_t;
+
+static msc_storage_t s_storage;
+
+static inline uint32_t sector_size(void) {
+    return s_storage.card->csd.sector_size;
+}
+
+static inline uint32_t sector_count(void) {
+    return s_storage.card->csd.capacity;
+}
+
+static inline uint32_t lun_sector_size(uint8_t lun) {
+    return lun == LUN_FLASH ? msc_flash_sector_size() : sector_size();
+}
+
+static inline uint32_t lun_sector_count(uint8_t lun) {
+    return lun == LUN_FLASH ? msc_flash_sector_count() : sector_count();
+}
+
+// Wait for all card I/O queued on behalf of the host. From the TinyUSB task,
+// or with io_lock held. Before msc_storage_init() nothing can have been queued
+// and the caches and the pipeline do not exist yet: START STOP UNIT and
+// SYNCHRONIZE CACHE arrive during card bring-up or without a card.
+static void storage_drain(void) {
+    if (!s_storage.card) {
+        return;
+    }
+    msc_writeback_flush();
+    msc_readahead_invalidate();
+    msc_pipeline_drain();
+}
+
+/* The read-ahead ring, the write-back cache and the discard state belong to
+ * the TinyUSB task. MSC callbacks that reach them hold io_lock; another task
+ * takes it to wait for a callback still running, then raises `fences` so the
+ * callbacks after it fail storage_ready() without touching the card. Before
+ * msc_storage_init() there is no card state to protect and no lock. */
+static SemaphoreHandle_t io_begin(void) {
+    SemaphoreHandle_t lock = s_storage.io_lock;
+    if (lock) {
+        xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+    }
+    return lock;
+}
+
+static void io_end(SemaphoreHandle_t lock) {
+    if (lock) {
+        xSemaphoreGiveRecursive(lock);
+    }
+}
+
+// Keep the host off the card until storage_unfence(), once the callback
+// running and the host I/O it queued are done
+static void storage_fence(void) {
+    xSemaphoreTakeRecursive(s_storage.io_lock, portMAX_DELAY);
+    s_storage.fences++;
+    storage_drain();
+    xSemaphoreGiveRecursive(s_storage.io_lock);
+}
+
+static void storage_unfence(void) {
+    xSemaphoreTakeRecursive(s_storage.io_lock, portMAX_DELAY);
+    s_storage.fences--;
+    xSemaphoreGiveRecursive(s_storage.io_lock);
+}
+
+// Read through the read-ahead window with dirty write-back sectors on top. A
+// flush racing with the read may leave pre-flush card data in the window, so
+// the window is dropped and the read retried behind the flushed writes.
+static esp_err_t storage_read(uint32_t lba, uint8_t *dst, uint32_t count) {
+    if (msc_metacache_read(lba, dst, count)) {
+        return ESP_OK;
+    }
+    uint32_t epoch = msc_writeback_epoch();
+    if (epoch != s_storage.wb_epoch) {
+        msc_readahead_invalidate();
+        s_storage.wb_epoch = epoch;
+    }
+    ESP_RETURN_ON_ERROR(msc_readahead_read(lba, dst, count), TAG,
+                        "read lba=%lu failed", lba);
+    msc_writeback_overlay(lba, dst, count);
+
+    if (msc_writeback_epoch() != epoch) {
+        msc_readahead_invalidate();
+        s_storage.wb_epoch = msc_writeback_epoch();
+        ESP_RETURN_ON_ERROR(msc_pipeline_read(lba, dst, count), TAG,
+                            "read lba=%lu failed", lba);
+        msc_writeback_overlay(lba, dst, count);
+    }
+    msc_metacache_fill(lba, dst, count);
+    return ESP_OK;
+}
+
+// Write through the pipeline, or into the cache in write-back mode
+static esp_err_t storage_write(uint32_t lba, const uint8_t *src,
+                               uint32_t count) {
+    msc_readahead_invalidate();
+    msc_discard_written(lba, count);
+#if CONFIG_EXAMPLE_MSC_WRITE_BACK
+    return msc_writeback_write(lba, src, count);
+#else
+    return msc_pipeline_write(lba, src, count);
+#endif
+}
+
+// Wait for the queued host I/O of one LUN
+static void lun_drain(uint8_t lun) {
+    if (lun == LUN_FLASH) {
+        msc_flash_drain();
+    } else {
+        storage_drain();
+    }
+}
+
+// Report a write that failed after its command had already completed. The
+// command at hand fails with CHECK CONDITION, and REQUEST SENSE answers with
+// deferred sense data so the host does not pin the fault on it.
+static bool check_deferred_error(uint8_t lun) {
+    esp_err_t err = lun == LUN_FLASH ? msc_flash_take_error()
+                                     : msc_pipeline_take_error();
+    if (err != ESP_OK) {
+        tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_WRITE_FAULT,
+                          0x00);
+        s_storage.deferred[lun] = true;
+        return false;
+    }
+    return true;
+}
+
+// Translate a TinyUSB (lba, offset, bufsize) chunk into a sector range.
+// Returns false and sets the sense data if the range is not usable.
+static bool resolve_range(uint8_t lun, uint32_t lba, uint32_t offset,
+                          uint32_t bufsize, uint32_t *out_lba,
+                          uint32_t *out_count) {
+    const uint32_t ssize = lun_sector_size(lun);
+    if ((offset % ssize) != 0 || (bufsize % ssize) != 0) {
+        ESP_LOGE(TAG, "unaligned access lba=%lu offset=%lu size=%lu", lba,
+                 offset, bufsize);
+        tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST,
+                          SCSI_ASC_INVALID_FIELD_IN_CDB, 0x00);
+        return false;
+    }
+    *out_lba   = lba + offset / ssize;
+    *out_count = bufsize / ssize;
+    if (*out_lba + *out_count > lun_sector_count(lun)) {
+        tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST,
+                          SCSI_ASC_LBA_OUT_OF_RANGE, 0x00);
+        return false;
+    }
+    return true;
+}
+
+esp_err_t msc_storage_init(sdmmc_card_t *card) {
+    ESP_RETURN_ON_FALSE(card, ESP_ERR_INVALID_ARG, TAG, "card is NULL");
+    ESP_RETURN_ON_FALSE(card->csd.sector_size == MSC_SECTOR_SIZE,
+                        ESP_ERR_NOT_SUPPORTED, TAG,
+                        "unsupported sector size %d", card->csd.sector_size);
+
+    ESP_RETURN_ON_ERROR(msc_pipeline_init(card, MSC_XFER_SIZE), TAG,
+                        "pipeline init failed");
+    ESP_RETURN_ON_ERROR(msc_readahead_init(card, MSC_XFER_SIZE), TAG,
+                        "read-ahead init failed");
+    ESP_RETURN_ON_ERROR(msc_writeback_init(card, MSC_XFER_SECTORS), TAG,
+                        "write-back init failed");
+    ESP_RETURN_ON_ERROR(msc_discard_init(card), TAG, "discard init failed");
+    ESP_RETURN_ON_ERROR(msc_stats_init(), TAG, "stats init failed");
+    if (s_storage.read_only) {
+        ESP_RETURN_ON_ERROR(msc_metacache_init(), TAG,
+                            "metadata cache init failed");
+    }
+    s_storage.lock    = xSemaphoreCreateMutex();
+    s_storage.io_lock = xSemaphoreCreateRecursiveMutex();
+    ESP_RETURN_ON_FALSE(s_storage.lock && s_storage.io_lock, ESP_ERR_NO_MEM,
+                        TAG, "could not create storage locks");
+
+    // the host was told the unit is becoming ready, now the medium is there
+    s_storage.pdrv           = 0xFF;
+    s_storage.media_present  = true;
+    s_storage.unit_attention = true;
+    s_storage.card           = card;
+    if (STORAGE_RAW_PASSTHROUGH) {
+        s_storage.volume_gen++;
+    }
+    return ESP_OK;
+}
+
+void msc_storage_no_card(void) {
+    ESP_LOGW(TAG, "no card");
+    s_storage.no_card = true;
+}
+
+void msc_storage_media_removed(void) {
+    ESP_LOGW(TAG, "card removed");
+    msc_storage_unmount();
+    storage_fence();
+    s_storage.media_present = false;
+    msc_pipeline_take_error();
+    msc_discard_reset();
+    storage_unfence();
+}
+
+void msc_storage_media_inserted(void) {
+    ESP_LOGI(TAG, "card inserted");
+    msc_discard_init(s_storage.card);
+    msc_metacache_invalidate();
+    s_storage.unit_attention = true;
+    s_storage.media_present  = true;
+    if (STORAGE_RAW_PASSTHROUGH) {
+        s_storage.volume_gen++;
+    }
+}
+
+void msc_storage_claim(void) {
+    storage_fence();
+    msc_pipeline_take_error();
+    msc_discard_reset();
+    msc_metacache_invalidate();
+}
+
+void msc_storage_release(void) {
+    // the host may have cached the state from before the claim
+    s_storage.unit_attention = true;
+    storage_unfence();
+}
+
+void msc_storage_set_readahead(uint32_t sectors) {
+    // every reader of the ring holds io_lock
+    SemaphoreHandle_t lock = io_begin();
+    msc_readahead_set_window(sectors);
+    io_end(lock);
+}
+
+static esp_err_t storage_mount(const char *base_path,
+                               const esp_vfs_fat_mount_config_t *mount_config) {
+    esp_err_t ret = ESP_OK;
+    ESP_RETURN_ON_FALSE(s_storage.media_present, ESP_ERR_NOT_FOUND, TAG,
+                        "no card");
+    if (s_storage.is_fat_mounted) {
+        return ESP_OK;
+    }
+    s_storage.base_path    = base_path;
+    s_storage.mount_config = *mount_config;
+
+    // the application talks to the card directly, msc_storage_mount() has
+    // let the host I/O settle
+    msc_pipeline_take_error();
+    msc_discard_reset();
+    msc_metacache_invalidate();
+
+    BYTE pdrv = 0xFF;
+    ESP_RETURN_ON_ERROR(ff_diskio_get_drive(&pdrv), TAG,
+                        "The maximum count of volumes is already mounted");
+    char drv[3] = {(char)('0' + pdrv), ':', 0};
+
+    ff_diskio_register_sdmmc(pdrv, s_storage.card);
+
+    FATFS *fs = NULL;
+    FRESULT fresult;
+    ret = esp_vfs_fat_register(base_path, drv, mount_config->max_files, &fs);
+    if (ret == ESP_ERR_INVALID_STATE) {
+        // already registered with VFS, reuse the FATFS object
+        ret = ESP_OK;
+    }
+    ESP_GOTO_ON_ERROR(ret, fail, TAG, "esp_vfs_fat_register failed (0x%x)",
+                      ret);
+
+    fresult = f_mount(fs, drv, 1);
+    if (fresult == FR_NO_FILESYSTEM && mount_config->format_if_mount_failed) {
+        ESP_LOGW(TAG, "f_mount failed (%d), formatting", fresult);
+        const size_t workbuf_size = 4096;
+        void *workbuf             = ff_memalloc(workbuf_size);
+        ESP_GOTO_ON_FALSE(workbuf, ESP_ERR_NO_MEM, fail, TAG,
+                          "no memory for format work buffer");
+        size_t alloc_unit_size = esp_vfs_fat_get_allocation_unit_size(
+            sector_size(), mount_config->allocation_unit_size);
+        const MKFS_PARM opt = {(BYTE)FM_ANY, 0, 0, 0, alloc_unit_size};
+        fresult = f_mkfs(drv, &opt, workbuf, workbuf_size);
+        ff_memfree(workbuf);
+        if (fresult == FR_OK) {
+            fresult = f_mount(fs, drv, 1);
+        }
+    }
+    ESP_GOTO_ON_FALSE(fresult == FR_OK, ESP_FAIL, fail, TAG,
+                      "f_mount failed (%d)", fresult);
+
+    s_storage.pdrv           = pdrv;
+    s_storage.is_fat_mounted = true;
+    s_storage.volume_gen++;
+    return ESP_OK;
+
+fail:
+    if (fs) {
+        f_mount(NULL, drv, 0);
+    }
+    esp_vfs_fat_unregister_path(base_path);
+    ff_diskio_unregister(pdrv);
+    return ret;
+}
+
+static esp_err_t storage_unmount(void) {
+    if (!s_storage.is_fat_mounted) {
+        return ESP_OK;
+    }
+    char drv[3] = {(char)('0' + s_storage.pdrv), ':', 0};
+    f_mount(NULL, drv, 0);
+    ff_diskio_unregister(s_storage.pdrv);
+    esp_err_t ret = esp_vfs_fat_unregister_path(s_storage.base_path);
+    s_storage.pdrv           = 0xFF;
+    s_storage.is_fat_mounted = false;
+    ESP_LOGI(TAG, "storage exposed over USB");
+    return ret;
+}
+
+esp_err_t msc_storage_mount(const char *base_path,
+                            const esp_vfs_fat_mount_config_t *mount_config) {
+    ESP_RETURN_ON_FALSE(!STORAGE_RAW_PASSTHROUGH, ESP_ERR_NOT_SUPPORTED, TAG,
+                        "raw passthrough mode, nothing to mount");
+    ESP_RETURN_ON_FALSE(s_storage.card, ESP_ERR_INVALID_STATE, TAG,
+                        "storage not initialized");
+    storage_fence();
+    xSemaphoreTake(s_storage.lock, portMAX_DELAY);
+    esp_err_t ret = storage_mount(base_path, mount_config);
+    xSemaphoreGive(s_storage.lock);
+    storage_unfence();
+    return ret;
+}
+
+esp_err_t msc_storage_unmount(void) {
+    if (!s_storage.card) {
+        return ESP_OK;
+    }
+    xSemaphoreTake(s_storage.lock, portMAX_DELAY);
+    esp_err_t ret = storage_unmount();
+    xSemaphoreGive(s_storage.lock);
+    return ret;
+}
+
+uint32_t msc_storage_volume_generation(void) {
+    return s_storage.volume_gen;
+}
+
+void msc_storage_flush(void) {
+    if (s_storage.card) {
+        msc_writeback_flush();
+        msc_pipeline_drain();
+    }
+}
+
+bool msc_storage_is_mounted(void) {
+    return s_storage.is_fat_mounted;
+}
+
+void msc_storage_set_read_only(bool read_only) {
+    s_storage.read_only = read_only;
+}
+
+bool msc_storage_is_read_only(void) {
+    return s_storage.read_only;
+}
+
+/* TinyUSB callbacks
+ ********************************************************************* */
+
+// Invoked when device is mounted (configured): hand the medium to the host
+extern "C" void tud_mount_cb(void) {
+    msc_stats_enumerated();
+    power_usb_active(true);
+    if (s_storage.card) {
+        msc_storage_unmount();
+    }
+}
+
+// Invoked when device is unmounted: give the medium back to the application
+extern "C" void tud_umount_cb(void) {
+    power_usb_active(false);
+    if (s_storage.card && s_storage.base_path) {
+        if (msc_storage_mount(s_storage.base_path, &s_storage.mount_config) !=
+            ESP_OK) {
+            ESP_LOGW(TAG, "tud_umount_cb() mount fails");
+        }
+    }
+}
+
+// The host suspended the bus: nothing arrives until it resumes
+extern "C" void tud_suspend_cb(bool remote_wakeup_en) {
+    (void)remote_wakeup_en;
+    power_usb_active(false);
+}
+
+extern "C" void tud_resume_cb(void) {
+    power_usb_active(true);
+}
+
+extern "C" uint8_t tud_msc_get_maxlun_cb(void) {
+    return STORAGE_LUNS;
+}
+
+// Sets the WP bit of MODE SENSE(6); WRITE(10) to a LUN that is not writable
+// is failed by TinyUSB without calling tud_msc_write10_cb()
+extern "C" bool tud_msc_is_writable_cb(uint8_t lun) {
+    (void)lun;
+    return !s_storage.read_only;
+}
+
+// Count a command and open its trace record
+static void command_start(uint8_t lun, uint8_t opcode, uint32_t lba) {
+    // any sense data from here on is for this command
+    s_storage.deferred[lun] = false;
+    msc_stats_cmd(opcode);
+    msc_trace_begin(lun, opcode, lba);
+}
+
+// The command is failed back to the host with a STALL
+static void command_stall(void) {
+    msc_stats_stall();
+    msc_trace_failed();
+}
+
+extern "C" void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8],
+                                   uint8_t product_id[16],
+                                   uint8_t product_rev[4]) {
+    command_start(lun, SCSI_CMD_INQUIRY, 0);
+    const char vid[] = "M5Stack";
+    const char *pid  = lun == LUN_FLASH ? "AtomS3 Flash" : "AtomS3 SD Reader";
+    const char rev[] = "0.1";
+
+    memcpy(vendor_id, vid, strlen(vid));
+    memcpy(product_id, pid, strlen(pid));
+    memcpy(product_rev, rev, strlen(rev));
+}
+
+// The flash LUN is there from boot and never mounted in the application
+static bool flash_ready(uint8_t lun) {
+    if (!msc_flash_present()) {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY,
+                          SCSI_ASC_MEDIUM_NOT_PRESENT, 0x00);
+        return false;
+    }
+    return check_deferred_error(lun);
+}
+
+// Also called by read10/write10; only TEST UNIT READY itself is counted
+static bool storage_ready(uint8_t lun) {
+    if (lun == LUN_FLASH) {
+        return flash_ready(lun);
+    }
+    if (s_storage.sd_write_tail) {
+        s_storage.sd_write_tail = false;
+        msc_pipeline_drain();
+    }
+    if ((!s_storage.card && !s_storage.no_card) || sd_recovery_degraded()) {
+        // card bring-up or re-init after errors still running
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, SCSI_ASC_NOT_READY,
+                          0x01);
+        return false;
+    }
+    if (!s_storage.card || !s_storage.media_present ||
+        s_storage.is_fat_mounted || s_storage.fences > 0) {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY,
+                          SCSI_ASC_MEDIUM_NOT_PRESENT, 0x00);
+        return false;
+    }
+    if (s_storage.unit_attention) {
+        s_storage.unit_attention = false;
+        tud_msc_set_sense(lun, SCSI_SENSE_UNIT_ATTENTION,
+                          SCSI_ASC_MEDIUM_CHANGED, 0x00);
+        return false;
+    }
+    return check_deferred_error(lun);
+}
+
+// Sets the sense data for commands that would change a write-protected LUN
+static bool storage_writable(uint8_t lun) {
+    if (s_storage.read_only) {
+        tud_msc_set_sense(lun, SCSI_SENSE_DATA_PROTECT,
+                          SCSI_ASC_WRITE_PROTECTED, 0x00);
+        return false;
+    }
+    return true;
+}
+
+extern "C" bool tud_msc_test_unit_ready_cb(uint8_t lun) {
+    command_start(lun, SCSI_CMD_TEST_UNIT_READY, 0);
+    SemaphoreHandle_t lock = io_begin();
+    bool ready             = storage_ready(lun);
+    io_end(lock);
+    return ready;
+}
+
+// Invoked by TinyUSB's REQUEST SENSE, which fills in current sense data
+extern "C" int32_t tud_msc_request_sense_cb(uint8_t lun, void *buffer,
+                                            uint16_t bufsize) {
+    (void)bufsize;
+    uint8_t *sense = (uint8_t *)buffer;
+    if (s_storage.deferred[lun]) {
+        // keep the VALID bit
+        sense[0]                = (sense[0] & 0x80) | SCSI_RESP_DEFERRED;
+        s_storage.deferred[lun] = false;
+    }
+    return (int32_t)sizeof(scsi_sense_fixed_resp_t);
+}
+
+extern "C" void tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count,
+                                    uint16_t *block_size) {
+    command_start(lun, SCSI_CMD_READ_CAPACITY_10, 0);
+    if (lun == LUN_FLASH) {
+        *block_count = msc_flash_sector_count();
+        *block_size  = (uint16_t)msc_flash_sector_size();
+        return;
+    }
+    if (!s_storage.card || !s_storage.media_present) {
+        *block_count = 0;
+        *block_size  = 0;
+        return;
+    }
+    *block_count = sector_count();
+    *block_size  = (uint16_t)sector_size();
+}
+
+extern "C" bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition,
+                                      bool start, bool load_eject) {
+    (void)power_condition;
+    command_start(lun, SCSI_CMD_START_STOP_UNIT, 0);
+
+    SemaphoreHandle_t lock = io_begin();
+    lun_drain(lun);
+    io_end(lock);
+    if (lun == LUN_FLASH) {
+        return true;
+    }
+    if (load_eject && !start) {
+        // host ejected the medium, give it back to the application
+        if (s_storage.base_path &&
+            msc_storage_mount(s_storage.base_path, &s_storage.mount_config) !=
+                ESP_OK) {
+            ESP_LOGW(TAG, "tud_msc_start_stop_cb() mount fails");
+        }
+    }
+    return true;
+}
+
+static int32_t storage_read10(uint8_t lun, uint32_t lba, uint32_t offset,
+                              void *buffer, uint32_t bufsize) {
+    int64_t t0 = esp_timer_get_time();
+    uint32_t start, count;
+    if (offset == 0) {
+        command_start(lun, SCSI_CMD_READ_10, lba);
+    }
+    if (!storage_ready(lun) ||
+        !resolve_range(lun, lba, offset, bufsize, &start, &count)) {
+        command_stall();
+        return -1;
+    }
+    power_activity();
+    esp_err_t err = lun == LUN_FLASH
+                        ? msc_flash_read(start, (uint8_t *)buffer, count)
+                        : storage_read(start, (uint8_t *)buffer, count);
+    if (err != ESP_OK && lun == LUN_SD && sd_recovery_degraded()) {
+        // the card is being re-initialized: the host should just retry
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, SCSI_ASC_NOT_READY,
+                          0x01);
+        command_stall();
+        return -1;
+    }
+    if (err != ESP_OK) {
+        tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR,
+                          SCSI_ASC_UNRECOVERED_READ_ERROR, 0x00);
+        command_stall();
+        return -1;
+    }
+    uint32_t us = (uint32_t)(esp_timer_get_time() - t0);
+    msc_stats_read(bufsize, us);
+    msc_trace_data(bufsize, us);
+    return (int32_t)bufsize;
+}
+
+extern "C" int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba,
+                                     uint32_t offset, void *buffer,
+                                     uint32_t bufsize) {
+    SemaphoreHandle_t lock = io_begin();
+    int32_t ret            = storage_read10(lun, lba, offset, buffer, bufsize);
+    io_end(lock);
+    return ret;
+}
+
+static int32_t storage_write10(uint8_t lun, uint32_t lba, uint32_t offset,
+                               uint8_t *buffer, uint32_t bufsize) {
+    int64_t t0 = esp_timer_get_time();
+    uint32_t start, count;
+    if (offset == 0) {
+        command_start(lun, SCSI_CMD_WRITE_10, lba);
+    }
+    if (!storage_ready(lun) || !storage_writable(lun) ||
+        !resolve_range(lun, lba, offset, bufsize, &start, &count)) {
+        command_stall();
+        return -1;
+    }
+    power_activity();
+    esp_err_t err = lun == LUN_FLASH ? msc_flash_write(start, buffer, count)
+                                     : storage_write(start, buffer, count);
+    if (err != ESP_OK) {
+        tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_WRITE_FAULT,
+                          0x00);
+        command_stall();
+        return -1;
+    }
+    uint32_t us = (uint32_t)(esp_timer_get_time() - t0);
+    msc_stats_write(bufsize, us);
+    msc_trace_data(bufsize, us);
+    return (int32_t)bufsize;
+}
+
+extern "C" int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba,
+                                      uint32_t offset, uint8_t *buffer,
+                                      uint32_t bufsize) {
+    SemaphoreHandle_t lock = io_begin();
+    int32_t ret            = storage_write10(lun, lba, offset, buffer,
+                                             bufsize);
+    io_end(lock);
+    return ret;
+}
+
+// Invoked after the status of a WRITE(10) was queued. Holding the TinyUSB task
+// here until the medium has the data keeps the next command ordered behind it.
+// With two LUNs the card is only waited for by the next command to LUN0, so a
+// slow card write does not hold up the flash LUN.
+extern "C" void tud_msc_write10_complete_cb(uint8_t lun) {
+    if (lun == LUN_FLASH) {
+        msc_flash_drain();
+    } else if (STORAGE_LUNS > 1) {
+        s_storage.sd_write_tail = true;
+    } else {
+        msc_pipeline_drain();
+    }
+    // the wait for the medium above is part of the command
+    msc_trace_end(lun, SCSI_CMD_WRITE_10);
+}
+
+#if CONFIG_EXAMPLE_MSC_TRACE
+// Invoked after the status of any other command was queued, to close its trace
+// record
+extern "C" void tud_msc_read10_complete_cb(uint8_t lun) {
+    msc_trace_end(lun, SCSI_CMD_READ_10);
+}
+
+extern "C" void tud_msc_scsi_complete_cb(uint8_t lun,
+                                         uint8_t const scsi_cmd[16]) {
+    msc_trace_end(lun, scsi_cmd[0]);
+}
+#endif  // CONFIG_EXAMPLE_MSC_TRACE
+
+static inline uint32_t get_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// READ CAPACITY(16): as READ CAPACITY(10), plus logical block provisioning.
+// The physical block exponent stays 0: an allocation unit of several MiB is an
+// erase grain, not a block size, and the card writes 512 byte sectors.
+// TinyUSB answers INQUIRY itself, so the grain cannot be offered as UNMAP
+// granularity in the Block Limits VPD page; msc_discard and the pipeline apply
+// it instead.
+static int32_t read_capacity_16(uint8_t lun, const uint8_t *cdb,
+                                uint8_t *buf, uint16_t bufsize) {
+    if (!storage_ready(lun)) {
+        return -1;
+    }
+    uint8_t resp[32] = {};
+    put_be32(&resp[4], lun_sector_count(lun) - 1);  // upper 32 bits stay 0
+    put_be32(&resp[8], lun_sector_size(lun));
+    if (lun == LUN_SD) {
+        if (STORAGE_UNMAP && !s_storage.read_only) {
+            resp[14] = 0x80;  // LBPME: UNMAP is supported
+        }
+    }
+    uint32_t len = get_be32(&cdb[10]);
+    len          = len < sizeof(resp) ? len : sizeof(resp);
+    len          = len < bufsize ? len : bufsize;
+    memcpy(buf, resp, len);
+    return (int32_t)len;
+}
+
+// Discard one host range, with the host I/O already drained
+static bool discard_sectors(uint8_t lun, uint32_t lba_hi, uint32_t lba,
+                            uint32_t count) {
+    if (lba_hi != 0 || lba > sector_count() || count > sector_count() - lba) {
+        tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST,
+                          SCSI_ASC_LBA_OUT_OF_RANGE, 0x00);
+        return false;
+    }
+    if (msc_discard_range(lba, count) != ESP_OK) {
+        tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_WRITE_FAULT,
+                          0x00);
+        return false;
+    }
+    return true;
+}
+
+// UNMAP: an 8 byte header, then 16 byte descriptors of LBA (8) and count (4)
+static int32_t storage_unmap(uint8_t lun, const uint8_t *params,
+                             uint16_t len) {
+    if (!storage_ready(lun)) {
+        return -1;
+    }
+    if (len < 8) {
+        return 0;  // parameter list length 0: nothing to do
+    }
+    const uint32_t desc_len = ((uint32_t)params[2] << 8) | params[3];
+    if (desc_len > (uint32_t)len - 8 || desc_len % 16 != 0) {
+        tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST,
+                          SCSI_ASC_INVALID_FIELD_IN_PARAM, 0x00);
+        return -1;
+    }
+    storage_drain();
+    for (uint32_t off = 8; off < 8 + desc_len; off += 16) {
+        const uint8_t *desc = &params[off];
+        if (!discard_sectors(lun, get_be32(&desc[0]), get_be32(&desc[4]),
+                             get_be32(&desc[8]))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// WRITE SAME(16) with the UNMAP bit, which hosts without the logical block
+// provisioning VPD page use to discard. The data block is ignored.
+static int32_t storage_write_same_16(uint8_t lun, const uint8_t *cdb) {
+    if (!(cdb[1] & 0x08)) {
+        tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST,
+                          SCSI_ASC_INVALID_FIELD_IN_CDB, 0x00);
+        return -1;
+    }
+    if (!storage_ready(lun)) {
+        return -1;
+    }
+    uint32_t lba   = get_be32(&cdb[6]);
+    uint32_t count = get_be32(&cdb[10]);
+    if (count == 0 && lba < sector_count()) {
+        count = sector_count() - lba;  // 0: up to the end of the medium
+    }
+    storage_drain();
+    return discard_sectors(lun, get_be32(&cdb[2]), lba, count) ? 0 : -1;
+}
+
+// MODE SENSE(10), which TinyUSB leaves to the application: the header only,
+// for the WP bit, with no block descriptor or mode pages
+static int32_t mode_sense_10(uint8_t lun, uint8_t *buf, uint16_t bufsize) {
+    (void)lun;
+    uint8_t resp[8] = {};
+    resp[1]         = sizeof(resp) - 2;  // mode data length
+    resp[3]         = s_storage.read_only ? 0x80 : 0x00;
+    uint32_t len    = sizeof(resp) < bufsize ? sizeof(resp) : bufsize;
+    memcpy(buf, resp, len);
+    return (int32_t)len;
+}
+
+static int32_t storage_scsi(uint8_t lun, uint8_t const scsi_cmd[16],
+                            void *buffer, uint16_t bufsize) {
+    const bool unmap = STORAGE_UNMAP && lun == LUN_SD;
+    int32_t ret;
+
+    switch (scsi_cmd[0]) {
+        case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+            return 0;
+        case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+            lun_drain(lun);
+            if (!check_deferred_error(lun)) {
+                command_stall();
+                return -1;
+            }
+            return 0;
+        case SCSI_CMD_SERVICE_ACTION_IN_16:
+            if ((scsi_cmd[1] & 0x1F) != SCSI_SAI_READ_CAPACITY_16) {
+                break;
+            }
+            ret = read_capacity_16(lun, scsi_cmd, (uint8_t *)buffer, bufsize);
+            if (ret < 0) {
+                command_stall();
+            }
+            return ret;
+        case SCSI_CMD_MODE_SENSE_10:
+            return mode_sense_10(lun, (uint8_t *)buffer, bufsize);
+        case SCSI_CMD_UNMAP:
+        case SCSI_CMD_WRITE_SAME_16:
+            if (!unmap) {
+                break;
+            }
+            if (!storage_writable(lun)) {
+                command_stall();
+                return -1;
+            }
+            ret = scsi_cmd[0] == SCSI_CMD_UNMAP
+                      ? storage_unmap(lun, (const uint8_t *)buffer, bufsize)
+                      : storage_write_same_16(lun, scsi_cmd);
+            if (ret < 0) {
+                command_stall();
+            }
+            return ret;
+        default:
+            break;
+    }
+    ESP_LOGW(TAG, "tud_msc_scsi_cb() invoked: %d", scsi_cmd[0]);
+    tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST,
+                      SCSI_ASC_INVALID_COMMAND_OPCODE, 0x00);
+    command_stall();
+    return -1;
+}
+
+// Invoked for SCSI commands not handled by TinyUSB itself
+extern "C" int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16],
+                                   void *buffer, uint16_t bufsize) {
+    command_start(lun, scsi_cmd[0], 0);
+    SemaphoreHandle_t lock = io_begin();
+    int32_t ret            = storage_scsi(lun, scsi_cmd, buffer, bufsize);
+    io_end(lock);
+    return ret;
+}
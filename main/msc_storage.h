@@ -0,0 +1,68 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * SD card storage backend for the TinyUSB MSC class. It replaces the stock
+ * `tusb_msc_storage` sdmmc glue: every READ(10)/WRITE(10) chunk handed over
+ * by TinyUSB is served with a single multi-block sdmmc_read_sectors() /
+ * sdmmc_write_sectors() call (CMD18/CMD25) through a DMA-capable transfer
+ * buffer of MSC_XFER_SIZE bytes.
+ */
+
+#pragma once
+
+#include "esp_err.h"
+#include "esp_vfs_fat.h"
+#include "sdmmc_cmd.h"
+
+// Attach the backend to an initialized card and allocate the transfer buffer.
+// Until then the host is answered NOT READY, becoming ready; afterwards it is
+// told once that the medium changed.
+esp_err_t msc_storage_init(sdmmc_card_t *card);
+
+// No card answered at boot: until msc_storage_init() the host is told the
+// medium is not present instead of becoming ready
+void msc_storage_no_card(void);
+
+// The card stopped answering: unmount it from the application and report the
+// medium as not present
+void msc_storage_media_removed(void);
+
+// A card was initialized again after msc_storage_media_removed()
+void msc_storage_media_inserted(void);
+
+// Mount the card in the application at base_path. While mounted, the host
+// sees the medium as not present. ESP_ERR_NOT_SUPPORTED in raw passthrough
+// mode.
+esp_err_t msc_storage_mount(const char *base_path,
+                            const esp_vfs_fat_mount_config_t *mount_config);
+
+// Unmount the card from the application and expose it to the host
+esp_err_t msc_storage_unmount(void);
+
+// Incremented by every mount in the application. In raw passthrough mode,
+// where nothing is ever mounted, by every card attach instead.
+uint32_t msc_storage_volume_generation(void);
+
+// Keep the host off the card, without mounting it, until
+// msc_storage_release(). An MSC callback still running and the host I/O it
+// queued are finished first. Nests.
+void msc_storage_claim(void);
+void msc_storage_release(void);
+
+// Resize the read-ahead window, from any task, between two MSC callbacks
+void msc_storage_set_readahead(uint32_t sectors);
+
+// Write out cached host data and wait until it reached the card
+void msc_storage_flush(void);
+
+// true while the card is mounted in the application
+bool msc_storage_is_mounted(void);
+
+// Expose every LUN write-protected, and cache the card's file system metadata.
+// Before msc_storage_init() and tinyusb_driver_install().
+void msc_storage_set_read_only(bool read_only);
+bool msc_storage_is_read_only(void);
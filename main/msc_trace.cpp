@@ -0,0 +1,120 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "msc_trace.h"
+
+#define TRACE_ENTRIES CONFIG_EXAMPLE_MSC_TRACE_ENTRIES
+
+static_assert(sizeof(msc_trace_record_t) == 32, "trace record layout changed");
+
+/* `head` counts every record stored, the ring holds the last TRACE_ENTRIES.
+ * The totals only grow; a command takes their difference over its lifetime. */
+typedef struct {
+    msc_trace_record_t ring[TRACE_ENTRIES];
+    volatile uint32_t head;
+    volatile uint32_t dropped;
+    volatile bool paused;    // a dump is reading the ring
+    msc_trace_record_t cur;  // command in progress
+    bool open;               // `cur` was begun and not yet ended
+    uint32_t queue_base;     // totals when `cur` began
+    uint32_t card_base;
+    volatile uint32_t queue_total;  // written by the SD worker only
+    volatile uint32_t card_total;
+} msc_trace_t;
+
+static msc_trace_t s_trace;
+
+static void store(msc_trace_record_t *rec) {
+    if (s_trace.paused) {
+        s_trace.dropped++;
+        return;
+    }
+    s_trace.ring[s_trace.head % TRACE_ENTRIES] = *rec;
+    s_trace.head++;
+}
+
+void msc_trace_begin(uint8_t lun, uint8_t opcode, uint32_t lba) {
+    if (s_trace.open) {
+        // TinyUSB did not report the status of the last one
+        msc_trace_end(s_trace.cur.lun, s_trace.cur.opcode);
+    }
+    memset(&s_trace.cur, 0, sizeof(s_trace.cur));
+    s_trace.cur.start_us = msc_trace_now();
+    s_trace.cur.lba      = lba;
+    s_trace.cur.opcode   = opcode;
+    s_trace.cur.lun      = lun;
+    s_trace.queue_base   = s_trace.queue_total;
+    s_trace.card_base    = s_trace.card_total;
+    s_trace.open         = true;
+}
+
+void msc_trace_data(uint32_t bytes, uint32_t cb_us) {
+    s_trace.cur.bytes += bytes;
+    s_trace.cur.cb_us += cb_us;
+}
+
+void msc_trace_failed(void) {
+    s_trace.cur.flags |= MSC_TRACE_FAILED;
+}
+
+void msc_trace_end(uint8_t lun, uint8_t opcode) {
+    if (!s_trace.open || s_trace.cur.opcode != opcode) {
+        // answered by TinyUSB itself, no callback saw it begin
+        msc_trace_begin(lun, opcode, 0);
+    }
+    s_trace.cur.total_us = msc_trace_now() - s_trace.cur.start_us;
+    s_trace.cur.queue_us = s_trace.queue_total - s_trace.queue_base;
+    s_trace.cur.card_us  = s_trace.card_total - s_trace.card_base;
+    s_trace.open         = false;
+    store(&s_trace.cur);
+}
+
+void msc_trace_card(uint32_t queued_us, uint32_t start_us, uint32_t end_us) {
+    s_trace.queue_total += start_us - queued_us;
+    s_trace.card_total += end_us - start_us;
+}
+
+static void print_hex(FILE *out, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < len; i++) {
+        fprintf(out, "%02x", p[i]);
+    }
+    fprintf(out, "\n");
+}
+
+void msc_trace_dump(FILE *out) {
+    s_trace.paused = true;
+    // let a record the TinyUSB task is storing right now land
+    vTaskDelay(1);
+
+    uint32_t head  = s_trace.head;
+    uint32_t count = head < TRACE_ENTRIES ? head : TRACE_ENTRIES;
+
+    msc_trace_header_t header = {
+        .magic       = MSC_TRACE_MAGIC,
+        .version     = MSC_TRACE_VERSION,
+        .record_size = sizeof(msc_trace_record_t),
+        .count       = count,
+        .dropped     = s_trace.dropped,
+        .now_us      = msc_trace_now(),
+    };
+    fprintf(out, "MSC_TRACE_BEGIN\n");
+    print_hex(out, &header, sizeof(header));
+    for (uint32_t i = head - count; i != head; i++) {
+        print_hex(out, &s_trace.ring[i % TRACE_ENTRIES],
+                  sizeof(msc_trace_record_t));
+    }
+    fprintf(out, "MSC_TRACE_END\n");
+
+    s_trace.head    = 0;
+    s_trace.dropped = 0;
+    s_trace.paused  = false;
+}
@@ -0,0 +1,99 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Per-command trace of the MSC callback path, enabled with
+ * CONFIG_EXAMPLE_MSC_TRACE. One fixed-size record per SCSI command goes into
+ * a ring of CONFIG_EXAMPLE_MSC_TRACE_ENTRIES, from the first callback of the
+ * command until TinyUSB sent its status. Besides opcode, LBA, bytes and
+ * result it holds the time spent in the MSC callbacks, the rest of the total
+ * being USB transfer and host time, and how long SD jobs waited for and ran
+ * in the SD worker while the command was open. With read-ahead and
+ * asynchronous writes, card time overlaps with USB time.
+ *
+ * The TinyUSB task is the only writer of the ring and the SD worker the only
+ * writer of the phase totals, so no lock is taken on the hot path. A dump
+ * stops recording while it runs. Records are written out as hex lines
+ * between MSC_TRACE_BEGIN and MSC_TRACE_END; tools/msc_trace.py decodes them.
+ *
+ * Without CONFIG_EXAMPLE_MSC_TRACE the hooks below are empty inline functions.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include "sdkconfig.h"
+#include "esp_timer.h"
+
+#define MSC_TRACE_MAGIC   0x5443534d  // "MSCT"
+#define MSC_TRACE_VERSION 1
+
+#define MSC_TRACE_FAILED 0x01  // flags: the command was answered with a STALL
+
+// Dump header, followed by `count` records, oldest first. Little endian, as
+// stored on the device.
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t count;
+    uint32_t dropped;  // commands not recorded while a dump ran
+    uint32_t now_us;   // time of the dump, same clock as start_us
+} msc_trace_header_t;
+
+typedef struct {
+    uint32_t start_us;  // first callback, low 32 bits of esp_timer_get_time()
+    uint32_t total_us;  // until the status was sent
+    uint32_t cb_us;     // in the MSC callbacks
+    uint32_t queue_us;  // SD jobs waiting for the worker
+    uint32_t card_us;   // SD worker in card I/O
+    uint32_t lba;
+    uint32_t bytes;  // data moved over USB
+    uint8_t opcode;
+    uint8_t lun;
+    uint8_t flags;
+    uint8_t reserved;
+} msc_trace_record_t;
+
+#if CONFIG_EXAMPLE_MSC_TRACE
+
+static inline uint32_t msc_trace_now(void) {
+    return (uint32_t)esp_timer_get_time();
+}
+
+// Hooks, called from the MSC callbacks (TinyUSB task)
+void msc_trace_begin(uint8_t lun, uint8_t opcode, uint32_t lba);
+void msc_trace_data(uint32_t bytes, uint32_t cb_us);
+void msc_trace_failed(void);
+void msc_trace_end(uint8_t lun, uint8_t opcode);
+
+// Hook, called from the SD worker for every job: queued_us is the
+// msc_trace_now() of its submission
+void msc_trace_card(uint32_t queued_us, uint32_t start_us, uint32_t end_us);
+
+// Print the ring to `out` and clear it
+void msc_trace_dump(FILE *out);
+
+#else
+
+static inline uint32_t msc_trace_now(void) {
+    return 0;
+}
+
+static inline void msc_trace_begin(uint8_t lun, uint8_t opcode,
+                                   uint32_t lba) {}
+
+static inline void msc_trace_data(uint32_t bytes, uint32_t cb_us) {}
+
+static inline void msc_trace_failed(void) {}
+
+static inline void msc_trace_end(uint8_t lun, uint8_t opcode) {}
+
+static inline void msc_trace_card(uint32_t queued_us, uint32_t start_us,
+                                  uint32_t end_us) {}
+
+#endif  // CONFIG_EXAMPLE_MSC_TRACE
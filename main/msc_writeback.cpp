@@ -0,0 +1,215 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "msc_config.h"
+#include "msc_pipeline.h"
+#include "msc_pool.h"
+#include "msc_writeback.h"
+#include "task_layout.h"
+
+#define WB_MAX_RUN MSC_XFER_SECTORS
+#define WB_EMPTY   (-1)
+
+#define WB_FLUSH_TASK_CORE       TASK_LAYOUT_WB_CORE
+#define WB_FLUSH_TASK_PRIORITY   TASK_LAYOUT_WB_PRIORITY
+#define WB_FLUSH_TASK_STACK_SIZE 3072
+
+static const char *TAG = "msc_writeback";
+
+/* Dirty sectors are stored in insertion order in `data`/`lbas` and found
+ * through an open-addressing hash table. Entries are never removed one by
+ * one: a flush writes all of them and clears the table. */
+typedef struct {
+    uint32_t ssize;
+    uint32_t run_sectors;
+    int capacity;
+    int used;
+    uint8_t *data;
+    uint32_t *lbas;
+    uint16_t *order;  // scratch for sorting at flush
+    int16_t *table;
+    uint32_t table_mask;
+    SemaphoreHandle_t lock;
+    esp_timer_handle_t timer;
+    TaskHandle_t flusher;
+    volatile uint32_t flush_ms;  // idle time before the timer flushes
+    volatile uint32_t epoch;  // bumped by every flush that wrote something
+    msc_writeback_stats_t stats;
+} msc_writeback_t;
+
+static msc_writeback_t s_wb = {
+    .flush_ms = CONFIG_EXAMPLE_MSC_WRITEBACK_FLUSH_MS,
+};
+
+static int wb_lookup(uint32_t lba, uint32_t *bucket) {
+    uint32_t b = lba & s_wb.table_mask;
+    while (s_wb.table[b] != WB_EMPTY) {
+        if (s_wb.lbas[s_wb.table[b]] == lba) {
+            break;
+        }
+        b = (b + 1) & s_wb.table_mask;
+    }
+    *bucket = b;
+    return s_wb.table[b];
+}
+
+static int wb_compare(const void *a, const void *b) {
+    uint32_t la = s_wb.lbas[*(const uint16_t *)a];
+    uint32_t lb = s_wb.lbas[*(const uint16_t *)b];
+    return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+static void wb_flush_locked(void) {
+    if (s_wb.used == 0) {
+        return;
+    }
+    for (int i = 0; i < s_wb.used; i++) {
+        s_wb.order[i] = i;
+    }
+    qsort(s_wb.order, s_wb.used, sizeof(s_wb.order[0]), wb_compare);
+
+    const uint8_t *srcs[WB_MAX_RUN];
+    int i = 0;
+    while (i < s_wb.used) {
+        uint32_t start = s_wb.lbas[s_wb.order[i]];
+        uint32_t n     = 0;
+        while (i + n < (uint32_t)s_wb.used && n < s_wb.run_sectors &&
+               s_wb.lbas[s_wb.order[i + n]] == start + n) {
+            srcs[n] = s_wb.data + s_wb.order[i + n] * s_wb.ssize;
+            n++;
+        }
+        msc_pipeline_write_gather(start, srcs, n);
+        s_wb.stats.writes++;
+        i += n;
+    }
+
+    ESP_LOGD(TAG, "flushed %d sectors", s_wb.used);
+    s_wb.stats.flushes++;
+    s_wb.stats.flushed += s_wb.used;
+    s_wb.used = 0;
+    memset(s_wb.table, 0xff, (s_wb.table_mask + 1) * sizeof(s_wb.table[0]));
+    s_wb.epoch++;
+}
+
+// A flush waits for free transfer slots, which must not hold up the shared
+// esp_timer task: the timer only wakes the flush task
+static void wb_timer_cb(void *arg) {
+    (void)arg;
+    xTaskNotifyGive(s_wb.flusher);
+}
+
+static void wb_flush_task(void *arg) {
+    (void)arg;
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        msc_writeback_flush();
+    }
+}
+
+esp_err_t msc_writeback_init(sdmmc_card_t *card, uint32_t run_sectors) {
+    s_wb.ssize       = card->csd.sector_size;
+    s_wb.run_sectors = run_sectors < WB_MAX_RUN ? run_sectors : WB_MAX_RUN;
+    s_wb.capacity    = CONFIG_EXAMPLE_MSC_WRITEBACK_SECTORS;
+
+    uint32_t table_size = 1;
+    while (table_size < 2 * (uint32_t)s_wb.capacity) {
+        table_size <<= 1;
+    }
+    s_wb.table_mask = table_size - 1;
+
+    s_wb.data  = (uint8_t *)msc_pool_alloc(s_wb.capacity * s_wb.ssize);
+    s_wb.lbas  = (uint32_t *)calloc(s_wb.capacity, sizeof(uint32_t));
+    s_wb.order = (uint16_t *)calloc(s_wb.capacity, sizeof(uint16_t));
+    s_wb.table = (int16_t *)malloc(table_size * sizeof(int16_t));
+    s_wb.lock  = xSemaphoreCreateMutex();
+    ESP_RETURN_ON_FALSE(s_wb.data && s_wb.lbas && s_wb.order && s_wb.table &&
+                            s_wb.lock,
+                        ESP_ERR_NO_MEM, TAG,
+                        "could not allocate %d sector write-back cache",
+                        s_wb.capacity);
+    memset(s_wb.table, 0xff, table_size * sizeof(int16_t));
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = wb_timer_cb,
+        .name     = "msc_wb_flush",
+    };
+    ESP_RETURN_ON_ERROR(esp_timer_create(&timer_args, &s_wb.timer), TAG,
+                        "could not create flush timer");
+    BaseType_t ok = xTaskCreatePinnedToCore(
+        wb_flush_task, "msc_wb", WB_FLUSH_TASK_STACK_SIZE, NULL,
+        WB_FLUSH_TASK_PRIORITY, &s_wb.flusher, WB_FLUSH_TASK_CORE);
+    ESP_RETURN_ON_FALSE(ok == pdPASS, ESP_ERR_NO_MEM, TAG,
+                        "could not create flush task");
+
+    ESP_LOGI(TAG, "write-back cache %d sectors, flush after %d ms",
+             s_wb.capacity, s_wb.flush_ms);
+    return ESP_OK;
+}
+
+esp_err_t msc_writeback_write(uint32_t lba, const uint8_t *src,
+                              uint32_t count) {
+    xSemaphoreTake(s_wb.lock, portMAX_DELAY);
+    for (uint32_t i = 0; i < count; i++, lba++, src += s_wb.ssize) {
+        uint32_t bucket;
+        int idx = wb_lookup(lba, &bucket);
+        if (idx == WB_EMPTY) {
+            if (s_wb.used == s_wb.capacity) {
+                wb_flush_locked();
+                wb_lookup(lba, &bucket);
+            }
+            idx                = s_wb.used++;
+            s_wb.lbas[idx]     = lba;
+            s_wb.table[bucket] = idx;
+        }
+        memcpy(s_wb.data + idx * s_wb.ssize, src, s_wb.ssize);
+    }
+    s_wb.stats.cached += count;
+    xSemaphoreGive(s_wb.lock);
+
+    esp_timer_stop(s_wb.timer);
+    esp_timer_start_once(s_wb.timer, s_wb.flush_ms * 1000ULL);
+    return ESP_OK;
+}
+
+void msc_writeback_overlay(uint32_t lba, uint8_t *dst, uint32_t count) {
+    xSemaphoreTake(s_wb.lock, portMAX_DELAY);
+    for (uint32_t i = 0; s_wb.used > 0 && i < count;
+         i++, lba++, dst += s_wb.ssize) {
+        uint32_t bucket;
+        int idx = wb_lookup(lba, &bucket);
+        if (idx != WB_EMPTY) {
+            memcpy(dst, s_wb.data + idx * s_wb.ssize, s_wb.ssize);
+        }
+    }
+    xSemaphoreGive(s_wb.lock);
+}
+
+void msc_writeback_flush(void) {
+    xSemaphoreTake(s_wb.lock, portMAX_DELAY);
+    wb_flush_locked();
+    xSemaphoreGive(s_wb.lock);
+}
+
+void msc_writeback_set_flush_ms(uint32_t flush_ms) {
+    s_wb.flush_ms = flush_ms;
+}
+
+uint32_t msc_writeback_epoch(void) {
+    return s_wb.epoch;
+}
+
+void msc_writeback_get_stats(msc_writeback_stats_t *stats) {
+    *stats = s_wb.stats;
+}
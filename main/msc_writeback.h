@@ -0,0 +1,80 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Optional write-back sector cache between the MSC callbacks and the card,
+ * enabled with CONFIG_EXAMPLE_MSC_WRITE_BACK. Host writes land in RAM and are
+ * written out sorted by LBA, adjacent dirty sectors merged into one
+ * multi-block write. The cache is flushed when it is full, after
+ * CONFIG_EXAMPLE_MSC_WRITEBACK_FLUSH_MS without writes (adjustable at
+ * runtime), on SYNCHRONIZE CACHE, on START STOP UNIT and before the
+ * application takes the card or restarts.
+ *
+ * In the default write-through build the functions below are no-ops.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "sdmmc_cmd.h"
+
+typedef struct {
+    uint32_t cached;   // sectors written by the host into the cache
+    uint32_t flushes;  // number of flushes that wrote something
+    uint32_t flushed;  // sectors written to the card
+    uint32_t writes;   // multi-block card writes issued by flushes
+} msc_writeback_stats_t;
+
+#if CONFIG_EXAMPLE_MSC_WRITE_BACK
+
+// Allocate the cache; flushes are issued in runs of at most run_sectors
+esp_err_t msc_writeback_init(sdmmc_card_t *card, uint32_t run_sectors);
+
+// Store `count` sectors from src at `lba` in the cache
+esp_err_t msc_writeback_write(uint32_t lba, const uint8_t *src,
+                              uint32_t count);
+
+// Patch dirty sectors over data just read from the card
+void msc_writeback_overlay(uint32_t lba, uint8_t *dst, uint32_t count);
+
+// Queue every dirty sector for writing; msc_pipeline_drain() waits for them
+void msc_writeback_flush(void);
+
+// Idle time after the last host write before the cache is flushed; applies
+// from the next write
+void msc_writeback_set_flush_ms(uint32_t flush_ms);
+
+// Changes whenever a flush moved dirty sectors out of the cache. Data that was
+// read from the card before the change may predate the flushed writes.
+uint32_t msc_writeback_epoch(void);
+
+void msc_writeback_get_stats(msc_writeback_stats_t *stats);
+
+#else
+
+static inline esp_err_t msc_writeback_init(sdmmc_card_t *card,
+                                           uint32_t run_sectors) {
+    return ESP_OK;
+}
+
+static inline void msc_writeback_overlay(uint32_t lba, uint8_t *dst,
+                                         uint32_t count) {}
+
+static inline void msc_writeback_flush(void) {}
+
+static inline void msc_writeback_set_flush_ms(uint32_t flush_ms) {}
+
+static inline uint32_t msc_writeback_epoch(void) {
+    return 0;
+}
+
+static inline void msc_writeback_get_stats(msc_writeback_stats_t *stats) {
+    *stats = {};
+}
+
+#endif  // CONFIG_EXAMPLE_MSC_WRITE_BACK
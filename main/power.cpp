@@ -0,0 +1,242 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdio.h>
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#include "msc_stats.h"
+#include "power.h"
+
+#ifdef CONFIG_EXAMPLE_PM_DFS
+#define POWER_DFS 1
+#else
+#define POWER_DFS 0
+#endif
+
+#ifdef CONFIG_EXAMPLE_PM_LIGHT_SLEEP
+#define POWER_LIGHT_SLEEP 1
+#else
+#define POWER_LIGHT_SLEEP 0
+#endif
+
+#define POWER_MAX_FREQ_MHZ 240
+#define POWER_MIN_FREQ_MHZ 80
+
+static const char *TAG = "power";
+
+typedef struct {
+    esp_pm_lock_handle_t boost;  // CPU_FREQ_MAX while transfers run
+    esp_pm_lock_handle_t awake;  // NO_LIGHT_SLEEP while USB is active
+    esp_timer_handle_t idle_timer;
+    volatile bool boosted;  // transfers running, the boost is wanted
+    bool boost_held;        // the boost lock is acquired
+    bool boost_syncing;     // a caller of sync_boost() is changing it
+    bool usb_active;
+    uint32_t last_chunks;
+    int64_t since;  // start of the current state
+    power_stats_t stats;
+    portMUX_TYPE lock;
+} power_t;
+
+static power_t s_power = {
+    .stats = {.state = POWER_IDLE},
+    .lock  = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static const char *const s_state_names[POWER_STATE_COUNT] = {
+    "boost",
+    "idle",
+    "low",
+};
+
+// Close the current state interval and enter the one the flags describe.
+// Called with the lock held.
+static void account(void) {
+    int64_t now = esp_timer_get_time();
+    s_power.stats.us[s_power.stats.state] += now - s_power.since;
+    s_power.since       = now;
+    s_power.stats.state = s_power.boosted      ? POWER_BOOST
+                          : s_power.usb_active ? POWER_IDLE
+                                               : POWER_LOW;
+}
+
+static void lock_take(esp_pm_lock_handle_t lock) {
+    if (lock) {
+        esp_pm_lock_acquire(lock);
+    }
+}
+
+static void lock_give(esp_pm_lock_handle_t lock) {
+    if (lock) {
+        esp_pm_lock_release(lock);
+    }
+}
+
+/* Bring the boost lock in line with `boosted`, which callers change under
+ * s_power.lock. The acquire and release themselves cannot run in the critical
+ * section, so only one caller at a time does them, until the lock matches the
+ * latest `boosted`; one arriving meanwhile leaves its change to that caller.
+ * That way every release follows an acquire. */
+static void sync_boost(void) {
+    portENTER_CRITICAL(&s_power.lock);
+    if (s_power.boost_syncing) {
+        portEXIT_CRITICAL(&s_power.lock);
+        return;
+    }
+    s_power.boost_syncing = true;
+    while (s_power.boost_held != s_power.boosted) {
+        bool take = s_power.boosted;
+        portEXIT_CRITICAL(&s_power.lock);
+        if (take) {
+            lock_take(s_power.boost);
+        } else {
+            lock_give(s_power.boost);
+        }
+        portENTER_CRITICAL(&s_power.lock);
+        s_power.boost_held = take;
+    }
+    s_power.boost_syncing = false;
+    portEXIT_CRITICAL(&s_power.lock);
+}
+
+#if POWER_DFS
+// Drop the boost once a whole period passed without a data chunk
+static void idle_check_cb(void *arg) {
+    (void)arg;
+    // msc_stats_t is large, keep the snapshot off the stack
+    static msc_stats_t stats;
+    msc_stats_get(&stats);
+    uint32_t chunks = stats.read_chunks + stats.write_chunks;
+
+    bool drop = false;
+    portENTER_CRITICAL(&s_power.lock);
+    if (s_power.boosted && chunks == s_power.last_chunks) {
+        s_power.boosted = false;
+        drop            = true;
+        account();
+    }
+    s_power.last_chunks = chunks;
+    portEXIT_CRITICAL(&s_power.lock);
+    if (drop) {
+        sync_boost();
+    }
+}
+#endif  // POWER_DFS
+
+esp_err_t power_init(void) {
+    s_power.usb_active = true;
+    s_power.since      = esp_timer_get_time();
+#if POWER_DFS
+    const esp_pm_config_t pm_config = {
+        .max_freq_mhz       = POWER_MAX_FREQ_MHZ,
+        .min_freq_mhz       = POWER_MIN_FREQ_MHZ,
+        .light_sleep_enable = POWER_LIGHT_SLEEP,
+    };
+    ESP_RETURN_ON_ERROR(esp_pm_configure(&pm_config), TAG,
+                        "could not configure power management");
+    ESP_RETURN_ON_ERROR(
+        esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "msc_boost", &s_power.boost),
+        TAG, "could not create the boost lock");
+    if (POWER_LIGHT_SLEEP) {
+        // USB is brought up right after this
+        ESP_RETURN_ON_ERROR(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0,
+                                               "usb_awake", &s_power.awake),
+                            TAG, "could not create the awake lock");
+        lock_take(s_power.awake);
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = idle_check_cb,
+        .name     = "power_idle",
+    };
+    ESP_RETURN_ON_ERROR(esp_timer_create(&timer_args, &s_power.idle_timer),
+                        TAG, "could not create idle timer");
+    ESP_RETURN_ON_ERROR(esp_timer_start_periodic(
+                            s_power.idle_timer,
+                            CONFIG_EXAMPLE_PM_IDLE_MS * 1000ULL),
+                        TAG, "could not start idle timer");
+    ESP_LOGI(TAG, "%d-%d MHz, light sleep %s", POWER_MIN_FREQ_MHZ,
+             POWER_MAX_FREQ_MHZ, POWER_LIGHT_SLEEP ? "on" : "off");
+#else
+    ESP_LOGI(TAG, "fixed CPU clock");
+#endif  // POWER_DFS
+    return ESP_OK;
+}
+
+void power_activity(void) {
+    if (s_power.boosted) {
+        return;
+    }
+    portENTER_CRITICAL(&s_power.lock);
+    bool was_boosted = s_power.boosted;
+    s_power.boosted  = true;
+    account();
+    portEXIT_CRITICAL(&s_power.lock);
+    if (!was_boosted) {
+        sync_boost();
+    }
+}
+
+void power_usb_active(bool active) {
+    portENTER_CRITICAL(&s_power.lock);
+    if (s_power.usb_active == active) {
+        portEXIT_CRITICAL(&s_power.lock);
+        return;
+    }
+    bool was_boosted   = s_power.boosted;
+    s_power.usb_active = active;
+    if (!active) {
+        s_power.boosted = false;
+    }
+    account();
+    portEXIT_CRITICAL(&s_power.lock);
+
+    if (active) {
+        lock_take(s_power.awake);
+        if (s_power.idle_timer) {
+            esp_timer_start_periodic(s_power.idle_timer,
+                                     CONFIG_EXAMPLE_PM_IDLE_MS * 1000ULL);
+        }
+    } else {
+        // nothing to check while the bus is down, let the chip sleep
+        if (s_power.idle_timer) {
+            esp_timer_stop(s_power.idle_timer);
+        }
+        if (was_boosted) {
+            sync_boost();
+        }
+        lock_give(s_power.awake);
+    }
+}
+
+void power_get_stats(power_stats_t *stats) {
+    portENTER_CRITICAL(&s_power.lock);
+    account();
+    *stats = s_power.stats;
+    portEXIT_CRITICAL(&s_power.lock);
+}
+
+void power_print(void) {
+    power_stats_t st;
+    power_get_stats(&st);
+
+    uint64_t total_us = 0;
+    for (int i = 0; i < POWER_STATE_COUNT; i++) {
+        total_us += st.us[i];
+    }
+    printf("state:  %s\n", s_state_names[st.state]);
+    for (int i = 0; i < POWER_STATE_COUNT; i++) {
+        printf("%-6s  %llu ms (%.1f%%)\n", s_state_names[i], st.us[i] / 1000,
+               total_us ? 100.0 * st.us[i] / total_us : 0.0);
+    }
+#if CONFIG_PM_PROFILING
+    esp_pm_dump_locks(stdout);
+#endif
+}
@@ -0,0 +1,50 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * CPU clock and sleep policy. The first READ(10)/WRITE(10) chunk after an idle
+ * period takes a CPU_FREQ_MAX lock, so the transfer runs at 240 MHz from its
+ * first sector. A periodic check on the msc_stats chunk counters drops the
+ * lock again once CONFIG_EXAMPLE_PM_IDLE_MS pass without a transfer, and the
+ * clock falls to 80 MHz.
+ *
+ * The USB controller stops in light sleep, so it is only allowed while no
+ * host has the device configured or the bus is suspended, and only with
+ * CONFIG_EXAMPLE_PM_LIGHT_SLEEP. Time spent in each state is accounted here;
+ * with CONFIG_PM_PROFILING the time really spent asleep is printed as well.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef enum {
+    POWER_BOOST = 0,  // transfers in flight, 240 MHz
+    POWER_IDLE,       // host connected and idle, 80 MHz
+    POWER_LOW,        // no host or bus suspended, light sleep allowed
+    POWER_STATE_COUNT,
+} power_state_t;
+
+typedef struct {
+    power_state_t state;
+    uint64_t us[POWER_STATE_COUNT];  // time spent in each state
+} power_stats_t;
+
+// Configure esp_pm. Without CONFIG_EXAMPLE_PM_DFS the clock stays fixed.
+esp_err_t power_init(void);
+
+// TinyUSB task: a data chunk is about to be transferred
+void power_activity(void);
+
+// TinyUSB task: a host has the device configured and the bus is not suspended
+void power_usb_active(bool active);
+
+void power_get_stats(power_stats_t *stats);
+
+// printf the time per state
+void power_print(void);
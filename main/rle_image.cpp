@@ -0,0 +1,31 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include "rle_image.h"
+
+void rle_image_decode(const rle_image_t *img, int y, int x, int w,
+                      uint16_t *out) {
+    uint32_t run       = img->row_index[y];
+    const uint32_t end = img->row_index[y + 1];
+    int px             = 0;
+
+    // runs entirely left of x
+    while (run < end && px + img->run_len[run] <= x) {
+        px += img->run_len[run++];
+    }
+    const int stop = x + w;
+    while (run < end && px < stop) {
+        int run_end = px + img->run_len[run];
+        if (run_end > stop) {
+            run_end = stop;
+        }
+        const uint16_t color = img->run_color[run++];
+        for (int i = px > x ? px : x; i < run_end; i++) {
+            *out++ = color;
+        }
+        px = run_end;
+    }
+}
@@ -0,0 +1,28 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Run-length encoded RGB565 images, as generated from assets/*.png at build
+ * time by tools/rle_image.py. Every scanline is encoded on its own and indexed,
+ * so any part of any row can be decoded into a line buffer without a
+ * framebuffer.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    const uint16_t *row_index;  // first run of each row, height + 1 entries
+    const uint8_t *run_len;     // pixels per run
+    const uint16_t *run_color;  // byte swapped RGB565, as pushImage() takes
+} rle_image_t;
+
+// Decode pixels [x, x + w) of row y into out
+void rle_image_decode(const rle_image_t *img, int y, int x, int w,
+                      uint16_t *out);
@@ -0,0 +1,129 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdlib.h>
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+
+#include "msc_pool.h"
+#include "sd_bench.h"
+
+// Sequential tests cover BENCH_SEQ_BYTES in the middle of the card, random
+// tests issue BENCH_RAND_OPS operations anywhere on it
+#define BENCH_SEQ_BYTES (2 * 1024 * 1024)
+#define BENCH_RAND_OPS  256
+#define BENCH_MAX_OPS   1024
+#define BENCH_MAX_SIZE  (32 * 1024)
+
+static const char *TAG = "sd_bench";
+
+typedef struct {
+    const char *name;
+    uint32_t size;
+    bool write;
+    bool random;
+} bench_test_t;
+
+static const bench_test_t s_tests[] = {
+    {"seq_read", 4096, false, false},    {"seq_read", 16384, false, false},
+    {"seq_read", 32768, false, false},   {"rand_read", 512, false, true},
+    {"rand_read", 4096, false, true},    {"seq_write", 4096, true, false},
+    {"seq_write", 16384, true, false},   {"seq_write", 32768, true, false},
+    {"rand_write", 512, true, true},     {"rand_write", 4096, true, true},
+};
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t ua = *(const uint32_t *)a;
+    uint32_t ub = *(const uint32_t *)b;
+    return ua < ub ? -1 : (ua > ub ? 1 : 0);
+}
+
+static esp_err_t run_test(sdmmc_card_t *card, const bench_test_t *test,
+                          uint8_t *buf, uint32_t *lat,
+                          sd_bench_result_t *res) {
+    const uint32_t ssize    = card->csd.sector_size;
+    const uint32_t count    = test->size / ssize;
+    const uint32_t capacity = (uint32_t)card->csd.capacity;
+
+    uint32_t ops = test->random ? BENCH_RAND_OPS : BENCH_SEQ_BYTES / test->size;
+    if (ops > BENCH_MAX_OPS) {
+        ops = BENCH_MAX_OPS;
+    }
+    uint32_t seq_lba = capacity / 2;
+    ESP_RETURN_ON_FALSE(count > 0 && capacity > ops * count + seq_lba,
+                        ESP_ERR_INVALID_SIZE, TAG, "card too small for %s",
+                        test->name);
+
+    int64_t total_us = 0;
+    for (uint32_t i = 0; i < ops; i++) {
+        uint32_t lba = test->random
+                           ? esp_random() % (capacity / count) * count
+                           : seq_lba + i * count;
+        if (test->write) {
+            // write back what is there, untimed read first
+            ESP_RETURN_ON_ERROR(sdmmc_read_sectors(card, buf, lba, count),
+                                TAG, "read at lba=%lu failed", lba);
+        }
+        int64_t t0 = esp_timer_get_time();
+        esp_err_t err = test->write
+                            ? sdmmc_write_sectors(card, buf, lba, count)
+                            : sdmmc_read_sectors(card, buf, lba, count);
+        int64_t dt = esp_timer_get_time() - t0;
+        ESP_RETURN_ON_ERROR(err, TAG, "%s at lba=%lu failed", test->name, lba);
+        lat[i] = (uint32_t)dt;
+        total_us += dt;
+    }
+
+    qsort(lat, ops, sizeof(lat[0]), compare_u32);
+    res->test   = test->name;
+    res->size   = test->size;
+    res->ops    = ops;
+    res->mbps   = (float)ops * test->size / total_us;
+    res->iops   = ops * 1e6f / total_us;
+    res->p50_us = lat[ops / 2];
+    res->p99_us = lat[ops * 99 / 100];
+    res->max_us = lat[ops - 1];
+
+    ESP_LOGI(TAG,
+             "BENCH test=%s size=%lu ops=%lu mbps=%.2f iops=%.0f "
+             "p50_us=%lu p99_us=%lu max_us=%lu",
+             res->test, res->size, res->ops, res->mbps, res->iops,
+             res->p50_us, res->p99_us, res->max_us);
+    return ESP_OK;
+}
+
+esp_err_t sd_bench_run(sdmmc_card_t *card, bool allow_write,
+                       sd_bench_result_t *results, size_t max_results,
+                       size_t *out_count) {
+    uint8_t *buf  = (uint8_t *)msc_pool_alloc(BENCH_MAX_SIZE);
+    uint32_t *lat = (uint32_t *)malloc(BENCH_MAX_OPS * sizeof(uint32_t));
+    esp_err_t ret = ESP_OK;
+    size_t n      = 0;
+    ESP_GOTO_ON_FALSE(buf && lat, ESP_ERR_NO_MEM, out, TAG,
+                      "no memory for benchmark buffers");
+
+    ESP_LOGI(TAG, "BENCH start writes=%d", allow_write);
+    for (size_t i = 0; i < sizeof(s_tests) / sizeof(s_tests[0]); i++) {
+        if (n == max_results) {
+            break;
+        }
+        if (s_tests[i].write && !allow_write) {
+            continue;
+        }
+        ESP_GOTO_ON_ERROR(run_test(card, &s_tests[i], buf, lat, &results[n]),
+                          out, TAG, "benchmark aborted");
+        n++;
+    }
+    ESP_LOGI(TAG, "BENCH done tests=%u", n);
+
+out:
+    msc_pool_free(buf);
+    free(lat);
+    *out_count = n;
+    return ret;
+}
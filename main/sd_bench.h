@@ -0,0 +1,44 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Raw SD card benchmark, run against the sdmmc card without going through USB
+ * or FatFs. It measures sequential throughput at several transfer sizes and
+ * 512 B / 4 KB random IOPS, with p50/p99/max latency per test, so a slow link
+ * can be told apart from a slow card.
+ *
+ * Every test reads by default. Write tests only run when allowed. They write
+ * back the data just read from the same sectors, so the card contents stay
+ * intact unless power is lost during the benchmark.
+ *
+ * One log line per test is printed in the form
+ *   BENCH test=<name> size=<bytes> ops=<n> mbps=<f> iops=<f> p50_us=<n>
+ *   p99_us=<n> max_us=<n>
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdmmc_cmd.h"
+
+typedef struct {
+    const char *test;  // seq_read, seq_write, rand_read or rand_write
+    uint32_t size;     // bytes per operation
+    uint32_t ops;
+    float mbps;
+    float iops;
+    uint32_t p50_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+} sd_bench_result_t;
+
+// Run the benchmark. The caller must own the card: no other task may access
+// it until this returns. Fills up to max_results entries of results.
+esp_err_t sd_bench_run(sdmmc_card_t *card, bool allow_write,
+                       sd_bench_result_t *results, size_t max_results,
+                       size_t *out_count);
@@ -0,0 +1,298 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "driver/sdmmc_host.h"
+#include "driver/sdspi_host.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "card_profile.h"
+#include "msc_config.h"
+#include "msc_pool.h"
+#include "sd_card.h"
+
+#define PIN_NUM_MISO GPIO_NUM_8
+#define PIN_NUM_MOSI GPIO_NUM_6
+#define PIN_NUM_CLK  GPIO_NUM_7
+#define PIN_NUM_CS   GPIO_NUM_NC
+
+/* Largest SPI transaction the SD bus is set up for, derived from the MSC
+ * transfer buffer so the two cannot drift apart. It does not make a chunk one
+ * SPI transaction: the sdspi host still sends CMD18/CMD25 data one 512 byte
+ * block per transaction, so this only bounds the DMA descriptors the bus
+ * reserves and has no measurable effect on throughput. */
+#define SD_SPI_BLOCK_OVERHEAD 8
+#define SD_SPI_MAX_TRANSFER_SZ \
+    (MSC_XFER_SECTORS * (MSC_SECTOR_SIZE + SD_SPI_BLOCK_OVERHEAD))
+
+#if CONFIG_EXAMPLE_SDMMC_BUS_WIDTH_4
+#define SDMMC_BUS_WIDTH 4
+#else
+#define SDMMC_BUS_WIDTH 1
+#endif
+
+// Card init attempts at boot before the host is told there is no medium
+#define SD_INIT_ATTEMPTS 3
+#define SD_INIT_RETRY_MS 1000
+
+// Recovery halves the clock below the negotiation steps, down to this
+#define SD_MIN_FREQ_KHZ 5000
+
+// Allocation unit of an SDHC card that does not report one
+#define SD_DEFAULT_AU_KB 4096
+
+// Self-test reads SELFTEST_SECTORS at SELFTEST_REGIONS places of the card,
+// SELFTEST_ROUNDS times per clock step
+#define SELFTEST_REGIONS 4
+#define SELFTEST_SECTORS 16
+#define SELFTEST_ROUNDS  4
+
+static const char *TAG = "sd_card";
+
+static const int s_freq_steps_khz[] = {
+    SDMMC_FREQ_DEFAULT,
+    SDMMC_FREQ_26M,
+    SDMMC_FREQ_HIGHSPEED,
+};
+
+static int s_freq_khz     = SDMMC_FREQ_DEFAULT;
+static int s_max_freq_khz = CONFIG_EXAMPLE_SD_MAX_FREQ_KHZ;
+
+// The one card this example drives, lives as long as the firmware
+static sdmmc_card_t s_card;
+
+static esp_err_t set_freq(sdmmc_card_t *card, int freq_khz) {
+    ESP_RETURN_ON_ERROR(card->host.set_card_clk(card->host.slot, freq_khz),
+                        TAG, "could not set clock to %d kHz", freq_khz);
+    s_freq_khz = freq_khz;
+    return ESP_OK;
+}
+
+static esp_err_t selftest_crc(sdmmc_card_t *card, uint8_t *buf,
+                              uint32_t crc[SELFTEST_REGIONS]) {
+    const uint32_t len = SELFTEST_SECTORS * card->csd.sector_size;
+    for (int r = 0; r < SELFTEST_REGIONS; r++) {
+        size_t lba = (size_t)card->csd.capacity / SELFTEST_REGIONS * r;
+        if (lba + SELFTEST_SECTORS > (size_t)card->csd.capacity) {
+            lba = card->csd.capacity - SELFTEST_SECTORS;
+        }
+        ESP_RETURN_ON_ERROR(
+            sdmmc_read_sectors(card, buf, lba, SELFTEST_SECTORS), TAG,
+            "self-test read at lba=%u failed", lba);
+        crc[r] = esp_rom_crc32_le(0, buf, len);
+    }
+    return ESP_OK;
+}
+
+#if CONFIG_EXAMPLE_SD_INTERFACE_SDMMC
+
+static esp_err_t host_init(sdmmc_host_t *host) {
+    ESP_LOGI(TAG, "Using SDMMC peripheral, %d-bit bus", SDMMC_BUS_WIDTH);
+
+    *host = SDMMC_HOST_DEFAULT();
+
+    // This initializes the slot without card detect (CD) and write protect (WP)
+    // signals. Modify slot_config.gpio_cd and slot_config.gpio_wp if your board
+    // has these signals.
+    sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
+    slot_config.width               = SDMMC_BUS_WIDTH;
+#if CONFIG_SOC_SDMMC_USE_GPIO_MATRIX
+    slot_config.clk = (gpio_num_t)CONFIG_EXAMPLE_PIN_CLK;
+    slot_config.cmd = (gpio_num_t)CONFIG_EXAMPLE_PIN_CMD;
+    slot_config.d0  = (gpio_num_t)CONFIG_EXAMPLE_PIN_D0;
+#if CONFIG_EXAMPLE_SDMMC_BUS_WIDTH_4
+    slot_config.d1 = (gpio_num_t)CONFIG_EXAMPLE_PIN_D1;
+    slot_config.d2 = (gpio_num_t)CONFIG_EXAMPLE_PIN_D2;
+    slot_config.d3 = (gpio_num_t)CONFIG_EXAMPLE_PIN_D3;
+#endif  // CONFIG_EXAMPLE_SDMMC_BUS_WIDTH_4
+#endif  // CONFIG_SOC_SDMMC_USE_GPIO_MATRIX
+    // External pull-ups are still required on a real board, the internal ones
+    // only keep the lines defined while nothing drives them
+    slot_config.flags |= SDMMC_SLOT_FLAG_INTERNAL_PULLUP;
+
+    ESP_RETURN_ON_ERROR(sdmmc_host_init(), TAG,
+                        "Failed to initialize SDMMC host");
+    ESP_RETURN_ON_ERROR(sdmmc_host_init_slot(host->slot, &slot_config), TAG,
+                        "Failed to initialize SDMMC slot");
+    return ESP_OK;
+}
+
+#else
+
+static esp_err_t host_init(sdmmc_host_t *host) {
+    ESP_LOGI(TAG, "Using SPI peripheral");
+
+    *host = SDSPI_HOST_DEFAULT();
+
+    spi_bus_config_t bus_cfg = {
+        .mosi_io_num     = PIN_NUM_MOSI,
+        .miso_io_num     = PIN_NUM_MISO,
+        .sclk_io_num     = PIN_NUM_CLK,
+        .quadwp_io_num   = -1,
+        .quadhd_io_num   = -1,
+        .max_transfer_sz = SD_SPI_MAX_TRANSFER_SZ,
+    };
+    ESP_RETURN_ON_ERROR(spi_bus_initialize((spi_host_device_t)host->slot,
+                                           &bus_cfg, SDSPI_DEFAULT_DMA),
+                        TAG, "Failed to initialize bus.");
+
+    // This initializes the slot without card detect (CD) and write protect (WP)
+    // signals. Modify slot_config.gpio_cd and slot_config.gpio_wp if your board
+    // has these signals.
+    sdspi_device_config_t slot_config = SDSPI_DEVICE_CONFIG_DEFAULT();
+    slot_config.gpio_cs               = PIN_NUM_CS;
+    slot_config.host_id               = (spi_host_device_t)host->slot;
+    int card_handle                   = -1;  // uninitialized
+    ESP_RETURN_ON_ERROR(sdspi_host_init_device(&slot_config, &card_handle), TAG,
+                        "Failed to attach the card to the bus");
+    host->slot = card_handle;
+    return ESP_OK;
+}
+
+#endif  // CONFIG_EXAMPLE_SD_INTERFACE_SDMMC
+
+// The clock a known card negotiated before, else a fresh negotiation
+static void tune_clock(sdmmc_card_t *card, int max_freq_khz) {
+    int freq_khz = card_profile_freq_khz(card, max_freq_khz);
+    if (freq_khz != 0 && set_freq(card, freq_khz) == ESP_OK) {
+        ESP_LOGI(TAG, "SD clock %d kHz from the card profile", s_freq_khz);
+    } else if (sd_card_negotiate_freq(card, max_freq_khz) != ESP_OK) {
+        ESP_LOGW(TAG, "Clock negotiation failed, using %d kHz",
+                 sd_card_get_freq_khz());
+    }
+    card_profile_attach(card, max_freq_khz);
+}
+
+esp_err_t sd_card_init(sdmmc_card_t **out_card) {
+    sdmmc_card_t *card = &s_card;
+
+    sdmmc_host_t host;
+    ESP_RETURN_ON_ERROR(host_init(&host), TAG, "host init failed");
+
+    // By default, SD card frequency is initialized to SDMMC_FREQ_DEFAULT
+    // (20MHz). Allowing more lets sdmmc_card_init() switch the card to high
+    // speed mode; sd_card_negotiate_freq() then picks the highest clock that
+    // passes its self-test, unless the card profile already knows it.
+    host.max_freq_khz = s_max_freq_khz;
+
+    // sdmmc_card_init() keeps the host in the card even when it fails, so
+    // sd_card_reinit() can carry on from here
+    *out_card = card;
+    for (int attempt = 1; sdmmc_card_init(&host, card) != ESP_OK; attempt++) {
+        ESP_LOGE(TAG, "Failed to initialize sdcard.");
+        if (attempt == SD_INIT_ATTEMPTS) {
+            return ESP_ERR_TIMEOUT;
+        }
+        // the high speed switch may not survive the wiring, retry without it
+        host.max_freq_khz = SDMMC_FREQ_DEFAULT;
+        vTaskDelay(pdMS_TO_TICKS(SD_INIT_RETRY_MS));
+    }
+    ESP_LOGI(TAG, "Success initialize sdcard.");
+
+    tune_clock(card, host.max_freq_khz);
+    return ESP_OK;
+}
+
+esp_err_t sd_card_reinit(sdmmc_card_t *card) {
+    sdmmc_host_t host = card->host;
+    host.max_freq_khz = s_max_freq_khz;
+    ESP_RETURN_ON_ERROR(sdmmc_card_init(&host, card), TAG,
+                        "card did not answer");
+    tune_clock(card, host.max_freq_khz);
+    return ESP_OK;
+}
+
+esp_err_t sd_card_negotiate_freq(sdmmc_card_t *card, int max_freq_khz) {
+    // nothing to step through below the default clock
+    if (max_freq_khz < s_freq_steps_khz[0]) {
+        ESP_RETURN_ON_ERROR(set_freq(card, max_freq_khz), TAG,
+                            "could not set the clock");
+        ESP_LOGI(TAG, "SD clock %d kHz", s_freq_khz);
+        return ESP_OK;
+    }
+
+    uint8_t *buf = (uint8_t *)msc_pool_alloc(SELFTEST_SECTORS *
+                                             card->csd.sector_size);
+    ESP_RETURN_ON_FALSE(buf, ESP_ERR_NO_MEM, TAG,
+                        "no memory for self-test buffer");
+
+    esp_err_t ret = ESP_OK;
+    uint32_t ref[SELFTEST_REGIONS];
+    uint32_t crc[SELFTEST_REGIONS];
+    int good_khz = s_freq_steps_khz[0];
+
+    // reference data at the clock every card supports
+    ESP_GOTO_ON_ERROR(set_freq(card, good_khz), out, TAG,
+                      "could not drop to the default clock");
+    ESP_GOTO_ON_ERROR(selftest_crc(card, buf, ref), out, TAG,
+                      "reference read failed");
+
+    for (size_t i = 1; i < sizeof(s_freq_steps_khz) / sizeof(int); i++) {
+        int freq_khz = s_freq_steps_khz[i];
+        if (freq_khz > max_freq_khz || freq_khz > card->max_freq_khz) {
+            break;
+        }
+
+        bool stable = set_freq(card, freq_khz) == ESP_OK;
+        for (int round = 0; stable && round < SELFTEST_ROUNDS; round++) {
+            stable = selftest_crc(card, buf, crc) == ESP_OK &&
+                     memcmp(crc, ref, sizeof(ref)) == 0;
+        }
+        if (!stable) {
+            ESP_LOGW(TAG, "%d kHz failed self-test, falling back to %d kHz",
+                     freq_khz, good_khz);
+            break;
+        }
+        good_khz = freq_khz;
+    }
+
+    if (s_freq_khz != good_khz) {
+        ret = set_freq(card, good_khz);
+    }
+    ESP_LOGI(TAG, "SD clock %d kHz", s_freq_khz);
+
+out:
+    msc_pool_free(buf);
+    return ret;
+}
+
+esp_err_t sd_card_step_down_freq(sdmmc_card_t *card) {
+    int freq_khz = s_freq_khz / 2;
+    for (size_t i = 1; i < sizeof(s_freq_steps_khz) / sizeof(int); i++) {
+        if (s_freq_steps_khz[i] == s_freq_khz) {
+            freq_khz = s_freq_steps_khz[i - 1];
+        }
+    }
+    if (freq_khz < SD_MIN_FREQ_KHZ) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return set_freq(card, freq_khz);
+}
+
+void sd_card_set_max_freq_khz(int max_freq_khz) {
+    s_max_freq_khz = max_freq_khz;
+}
+
+int sd_card_get_max_freq_khz(void) {
+    return s_max_freq_khz;
+}
+
+int sd_card_get_freq_khz(void) {
+    return s_freq_khz;
+}
+
+uint32_t sd_card_au_sectors(const sdmmc_card_t *card) {
+    uint32_t au_kb = card->ssr.alloc_unit_kb;
+    if (au_kb == 0) {
+        au_kb = SD_DEFAULT_AU_KB;
+    }
+    return au_kb * 1024 / card->csd.sector_size;
+}
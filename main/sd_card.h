@@ -0,0 +1,50 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * SD card bring-up. The card is attached either to the SDMMC peripheral (1 or
+ * 4 data lines, CONFIG_EXAMPLE_SD_INTERFACE_SDMMC) or to an SPI bus, as on the
+ * Atomic TF base. After sdmmc_card_init() succeeded, the card clock is
+ * stepped up from SDMMC_FREQ_DEFAULT through the frequencies the card and the
+ * board wiring allow. Each step must pass a read/CRC self-test against data
+ * read at the default clock; the highest stable step is kept. A card with a
+ * card_profile starts at the clock it negotiated before, without the steps.
+ */
+
+#pragma once
+
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "sdmmc_cmd.h"
+
+// Set up the configured host, initialize the card and negotiate its clock.
+// ESP_ERR_TIMEOUT if no card answered a few attempts; *out_card is still set
+// and sd_card_reinit() can be retried on it.
+esp_err_t sd_card_init(sdmmc_card_t **out_card);
+
+// Initialize a card inserted into the already set up host, once
+esp_err_t sd_card_reinit(sdmmc_card_t *card);
+
+// Negotiate the card clock, up to max_freq_khz
+esp_err_t sd_card_negotiate_freq(sdmmc_card_t *card, int max_freq_khz);
+
+// Lower the card clock by one step: back through the negotiation steps, then
+// halving down to 5 MHz. ESP_ERR_NOT_FOUND once there is no lower step. Only
+// while no other card I/O is running, as from the SD worker.
+esp_err_t sd_card_step_down_freq(sdmmc_card_t *card);
+
+// Clock ceiling for sd_card_init() and sd_card_reinit(),
+// CONFIG_EXAMPLE_SD_MAX_FREQ_KHZ unless set. Clocks above 20 MHz need the card
+// initialized with the higher ceiling, which switches it to high speed mode.
+void sd_card_set_max_freq_khz(int max_freq_khz);
+int sd_card_get_max_freq_khz(void);
+
+// Card clock currently in use, in kHz
+int sd_card_get_freq_khz(void);
+
+// Allocation unit (erase unit) of the card in sectors, from the SD Status
+// register; 4 MB if the card does not report one
+uint32_t sd_card_au_sectors(const sdmmc_card_t *card);
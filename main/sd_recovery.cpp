@@ -0,0 +1,124 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include "esp_log.h"
+
+#include "sd_card.h"
+#include "sd_recovery.h"
+
+#define RECOVERY_RETRIES CONFIG_EXAMPLE_SD_RETRIES
+
+static const char *TAG = "sd_recovery";
+
+typedef struct {
+    TaskHandle_t supervisor;
+    uint32_t notify_bits;
+    volatile bool degraded;
+    sd_recovery_stats_t stats;
+} sd_recovery_t;
+
+static sd_recovery_t s_rec;
+
+static sd_err_class_t classify(esp_err_t err) {
+    switch (err) {
+        case ESP_ERR_TIMEOUT:
+            return SD_ERR_TIMEOUT;
+        case ESP_ERR_INVALID_CRC:
+            return SD_ERR_CRC;
+        case ESP_ERR_INVALID_RESPONSE:
+        case ESP_ERR_INVALID_STATE:
+            return SD_ERR_RESPONSE;
+        default:
+            return SD_ERR_OTHER;
+    }
+}
+
+static void count_error(esp_err_t err) {
+    s_rec.stats.errors[classify(err)]++;
+}
+
+static esp_err_t run_sector(sdmmc_card_t *card, msc_job_t *job, uint32_t i) {
+    uint8_t *data = job->data + i * card->csd.sector_size;
+    if (job->op == MSC_JOB_READ) {
+        return sdmmc_read_sectors(card, data, job->lba + i, 1);
+    }
+    return sdmmc_write_sectors(card, data, job->lba + i, 1);
+}
+
+// Retry sectors [first, count) of the job one by one. Returns the first
+// sector that still fails, or job->count. A timeout ends the tier at once:
+// a card that stopped answering would cost a timeout per retry.
+static uint32_t retry_sectors(sdmmc_card_t *card, msc_job_t *job,
+                              uint32_t first, esp_err_t *err) {
+    for (uint32_t i = first; i < job->count; i++) {
+        esp_err_t ret = ESP_FAIL;
+        for (int n = 0; n < RECOVERY_RETRIES; n++) {
+            s_rec.stats.retries++;
+            ret = run_sector(card, job, i);
+            if (ret == ESP_OK) {
+                break;
+            }
+            count_error(ret);
+            if (ret == ESP_ERR_TIMEOUT) {
+                break;
+            }
+        }
+        if (ret != ESP_OK) {
+            *err = ret;
+            return i;
+        }
+    }
+    return job->count;
+}
+
+void sd_recovery_init(TaskHandle_t supervisor, uint32_t notify_bits) {
+    s_rec.supervisor  = supervisor;
+    s_rec.notify_bits = notify_bits;
+}
+
+esp_err_t sd_recovery_handle(sdmmc_card_t *card, msc_job_t *job,
+                             esp_err_t err) {
+    count_error(err);
+    // the supervisor polls with STATUS jobs and handles their failure
+    if (s_rec.degraded ||
+        (job->op != MSC_JOB_READ && job->op != MSC_JOB_WRITE)) {
+        return err;
+    }
+
+    uint32_t next = retry_sectors(card, job, 0, &err);
+    if (next < job->count && sd_card_step_down_freq(card) == ESP_OK) {
+        s_rec.stats.clock_drops++;
+        ESP_LOGW(TAG, "lba=%lu keeps failing, clock down to %d kHz",
+                 job->lba + next, sd_card_get_freq_khz());
+        next = retry_sectors(card, job, next, &err);
+    }
+    if (next == job->count) {
+        s_rec.stats.recovered++;
+        return ESP_OK;
+    }
+
+    ESP_LOGE(TAG, "%s lba=%lu failed (0x%x), re-initializing the card",
+             job->op == MSC_JOB_READ ? "read" : "write", job->lba + next, err);
+    s_rec.stats.failed++;
+    s_rec.stats.reinits++;
+    s_rec.degraded = true;
+    if (s_rec.supervisor) {
+        xTaskNotify(s_rec.supervisor, s_rec.notify_bits, eSetBits);
+    }
+    return err;
+}
+
+bool sd_recovery_degraded(void) {
+    return s_rec.degraded;
+}
+
+void sd_recovery_clear(void) {
+    s_rec.degraded = false;
+}
+
+void sd_recovery_get_stats(sd_recovery_stats_t *stats) {
+    *stats = s_rec.stats;
+}
@@ -0,0 +1,67 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Bounded recovery from SD card errors, run by the SD worker when a job
+ * failed. The tiers are tried in order, each at most once per failed job:
+ * 1. retry the job one sector at a time, CONFIG_EXAMPLE_SD_RETRIES times per
+ *    sector;
+ * 2. drop the card clock one step and retry the sectors still failing;
+ * 3. give up: the job fails, the card is marked degraded and the supervisor
+ *    task is notified to re-initialize it in the background.
+ *
+ * While degraded, queued and new jobs fail at once instead of each running
+ * into the card timeouts, and the host is answered NOT READY, becoming ready,
+ * so it retries instead of resetting the bus. If the re-init does not succeed
+ * within a few attempts the host is told the medium is gone. Errors are
+ * counted by class for the console `stats` command.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdmmc_cmd.h"
+
+#include "msc_pipeline.h"
+
+typedef enum {
+    SD_ERR_TIMEOUT = 0,  // the card did not answer in time
+    SD_ERR_CRC,          // data or response CRC mismatch
+    SD_ERR_RESPONSE,     // the card answered with an error
+    SD_ERR_OTHER,
+    SD_ERR_CLASSES,
+} sd_err_class_t;
+
+typedef struct {
+    uint32_t errors[SD_ERR_CLASSES];  // failed card commands by class
+    uint32_t retries;                 // single sector retries issued
+    uint32_t recovered;               // failed jobs completed by retrying
+    uint32_t clock_drops;             // clock steps given up
+    uint32_t failed;                  // jobs failed back to the caller
+    uint32_t reinits;                 // background re-inits requested
+} sd_recovery_stats_t;
+
+// Notify `supervisor` with `notify_bits` (eSetBits) when the card needs to be
+// initialized again
+void sd_recovery_init(TaskHandle_t supervisor, uint32_t notify_bits);
+
+// Called by the SD worker for a job that failed with err; returns the result
+// of the recovery
+esp_err_t sd_recovery_handle(sdmmc_card_t *card, msc_job_t *job,
+                             esp_err_t err);
+
+// true from giving up on a job until sd_recovery_clear()
+bool sd_recovery_degraded(void);
+
+// Leave the degraded state, once the card was initialized again or has been
+// given up on as removed
+void sd_recovery_clear(void);
+
+void sd_recovery_get_stats(sd_recovery_stats_t *stats);
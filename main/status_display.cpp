@@ -0,0 +1,252 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <string.h>
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "M5Unified.h"
+#include "M5GFX.h"
+
+#include "background_1_rle.h"
+#include "background_2_rle.h"
+
+#include "msc_stats.h"
+#include "status_display.h"
+#include "task_layout.h"
+
+// Runs on the housekeeping core, below every I/O task
+#define DISPLAY_TASK_CORE       TASK_LAYOUT_UI_CORE
+#define DISPLAY_TASK_PRIORITY   TASK_LAYOUT_UI_PRIORITY
+#define DISPLAY_TASK_STACK_SIZE 4096
+
+#define DISPLAY_SIZE     128
+#define DISPLAY_TEXT_LEN 32
+#define FIELD_HEIGHT     20
+#define LINE_PITCH       24
+#define CHUNK_ROWS       8  // scanlines decoded per pushImage()
+
+// Throughput bar along the top edge, full width at BAR_FULL_MBPS
+#define BAR_HEIGHT 4
+#if CONFIG_EXAMPLE_SD_INTERFACE_SDMMC
+#define BAR_FULL_MBPS 20.0f
+#else
+#define BAR_FULL_MBPS 5.0f
+#endif
+
+static const char *TAG = "status_display";
+
+typedef struct {
+    char text[DISPLAY_TEXT_LEN];
+    uint32_t color;
+    bool dirty;
+} display_text_t;
+
+typedef struct {
+    display_bg_t bg;
+    bool bg_dirty;
+    display_text_t fields[DISPLAY_FIELD_COUNT];
+    display_text_t lines[DISPLAY_MAX_LINES];
+} display_state_t;
+
+static const int s_field_y[DISPLAY_FIELD_COUNT] = {52, 97, 118};
+
+static display_state_t s_state = {.bg = DISPLAY_BG_BOOT, .bg_dirty = true};
+static portMUX_TYPE s_lock     = portMUX_INITIALIZER_UNLOCKED;
+
+// Decoded scanlines on their way to the panel, only used by the display task
+static uint16_t s_lines[CHUNK_ROWS * DISPLAY_SIZE];
+
+static const rle_image_t *background_image(display_bg_t bg) {
+    switch (bg) {
+        case DISPLAY_BG_BOOT:
+            return &rle_background_1;
+        case DISPLAY_BG_READY:
+            return &rle_background_2;
+        default:
+            return NULL;
+    }
+}
+
+// Repaint the background under one rectangle only, CHUNK_ROWS at a time
+static void restore_rect(display_bg_t bg, int x, int y, int w, int h) {
+    const rle_image_t *image = background_image(bg);
+    if (!image) {
+        M5.Display.fillRect(x, y, w, h, BLACK);
+        return;
+    }
+    for (int row = y; row < y + h; row += CHUNK_ROWS) {
+        int rows = y + h - row < CHUNK_ROWS ? y + h - row : CHUNK_ROWS;
+        for (int i = 0; i < rows; i++) {
+            rle_image_decode(image, row + i, x, w, s_lines + i * w);
+        }
+        M5.Display.pushImage(x, row, w, rows, s_lines);
+    }
+}
+
+static void draw_text(display_bg_t bg, const display_text_t *t, int y,
+                      bool restore) {
+    int top = y - FIELD_HEIGHT / 2;
+    int h   = top + FIELD_HEIGHT > DISPLAY_SIZE ? DISPLAY_SIZE - top
+                                                : FIELD_HEIGHT;
+    if (restore) {
+        restore_rect(bg, 0, top, DISPLAY_SIZE, h);
+    }
+    if (t->text[0]) {
+        M5.Display.setTextColor(t->color);
+        M5.Display.drawString(t->text, DISPLAY_SIZE / 2, y);
+    }
+}
+
+static int bar_width(uint32_t bytes, float dt_us) {
+    int w = (int)(bytes / dt_us / BAR_FULL_MBPS * DISPLAY_SIZE);
+    return w > DISPLAY_SIZE ? DISPLAY_SIZE : w;
+}
+
+static void draw_bar(display_bg_t bg, int rd_w, int wr_w) {
+    if (rd_w + wr_w > DISPLAY_SIZE) {
+        wr_w = DISPLAY_SIZE - rd_w;
+    }
+    if (rd_w > 0) {
+        M5.Display.fillRect(0, 0, rd_w, BAR_HEIGHT, GREEN);
+    }
+    if (wr_w > 0) {
+        M5.Display.fillRect(rd_w, 0, wr_w, BAR_HEIGHT, RED);
+    }
+    if (rd_w + wr_w < DISPLAY_SIZE) {
+        restore_rect(bg, rd_w + wr_w, 0, DISPLAY_SIZE - rd_w - wr_w,
+                     BAR_HEIGHT);
+    }
+}
+
+static void display_task(void *arg) {
+    (void)arg;
+    const TickType_t period =
+        pdMS_TO_TICKS(1000 / CONFIG_EXAMPLE_DISPLAY_FPS) > 0
+            ? pdMS_TO_TICKS(1000 / CONFIG_EXAMPLE_DISPLAY_FPS)
+            : 1;
+    TickType_t last_wake = xTaskGetTickCount();
+    display_state_t frame;
+    msc_stats_t prev_stats = {};
+    int64_t prev_us        = esp_timer_get_time();
+    int bar_rd = -1, bar_wr = -1;
+
+    // msc_stats_t is large, keep the snapshot off the stack
+    static msc_stats_t stats;
+
+    while (1) {
+        vTaskDelayUntil(&last_wake, period);
+
+        portENTER_CRITICAL(&s_lock);
+        frame            = s_state;
+        s_state.bg_dirty = false;
+        for (int i = 0; i < DISPLAY_FIELD_COUNT; i++) {
+            s_state.fields[i].dirty = false;
+        }
+        for (int i = 0; i < DISPLAY_MAX_LINES; i++) {
+            s_state.lines[i].dirty = false;
+        }
+        portEXIT_CRITICAL(&s_lock);
+
+        msc_stats_get(&stats);
+        int64_t now_us = esp_timer_get_time();
+        float dt_us    = (float)(now_us - prev_us);
+        int rd_w       = bar_width(stats.read_bytes - prev_stats.read_bytes,
+                                   dt_us);
+        int wr_w = bar_width(stats.write_bytes - prev_stats.write_bytes,
+                             dt_us);
+        prev_stats.read_bytes  = stats.read_bytes;
+        prev_stats.write_bytes = stats.write_bytes;
+        prev_us                = now_us;
+
+        M5.Display.startWrite();
+        if (frame.bg_dirty) {
+            restore_rect(frame.bg, 0, 0, DISPLAY_SIZE, DISPLAY_SIZE);
+            bar_rd = bar_wr = -1;
+        }
+        if (frame.bg == DISPLAY_BG_BLANK) {
+            for (int i = 0; i < DISPLAY_MAX_LINES; i++) {
+                if (frame.bg_dirty || frame.lines[i].dirty) {
+                    draw_text(frame.bg, &frame.lines[i],
+                              LINE_PITCH / 2 + i * LINE_PITCH,
+                              !frame.bg_dirty);
+                }
+            }
+        } else {
+            for (int i = 0; i < DISPLAY_FIELD_COUNT; i++) {
+                if (frame.bg_dirty || frame.fields[i].dirty) {
+                    draw_text(frame.bg, &frame.fields[i], s_field_y[i],
+                              !frame.bg_dirty);
+                }
+            }
+            if (rd_w != bar_rd || wr_w != bar_wr) {
+                draw_bar(frame.bg, rd_w, wr_w);
+                bar_rd = rd_w;
+                bar_wr = wr_w;
+            }
+        }
+        M5.Display.endWrite();
+    }
+}
+
+esp_err_t display_init(void) {
+    M5.Display.setTextDatum(middle_center);
+    M5.Display.setTextFont(&fonts::FreeSansBold9pt7b);
+    M5.Display.setTextSize(1);
+
+    BaseType_t ok = xTaskCreatePinnedToCore(
+        display_task, "display", DISPLAY_TASK_STACK_SIZE, NULL,
+        DISPLAY_TASK_PRIORITY, NULL, DISPLAY_TASK_CORE);
+    ESP_RETURN_ON_FALSE(ok == pdPASS, ESP_ERR_NO_MEM, TAG,
+                        "could not create display task");
+    return ESP_OK;
+}
+
+void display_set_background(display_bg_t bg) {
+    portENTER_CRITICAL(&s_lock);
+    s_state.bg       = bg;
+    s_state.bg_dirty = true;
+    for (int i = 0; i < DISPLAY_FIELD_COUNT; i++) {
+        s_state.fields[i].text[0] = '\0';
+    }
+    for (int i = 0; i < DISPLAY_MAX_LINES; i++) {
+        s_state.lines[i].text[0] = '\0';
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+static void set_text(display_text_t *t, const char *text, uint32_t color) {
+    if (strncmp(t->text, text, DISPLAY_TEXT_LEN - 1) != 0 ||
+        t->color != color) {
+        strlcpy(t->text, text, DISPLAY_TEXT_LEN);
+        t->color = color;
+        t->dirty = true;
+    }
+}
+
+void display_set_text(display_field_t field, const char *text,
+                      uint32_t color) {
+    portENTER_CRITICAL(&s_lock);
+    set_text(&s_state.fields[field], text, color);
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void display_show_lines(const char *const *lines, const uint32_t *colors,
+                        size_t n) {
+    portENTER_CRITICAL(&s_lock);
+    if (s_state.bg != DISPLAY_BG_BLANK) {
+        s_state.bg       = DISPLAY_BG_BLANK;
+        s_state.bg_dirty = true;
+    }
+    for (size_t i = 0; i < DISPLAY_MAX_LINES; i++) {
+        set_text(&s_state.lines[i], i < n ? lines[i] : "",
+                 i < n ? colors[i] : WHITE);
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
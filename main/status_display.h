@@ -0,0 +1,51 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Status display. A low priority task on the core TinyUSB is not running on
+ * owns the panel and redraws at most CONFIG_EXAMPLE_DISPLAY_FPS frames per
+ * second. The setters below only record the new state; the task then repaints
+ * just the rectangles that changed, restoring the background underneath from
+ * the RLE image in flash a few scanlines at a time. The background is pushed
+ * in full only when it changes.
+ *
+ * A throughput bar along the top edge shows USB read (green) and write (red)
+ * rates taken from msc_stats.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef enum {
+    DISPLAY_BG_BOOT = 0,  // waiting for the card
+    DISPLAY_BG_READY,     // card up
+    DISPLAY_BG_BLANK,     // black, for full-screen text
+} display_bg_t;
+
+typedef enum {
+    DISPLAY_FIELD_FREE = 0,
+    DISPLAY_FIELD_TOTAL,
+    DISPLAY_FIELD_FREQ,
+    DISPLAY_FIELD_COUNT,
+} display_field_t;
+
+// Start the display task. M5.begin() must have been called.
+esp_err_t display_init(void);
+
+// Switch the background; clears all text
+void display_set_background(display_bg_t bg);
+
+// Show text (at most 31 characters) in one of the fixed fields
+void display_set_text(display_field_t field, const char *text, uint32_t color);
+
+// Replace the screen with up to DISPLAY_MAX_LINES lines of text on black.
+// Left by the next display_set_background().
+#define DISPLAY_MAX_LINES 5
+void display_show_lines(const char *const *lines, const uint32_t *colors,
+                        size_t n);
@@ -0,0 +1,57 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Core and priority of every task the example creates, in one place. The
+ * TinyUSB task core comes from CONFIG_TINYUSB_TASK_AFFINITY_*; the other
+ * tasks are placed relative to it by the CONFIG_EXAMPLE_TASK_LAYOUT_* preset:
+ * - SPLIT, the default: the SD and flash workers run on the non-USB core next
+ *   to the housekeeping tasks, so the card and the USB stack never compete
+ *   for a CPU and the double-buffered pipeline overlaps for real.
+ * - IO_CORE: USB and the SD and flash workers share the USB core at high
+ *   priority; the display, free space, card supervision and button tasks run
+ *   on the other core at low priority, so housekeeping can never delay a
+ *   transfer. The USB and card work then take turns on one core; measure it
+ *   against SPLIT with the host throughput test before choosing it.
+ * The write-back flush task always runs next to the SD worker, one priority
+ * below it.
+ *
+ * The main task (console, buttons) keeps CONFIG_ESP_MAIN_TASK_AFFINITY, which
+ * is CPU0: pair the IO_CORE preset with TinyUSB on CPU1.
+ */
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+#if CONFIG_TINYUSB_TASK_AFFINITY_CPU0
+#define TASK_LAYOUT_USB_CORE   0
+#define TASK_LAYOUT_OTHER_CORE 1
+#elif CONFIG_TINYUSB_TASK_AFFINITY_CPU1
+#define TASK_LAYOUT_USB_CORE   1
+#define TASK_LAYOUT_OTHER_CORE 0
+#else
+#define TASK_LAYOUT_USB_CORE   tskNO_AFFINITY
+#define TASK_LAYOUT_OTHER_CORE tskNO_AFFINITY
+#endif
+
+#if CONFIG_EXAMPLE_TASK_LAYOUT_IO_CORE
+#define TASK_LAYOUT_SD_CORE TASK_LAYOUT_USB_CORE
+#else
+#define TASK_LAYOUT_SD_CORE TASK_LAYOUT_OTHER_CORE
+#endif
+#define TASK_LAYOUT_UI_CORE    TASK_LAYOUT_OTHER_CORE
+#define TASK_LAYOUT_FLASH_CORE TASK_LAYOUT_SD_CORE
+#define TASK_LAYOUT_WB_CORE    TASK_LAYOUT_SD_CORE
+
+// The SD worker must keep up with the USB task it feeds
+#define TASK_LAYOUT_SD_PRIORITY    CONFIG_TINYUSB_TASK_PRIORITY
+#define TASK_LAYOUT_FLASH_PRIORITY CONFIG_TINYUSB_TASK_PRIORITY
+// An idle write-back flush, next to the SD worker it feeds, yields to both
+#define TASK_LAYOUT_WB_PRIORITY    (CONFIG_TINYUSB_TASK_PRIORITY - 1)
+#define TASK_LAYOUT_CARD_PRIORITY  2
+#define TASK_LAYOUT_UI_PRIORITY    1
+#define TASK_LAYOUT_SPACE_PRIORITY 1
@@ -15,38 +15,62 @@
 
 #include <errno.h>
 #include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
 #include "esp_console.h"
 #include "esp_check.h"
 #include "driver/gpio.h"
+#include "esp_vfs_fat.h"
+#include "nvs_flash.h"
 #include "tinyusb.h"
-#include "tusb_msc_storage.h"
 
-#ifdef CONFIG_EXAMPLE_STORAGE_MEDIA_SDMMCCARD
-#include "diskio_impl.h"
-#include "diskio_sdmmc.h"
-#endif
+#include "button.h"
+#include "card_profile.h"
+#include "fat_space.h"
+#include "msc_config.h"
+#include "msc_flash.h"
+#include "msc_metacache.h"
+#include "msc_pipeline.h"
+#include "msc_readahead.h"
+#include "msc_settings.h"
+#include "msc_stats.h"
+#include "msc_storage.h"
+#include "msc_trace.h"
+#include "msc_writeback.h"
+#include "power.h"
+#include "sd_bench.h"
+#include "sd_card.h"
+#include "sd_recovery.h"
+#include "status_display.h"
+#include "task_layout.h"
+#include "usb_telemetry.h"
 
 #include "M5Unified.h"
 #include "M5GFX.h"
 
-#include "background_1.h"
-#include "background_2.h"
 
 #define MOUNT_POINT "/sdcard"
 
-#define PIN_NUM_MISO GPIO_NUM_8
-#define PIN_NUM_MOSI GPIO_NUM_6
-#define PIN_NUM_CLK  GPIO_NUM_7
-#define PIN_NUM_CS   GPIO_NUM_NC
-
 static const char *TAG = "example_main";
 
 /* TinyUSB descriptors
  ********************************************************************* */
-#define EPNUM_MSC           1
+#define EPNUM_MSC 1
+#if CONFIG_EXAMPLE_USB_CDC_TELEMETRY
+#define TUSB_DESC_TOTAL_LEN \
+    (TUD_CONFIG_DESC_LEN + TUD_MSC_DESC_LEN + TUD_CDC_DESC_LEN)
+#else
 #define TUSB_DESC_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_MSC_DESC_LEN)
+#endif
 
-enum { ITF_NUM_MSC = 0, ITF_NUM_TOTAL };
+enum {
+    ITF_NUM_MSC = 0,
+#if CONFIG_EXAMPLE_USB_CDC_TELEMETRY
+    ITF_NUM_CDC,
+    ITF_NUM_CDC_DATA,
+#endif
+    ITF_NUM_TOTAL
+};
 
 enum {
     EDPT_CTRL_OUT = 0x00,
@@ -54,8 +78,15 @@ enum {
 
     EDPT_MSC_OUT = 0x01,
     EDPT_MSC_IN  = 0x81,
+
+    EDPT_CDC_NOTIF    = 0x82,
+    EDPT_CDC_DATA_OUT = 0x03,
+    EDPT_CDC_DATA_IN  = 0x83,
 };
 
+// CDC notification endpoint size, the data endpoints are as large as MSC's
+#define CDC_NOTIF_EP_SIZE 8
+
 static uint8_t const desc_configuration[] = {
     // Config number, interface count, string index, total length, attribute,
     // power in mA
@@ -63,8 +94,13 @@ static uint8_t const desc_configuration[] = {
                           TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
 
     // Interface number, string index, EP Out & EP In address, EP size
-    TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, 0, EDPT_MSC_OUT, EDPT_MSC_IN,
-                       TUD_OPT_HIGH_SPEED ? 512 : 64),
+    TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, 0, EDPT_MSC_OUT, EDPT_MSC_IN, MSC_EP_SIZE),
+#if CONFIG_EXAMPLE_USB_CDC_TELEMETRY
+    // Interface number, string index, EP notification address and size, EP
+    // data address (out, in) and size
+    TUD_CDC_DESCRIPTOR(ITF_NUM_CDC, 5, EDPT_CDC_NOTIF, CDC_NOTIF_EP_SIZE,
+                       EDPT_CDC_DATA_OUT, EDPT_CDC_DATA_IN, MSC_EP_SIZE),
+#endif
 };
 
 static tusb_desc_device_t descriptor_config = {
@@ -90,6 +126,9 @@ static char const *string_desc_arr[] = {
     "TinyUSB Device",            // 2: Product
     "123456",                    // 3: Serials
     "Example MSC",               // 4. MSC
+#if CONFIG_EXAMPLE_USB_CDC_TELEMETRY
+    "Telemetry CDC",             // 5. CDC
+#endif
 };
 /*********************************************************************** TinyUSB
  * descriptors*/
@@ -98,10 +137,61 @@ static char const *string_desc_arr[] = {
 
 #define PROMPT_STR CONFIG_IDF_TARGET
 
-// mount the partition and show all the files in BASE_PATH
-static void _mount(void) {
+#define CARD_TASK_STACK_SIZE 4096
+#define CARD_TASK_CORE       TASK_LAYOUT_UI_CORE
+#define CARD_TASK_PRIORITY   TASK_LAYOUT_CARD_PRIORITY
+#define CARD_POLL_MS         1000
+// failed re-inits after I/O errors before the card is reported removed
+#define CARD_GIVE_UP_ATTEMPTS 3
+
+// card task notification bits
+#define CARD_NOTIFY_BENCH    (1 << 0)
+#define CARD_NOTIFY_REINIT   (1 << 1)
+#define CARD_NOTIFY_FREQ     (1 << 2)  // new clock ceiling
+#define CARD_NOTIFY_CACHE    (1 << 3)  // new read-ahead window
+#define CARD_NOTIFY_EXPOSE   (1 << 4)  // hand the card to the host
+#define CARD_NOTIFY_UNEXPOSE (1 << 5)  // mount the card in the application
+#define CARD_NOTIFY_REQUESTS                                    \
+    (CARD_NOTIFY_BENCH | CARD_NOTIFY_FREQ | CARD_NOTIFY_CACHE | \
+     CARD_NOTIFY_EXPOSE | CARD_NOTIFY_UNEXPOSE)
+
+#define BENCH_MAX_RESULTS 10
+#ifdef CONFIG_EXAMPLE_BENCH_WRITE
+#define BENCH_ALLOW_WRITE true
+#else
+#define BENCH_ALLOW_WRITE false
+#endif  // CONFIG_EXAMPLE_BENCH_WRITE
+
+#ifdef CONFIG_EXAMPLE_MSC_READ_ONLY
+#define MSC_READ_ONLY true
+#else
+#define MSC_READ_ONLY false
+#endif  // CONFIG_EXAMPLE_MSC_READ_ONLY
+// BtnA held this long at power-up exposes the card read-only for this boot,
+// long enough that a stray touch while plugging in does not count
+#define READ_ONLY_HOLD_MS 1500
+#define READ_ONLY_POLL_MS 50
+
+static const esp_vfs_fat_sdmmc_mount_config_t s_mount_config = {
+#ifdef CONFIG_EXAMPLE_FORMAT_IF_MOUNT_FAILED
+    .format_if_mount_failed = true,
+#else
+    .format_if_mount_failed = false,
+#endif  // EXAMPLE_FORMAT_IF_MOUNT_FAILED
+    .max_files            = 5,
+    .allocation_unit_size = MSC_ALLOC_UNIT_SIZE};
+
+static TaskHandle_t s_card_task = NULL;
+
+#if !CONFIG_EXAMPLE_MSC_RAW_PASSTHROUGH
+// mount the partition and show all the files in BASE_PATH, unless the card
+// was listed on an earlier boot
+static void _mount(const esp_vfs_fat_mount_config_t *mount_config) {
     ESP_LOGI(TAG, "Mount storage...");
-    ESP_ERROR_CHECK(tinyusb_msc_storage_mount(BASE_PATH));
+    ESP_ERROR_CHECK(msc_storage_mount(BASE_PATH, mount_config));
+    if (card_profile_known()) {
+        return;
+    }
 
     // List all the files in this directory
     ESP_LOGI(TAG, "\nls command output:");
@@ -123,131 +213,571 @@ static void _mount(void) {
     }
     return;
 }
+#endif  // !CONFIG_EXAMPLE_MSC_RAW_PASSTHROUGH
 
-extern "C" {
-void app_main(void) {
-    M5.begin();
-    M5.Display.setTextDatum(top_center);
-    M5.Display.setTextColor(WHITE);
-    M5.Display.setTextDatum(middle_center);
-    M5.Display.setTextFont(&fonts::FreeSansBold9pt7b);
-    M5.Display.setTextSize(1);
-    M5.Display.pushImage(0, 0, 128, 128, image_data_background_1);
+#if CONFIG_EXAMPLE_USB_CDC_TELEMETRY
+#define CONSOLE_OUT_HINT "[cdc]"
+#else
+#define CONSOLE_OUT_HINT NULL
+#endif
 
-    esp_err_t ret;
+// Where a dump goes: the console, or the telemetry port with `cdc`
+static FILE *console_out(int argc, char **argv) {
+    if (argc == 1) {
+        return stdout;
+    }
+    if (argc == 2 && strcmp(argv[1], "cdc") == 0 && usb_telemetry_stream()) {
+        return usb_telemetry_stream();
+    }
+    printf("usage: %s%s\n", argv[0], usb_telemetry_stream() ? " [cdc]" : "");
+    return NULL;
+}
 
-    ESP_LOGI(TAG, "Initializing storage...");
+// console command: print the MSC counters
+static int console_stats(int argc, char **argv) {
+    FILE *out = console_out(argc, argv);
+    if (out == NULL) {
+        return 1;
+    }
+    msc_stats_print(out);
+    fflush(out);
+    return 0;
+}
+
+// console command: time spent at each CPU clock / sleep state
+static int console_power(int argc, char **argv) {
+    power_print();
+    return 0;
+}
 
-    static sdmmc_card_t *card = NULL;
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS && \
+    CONFIG_FREERTOS_USE_STATS_FORMATTING_FUNCTIONS
+// console command: CPU time per task since boot, and where each task runs
+static int console_tasks(int argc, char **argv) {
+    // about 40 bytes per task
+    static char buf[2048];
+    vTaskGetRunTimeStats(buf);
+    printf("task            time (us)       %%\n%s", buf);
+    vTaskList(buf);
+    printf("task            state prio stack num core\n%s", buf);
+    return 0;
+}
+#endif
 
-    card = (sdmmc_card_t *)malloc(sizeof(sdmmc_card_t));
-    if (card == NULL) {
-        ESP_LOGD(TAG, "could not locate new sdmmc_card_t");
+static bool parse_u32(const char *text, uint32_t *value) {
+    char *end;
+    unsigned long v = strtoul(text, &end, 10);
+    if (end == text || *end != '\0') {
+        return false;
     }
+    *value = v;
+    return true;
+}
 
-    esp_vfs_fat_sdmmc_mount_config_t mount_config = {
-#ifdef CONFIG_EXAMPLE_FORMAT_IF_MOUNT_FAILED
-        .format_if_mount_failed = true,
+// Store changed settings and have the card task apply `bits`
+static int apply_settings(const msc_settings_t *settings, uint32_t bits) {
+    if (msc_settings_set(settings) != ESP_OK) {
+        return 1;
+    }
+    if (bits) {
+        xTaskNotify(s_card_task, bits, eSetBits);
+    }
+    return 0;
+}
+
+// console command: benchmark the card, in the card task
+static int console_bench(int argc, char **argv) {
+    xTaskNotify(s_card_task, CARD_NOTIFY_BENCH, eSetBits);
+    printf("benchmark started, the host is kept off the card meanwhile\n");
+    return 0;
+}
+
+// console command: show the card clock, or store a new ceiling and
+// renegotiate
+static int console_freq(int argc, char **argv) {
+    msc_settings_t settings = *msc_settings_get();
+    if (argc > 1) {
+        if (!parse_u32(argv[1], &settings.max_freq_khz)) {
+            printf("usage: freq [<kHz>]\n");
+            return 1;
+        }
+        printf("renegotiating up to %lu kHz\n", settings.max_freq_khz);
+        return apply_settings(&settings, CARD_NOTIFY_FREQ);
+    }
+    printf("clock %d kHz, ceiling %lu kHz\n", sd_card_get_freq_khz(),
+           settings.max_freq_khz);
+    return 0;
+}
+
+// console command: show or change the read-ahead window and the write-back
+// flush delay, or flush the write-back cache
+static int console_cache(int argc, char **argv) {
+    msc_settings_t settings = *msc_settings_get();
+    if (argc == 2 && strcmp(argv[1], "flush") == 0) {
+        msc_storage_flush();
+        return 0;
+    }
+    if (argc == 3 && strcmp(argv[1], "ra") == 0 &&
+        parse_u32(argv[2], &settings.readahead_sectors)) {
+        return apply_settings(&settings, CARD_NOTIFY_CACHE);
+    }
+    if (argc == 3 && strcmp(argv[1], "flush_ms") == 0 &&
+        parse_u32(argv[2], &settings.writeback_flush_ms) &&
+        apply_settings(&settings, 0) == 0) {
+        msc_writeback_set_flush_ms(settings.writeback_flush_ms);
+        return 0;
+    }
+    if (argc > 1) {
+        printf("usage: cache [flush | ra <sectors> | flush_ms <ms>]\n");
+        return 1;
+    }
+
+    msc_readahead_stats_t ra;
+    msc_readahead_get_stats(&ra);
+    printf("read-ahead: %lu sectors (ring %d)\n", msc_readahead_window(),
+           CONFIG_EXAMPLE_MSC_READAHEAD_SECTORS);
+    printf("            %lu hits, %lu misses, %lu prefetched, %lu discarded\n",
+           ra.hits, ra.misses, ra.prefetched, ra.discarded);
+    if (msc_storage_is_read_only()) {
+        msc_metacache_stats_t meta;
+        msc_metacache_get_stats(&meta);
+        printf("metadata:   %d sectors, %lu hits, %lu misses\n",
+               CONFIG_EXAMPLE_MSC_METACACHE_SECTORS, meta.hits, meta.misses);
+    } else {
+        printf("metadata:   off, the card is writable\n");
+    }
+#if CONFIG_EXAMPLE_MSC_WRITE_BACK
+    msc_writeback_stats_t wb;
+    msc_writeback_get_stats(&wb);
+    printf("write-back: %d sectors, flush after %lu ms\n",
+           CONFIG_EXAMPLE_MSC_WRITEBACK_SECTORS, settings.writeback_flush_ms);
+    printf("            %lu cached, %lu flushes, %lu sectors in %lu writes\n",
+           wb.cached, wb.flushes, wb.flushed, wb.writes);
 #else
-        .format_if_mount_failed = false,
-#endif  // EXAMPLE_FORMAT_IF_MOUNT_FAILED
-        // .max_files            = 5,
-        .allocation_unit_size = 16 * 1024};
+    printf("write-back: off\n");
+#endif
+    return 0;
+}
 
-    ESP_LOGI(TAG, "Initializing SD card");
-    ESP_LOGI(TAG, "Using SPI peripheral");
-
-    // By default, SD card frequency is initialized to SDMMC_FREQ_DEFAULT
-    // (20MHz) For setting a specific frequency, use host.max_freq_khz (range
-    // 400kHz - 20MHz for SDSPI) Example: for fixed frequency of 10MHz, use
-    // host.max_freq_khz = 10000;
-    sdmmc_host_t host = SDSPI_HOST_DEFAULT();
-
-    spi_bus_config_t bus_cfg = {
-        .mosi_io_num     = PIN_NUM_MOSI,
-        .miso_io_num     = PIN_NUM_MISO,
-        .sclk_io_num     = PIN_NUM_CLK,
-        .quadwp_io_num   = -1,
-        .quadhd_io_num   = -1,
-        .max_transfer_sz = 4000,
-    };
-    ret = spi_bus_initialize((spi_host_device_t)host.slot, &bus_cfg,
-                             SDSPI_DEFAULT_DMA);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to initialize bus.");
-        return;
+// console command: show the stored settings, or go back to the defaults
+static int console_settings(int argc, char **argv) {
+    if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        if (msc_settings_reset() != ESP_OK) {
+            return 1;
+        }
+        msc_writeback_set_flush_ms(msc_settings_get()->writeback_flush_ms);
+        xTaskNotify(s_card_task, CARD_NOTIFY_FREQ | CARD_NOTIFY_CACHE,
+                    eSetBits);
+    } else if (argc > 1) {
+        printf("usage: settings [reset]\n");
+        return 1;
+    }
+    const msc_settings_t *settings = msc_settings_get();
+    printf("max_freq:  %lu kHz\n", settings->max_freq_khz);
+    printf("ra:        %lu sectors\n", settings->readahead_sectors);
+    printf("flush_ms:  %lu ms\n", settings->writeback_flush_ms);
+    return 0;
+}
+
+#if CONFIG_EXAMPLE_MSC_TRACE
+// console command: dump and clear the per-command trace
+static int console_trace(int argc, char **argv) {
+    FILE *out = console_out(argc, argv);
+    if (out == NULL) {
+        return 1;
     }
+    msc_trace_dump(out);
+    fflush(out);
+    return 0;
+}
+#endif
 
-    // This initializes the slot without card detect (CD) and write protect (WP)
-    // signals. Modify slot_config.gpio_cd and slot_config.gpio_wp if your board
-    // has these signals.
-    sdspi_device_config_t slot_config = SDSPI_DEVICE_CONFIG_DEFAULT();
-    slot_config.gpio_cs               = PIN_NUM_CS;
-    slot_config.host_id               = (spi_host_device_t)host.slot;
-    int card_handle                   = -1;  // uninitialized
-    sdspi_host_init_device((const sdspi_device_config_t *)&slot_config,
-                           &card_handle);
+#if !CONFIG_EXAMPLE_MSC_RAW_PASSTHROUGH
+// console commands: move the card between the host and the application
+static int console_expose(int argc, char **argv) {
+    xTaskNotify(s_card_task, CARD_NOTIFY_EXPOSE, eSetBits);
+    return 0;
+}
 
-    while (sdmmc_card_init(&host, card) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to initialize sdcard.");
-        vTaskDelay(pdMS_TO_TICKS(1000));
-    };
-    ESP_LOGI(TAG, "Success initialize sdcard.");
-    // ESP_LOGI(
-    //     TAG, "Size: %lluMB\n",
-    //     ((uint64_t)card->csd.capacity) * card->csd.sector_size / (1024.0 *
-    //     1024.0));
+static int console_unexpose(int argc, char **argv) {
+    xTaskNotify(s_card_task, CARD_NOTIFY_UNEXPOSE, eSetBits);
+    return 0;
+}
+#endif  // !CONFIG_EXAMPLE_MSC_RAW_PASSTHROUGH
+
+static const esp_console_cmd_t cmds[] = {
+    {
+        .command = "stats",
+        .help    = "print USB MSC throughput, command and stall counters",
+        .hint    = CONSOLE_OUT_HINT,
+        .func    = &console_stats,
+    },
+    {
+        .command = "power",
+        .help    = "print the time spent boosted, idle and in low power",
+        .hint    = NULL,
+        .func    = &console_power,
+    },
+    {
+        .command = "bench",
+        .help    = "benchmark the card, results on the display",
+        .hint    = NULL,
+        .func    = &console_bench,
+    },
+    {
+        .command = "freq",
+        .help    = "print the card clock, or store a new ceiling (kHz) and "
+                   "renegotiate",
+        .hint    = "[<kHz>]",
+        .func    = &console_freq,
+    },
+    {
+        .command = "cache",
+        .help    = "print the cache sizes, flush the write-back cache, or "
+                   "store a new read-ahead window or flush delay",
+        .hint    = "[flush | ra <sectors> | flush_ms <ms>]",
+        .func    = &console_cache,
+    },
+    {
+        .command = "settings",
+        .help    = "print the settings stored in NVS, or go back to the "
+                   "defaults",
+        .hint    = "[reset]",
+        .func    = &console_settings,
+    },
+#if !CONFIG_EXAMPLE_MSC_RAW_PASSTHROUGH
+    {
+        .command = "expose",
+        .help    = "unmount the card in the application and hand it to the "
+                   "host",
+        .hint    = NULL,
+        .func    = &console_expose,
+    },
+    {
+        .command = "unexpose",
+        .help    = "take the card from the host and mount it in the "
+                   "application",
+        .hint    = NULL,
+        .func    = &console_unexpose,
+    },
+#endif
+#if CONFIG_EXAMPLE_MSC_TRACE
+    {
+        .command = "trace",
+        .help    = "dump the per-command trace for tools/msc_trace.py and "
+                   "clear it",
+        .hint    = CONSOLE_OUT_HINT,
+        .func    = &console_trace,
+    },
+#endif
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS && \
+    CONFIG_FREERTOS_USE_STATS_FORMATTING_FUNCTIONS
+    {
+        .command = "tasks",
+        .help    = "print CPU time, priority and core of every task",
+        .hint    = NULL,
+        .func    = &console_tasks,
+    },
+#endif
+};
+
+static const sd_bench_result_t *find_result(const sd_bench_result_t *results,
+                                            size_t n, const char *test,
+                                            uint32_t size) {
+    for (size_t i = 0; i < n; i++) {
+        if (strcmp(results[i].test, test) == 0 && results[i].size == size) {
+            return &results[i];
+        }
+    }
+    return NULL;
+}
+
+// benchmark the card and show a summary, the host is locked out meanwhile
+static void _bench(sdmmc_card_t *card) {
+    msc_storage_claim();
+
+    const char *busy_line     = "Benchmark...";
+    const uint32_t busy_color = WHITE;
+    display_show_lines(&busy_line, &busy_color, 1);
+
+    sd_bench_result_t results[BENCH_MAX_RESULTS];
+    size_t n = 0;
+    if (sd_bench_run(card, BENCH_ALLOW_WRITE, results, BENCH_MAX_RESULTS,
+                     &n) != ESP_OK) {
+        ESP_LOGW(TAG, "Benchmark incomplete");
+    }
+
+    const sd_bench_result_t *rd = find_result(results, n, "seq_read", 32768);
+    const sd_bench_result_t *wr = find_result(results, n, "seq_write", 32768);
+    const sd_bench_result_t *rr = find_result(results, n, "rand_read", 4096);
+    char text[DISPLAY_MAX_LINES][30] = {"SD bench", "R --", "W --", "", ""};
+    const uint32_t colors[DISPLAY_MAX_LINES] = {WHITE, GREEN, GREEN, 0x4e7f,
+                                                0x4e7f};
+    const char *lines[DISPLAY_MAX_LINES];
+
+    if (rd) {
+        sprintf(text[1], "R %.1f MB/s", rd->mbps);
+    }
+    if (wr) {
+        sprintf(text[2], "W %.1f MB/s", wr->mbps);
+    }
+    if (rr) {
+        sprintf(text[3], "4K %.0f IOPS", rr->iops);
+        sprintf(text[4], "p99 %.1f ms", rr->p99_us / 1000.0);
+    }
+    for (int i = 0; i < DISPLAY_MAX_LINES; i++) {
+        lines[i] = text[i];
+    }
+    display_show_lines(lines, colors, DISPLAY_MAX_LINES);
 
-    M5.Display.pushImage(0, 0, 128, 128, image_data_background_2);
+    msc_storage_release();
+}
+
+static void _show_freq(void) {
+    char freq[16];
+    sprintf(freq, "%d MHz", sd_card_get_freq_khz() / 1000);
+    display_set_text(DISPLAY_FIELD_FREQ, freq, WHITE);
+}
+
+// mount in the app to read the card, then hand it to the host if one is there.
+// fat_space fills in the sizes once the volume is mounted. In raw passthrough
+// mode the card goes to the host right away.
+static void _card_ready(void) {
+    display_set_background(DISPLAY_BG_READY);
+    display_set_text(DISPLAY_FIELD_FREE, "F: --", GREEN);
+    display_set_text(DISPLAY_FIELD_TOTAL, "T: --", 0x4e7f);
+    _show_freq();
+
+#if !CONFIG_EXAMPLE_MSC_RAW_PASSTHROUGH
+    _mount(&s_mount_config);
+    if (tud_mounted()) {
+        msc_storage_unmount();
+    }
+#endif
+}
+
+// Stop telling the host the card is becoming ready after I/O errors. The
+// medium was already recorded as gone by msc_storage_media_removed(), so out
+// of the degraded state the host is answered MEDIUM NOT PRESENT.
+static void _card_give_up(void) {
+    ESP_LOGW(TAG, "SD card did not come back, reporting it removed");
+    sd_recovery_clear();
+}
+
+// Initialize the card again until it answers. After CARD_GIVE_UP_ATTEMPTS
+// failed attempts the host is told the medium is gone instead of becoming
+// ready.
+static void _card_reinit(sdmmc_card_t *card) {
+    for (int attempt = 1; sd_card_reinit(card) != ESP_OK; attempt++) {
+        if (attempt == CARD_GIVE_UP_ATTEMPTS && sd_recovery_degraded()) {
+            _card_give_up();
+        }
+        vTaskDelay(pdMS_TO_TICKS(CARD_POLL_MS));
+    }
+    // the card answers again
+    sd_recovery_clear();
+}
+
+// Initialize the card again under the new clock ceiling: going above 20 MHz
+// needs the high speed switch of a fresh init. Should the card not come back,
+// the next poll handles it as removed.
+static void _card_retune(sdmmc_card_t *card) {
+    msc_storage_claim();
+    sd_card_set_max_freq_khz(msc_settings_get()->max_freq_khz);
+    if (sd_card_reinit(card) != ESP_OK) {
+        ESP_LOGW(TAG, "card did not answer after the clock change");
+    }
+    msc_storage_release();
+    _show_freq();
+}
 
-    sdmmc_card_print_info(stdout, card);
-    const tinyusb_msc_sdmmc_config_t config_sdmmc = {.card = card};
-    ESP_ERROR_CHECK(tinyusb_msc_storage_init_sdmmc(&config_sdmmc));
+// Console requests, handled here so they never overlap with each other, a
+// benchmark or the polling
+static void _card_requests(sdmmc_card_t *card, uint32_t bits) {
+    if (bits & CARD_NOTIFY_FREQ) {
+        _card_retune(card);
+    }
+    if (bits & CARD_NOTIFY_CACHE) {
+        msc_storage_set_readahead(msc_settings_get()->readahead_sectors);
+        ESP_LOGI(TAG, "read-ahead window %lu sectors", msc_readahead_window());
+    }
+#if !CONFIG_EXAMPLE_MSC_RAW_PASSTHROUGH
+    if (bits & CARD_NOTIFY_EXPOSE) {
+        msc_storage_unmount();
+    }
+    if ((bits & CARD_NOTIFY_UNEXPOSE) &&
+        msc_storage_mount(BASE_PATH, &s_mount_config) != ESP_OK) {
+        ESP_LOGW(TAG, "could not mount the card in the application");
+    }
+#endif
+    if (bits & CARD_NOTIFY_BENCH) {
+        _bench(card);
+    }
+}
 
-    // mounted in the app by default
-    _mount();
+/* Card bring-up runs here, after USB is already enumerated; the host is told
+ * the unit is becoming ready meanwhile, or that there is no medium if no card
+ * answers a few attempts. Afterwards the card is polled through the SD worker,
+ * and losing it or getting it back is reported as a media change. When the SD
+ * worker gave up on an I/O error the card is re-initialized the same way.
+ * Benchmarks and console requests, sent as task notifications, run here as
+ * well, so they never overlap with the polling. */
+static void card_task(void *arg) {
+    (void)arg;
+    sdmmc_card_t *card = NULL;
 
-    uint64_t out_total_bytes = 0;
-    uint64_t out_free_bytes  = 0;
+    ESP_LOGI(TAG, "Initializing SD card");
+    sd_recovery_init(xTaskGetCurrentTaskHandle(), CARD_NOTIFY_REINIT);
+    esp_err_t ret = sd_card_init(&card);
+    if (ret == ESP_ERR_TIMEOUT) {
+        msc_storage_no_card();
+        _card_reinit(card);
+    } else if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to set up the SD card host.");
+        vTaskDelete(NULL);
+    }
+    if (!card_profile_known()) {
+        sdmmc_card_print_info(stdout, card);
+    }
+    ESP_ERROR_CHECK(msc_storage_init(card));
 
-    esp_vfs_fat_info(BASE_PATH, &out_total_bytes, &out_free_bytes);
+    _card_ready();
+#if CONFIG_EXAMPLE_BENCH_AT_BOOT
+    _bench(card);
+#endif
 
-    float free_mb  = (out_free_bytes / 1024.0 / 1024.0);
-    float total_mb = (out_total_bytes / 1024.0 / 1024.0);
+    while (1) {
+        uint32_t bits = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &bits, pdMS_TO_TICKS(CARD_POLL_MS));
+        if (bits & CARD_NOTIFY_REINIT) {
+            ESP_LOGW(TAG, "Re-initializing the SD card after I/O errors");
+        } else if (bits & CARD_NOTIFY_REQUESTS) {
+            _card_requests(card, bits);
+            continue;
+        } else if (msc_pipeline_check_card() == ESP_OK) {
+            continue;
+        }
+        msc_storage_media_removed();
+        display_set_background(DISPLAY_BG_BOOT);
+        _card_reinit(card);
+        msc_storage_media_inserted();
+        _card_ready();
+    }
+}
 
-    ESP_LOGI(TAG, "Size: %.1f/%.1fMB\n", free_mb, total_mb);
+extern "C" {
+// Read-only by configuration, or while BtnA is held at power-up
+static bool read_only_requested(void) {
+    if (MSC_READ_ONLY) {
+        return true;
+    }
+    if (!button_is_pressed()) {
+        return false;
+    }
 
-    // M5.Display.fillRect(9, 84, 50, 22, 0x4e7f);
+    const char *hold_line     = "Hold: read-only";
+    const uint32_t hold_color = WHITE;
+    display_show_lines(&hold_line, &hold_color, 1);
+    for (int ms = 0; ms < READ_ONLY_HOLD_MS; ms += READ_ONLY_POLL_MS) {
+        vTaskDelay(pdMS_TO_TICKS(READ_ONLY_POLL_MS));
+        if (!button_is_pressed()) {
+            display_set_background(DISPLAY_BG_BOOT);
+            return false;
+        }
+    }
 
-    char free[30];
-    char total[30];
+    // left on screen until the card comes up
+    const char *ro_line     = "Read-only";
+    const uint32_t ro_color = RED;
+    display_show_lines(&ro_line, &ro_color, 1);
+    return true;
+}
 
-    sprintf(free, "F: %.1fMB", free_mb);
-    sprintf(total, "T: %.1fMB", total_mb);
+void app_main(void) {
+    M5.begin();
+    ESP_ERROR_CHECK(display_init());
+    ESP_ERROR_CHECK(button_init());
+
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES ||
+        ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(ret);
+    ESP_ERROR_CHECK(msc_settings_init());
+    ESP_ERROR_CHECK(card_profile_init());
+    const msc_settings_t *settings = msc_settings_get();
+    sd_card_set_max_freq_khz(settings->max_freq_khz);
+    msc_storage_set_readahead(settings->readahead_sectors);
+    msc_writeback_set_flush_ms(settings->writeback_flush_ms);
+    ESP_ERROR_CHECK(fat_space_init());
+    ESP_ERROR_CHECK(power_init());
+    if (msc_flash_init() != ESP_OK) {
+        ESP_LOGW(TAG, "flash LUN not available");
+    }
 
-    M5.Display.setTextColor(GREEN);
-    M5.Display.drawString(free, M5.Display.width() / 2, 52);
-    M5.Display.setTextColor(0x4e7f);
-    M5.Display.drawString(total, M5.Display.width() / 2, 97);
+    if (read_only_requested()) {
+        ESP_LOGI(TAG, "exposing the card read-only");
+        msc_storage_set_read_only(true);
+    }
 
+    // USB first: the host enumerates the device while the card comes up
     ESP_LOGI(TAG, "USB MSC initialization");
     const tinyusb_config_t tusb_cfg = {
         .device_descriptor = &descriptor_config,
         .string_descriptor = string_desc_arr,
         .string_descriptor_count =
             sizeof(string_desc_arr) / sizeof(string_desc_arr[0]),
-        .external_phy             = false,
+        .external_phy             = MSC_EXTERNAL_PHY,
         .configuration_descriptor = desc_configuration,
     };
     ESP_ERROR_CHECK(tinyusb_driver_install(&tusb_cfg));
+    ESP_ERROR_CHECK(usb_telemetry_init());
     ESP_LOGI(TAG, "USB MSC initialization DONE");
 
+    ESP_LOGI(TAG, "Initializing storage...");
+    BaseType_t ok = xTaskCreatePinnedToCore(
+        card_task, "sd_card", CARD_TASK_STACK_SIZE, NULL, CARD_TASK_PRIORITY,
+        &s_card_task, CARD_TASK_CORE);
+    if (ok != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the SD card task.");
+        return;
+    }
+
+    esp_console_repl_t *repl              = NULL;
+    esp_console_repl_config_t repl_config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
+    /* Prompt to be printed before each line.
+     * This can be customized, made dynamic, etc.
+     */
+    repl_config.prompt             = PROMPT_STR ">";
+    repl_config.max_cmdline_length = 64;
+    esp_console_register_help_command();
+    esp_console_dev_uart_config_t hw_config =
+        ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_console_new_repl_uart(&hw_config, &repl_config, &repl));
+    for (size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); i++) {
+        ESP_ERROR_CHECK(esp_console_cmd_register(&cmds[i]));
+    }
+    ESP_ERROR_CHECK(esp_console_start_repl(repl));
+
+    button_event_t event;
     while (1) {
-        M5.update();
-        if (M5.BtnA.wasClicked()) {
-            esp_restart();
+        if (!button_wait(&event, portMAX_DELAY)) {
+            continue;
+        }
+        switch (event) {
+            case BUTTON_CLICK:
+                msc_storage_flush();
+                esp_restart();
+                break;
+            case BUTTON_DOUBLE_CLICK:
+                msc_stats_print(stdout);
+                break;
+            case BUTTON_LONG_PRESS:
+                xTaskNotify(s_card_task, CARD_NOTIFY_BENCH, eSetBits);
+                break;
         }
-        vTaskDelay(pdMS_TO_TICKS(100));
     }
 }
 }
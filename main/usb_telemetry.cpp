@@ -0,0 +1,179 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/ringbuf.h"
+#include "freertos/task.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "tinyusb.h"
+#include "tusb_cdc_acm.h"
+
+#include "msc_stats.h"
+#include "task_layout.h"
+#include "usb_telemetry.h"
+
+#define TELEMETRY_ITF       TINYUSB_CDC_ACM_0
+#define TELEMETRY_RING_SIZE CONFIG_EXAMPLE_USB_CDC_TELEMETRY_RING
+#define TELEMETRY_PACKET    (TUD_OPT_HIGH_SPEED ? 512 : 64)
+
+#define DRAIN_TASK_STACK_SIZE 3072
+#define DRAIN_TASK_CORE       TASK_LAYOUT_UI_CORE
+#define DRAIN_TASK_PRIORITY   TASK_LAYOUT_UI_PRIORITY
+#define DRAIN_POLL_MS         20
+
+#define LOG_LINE_MAX    128  // longer log lines are cut
+#define STREAM_CHUNK    (TELEMETRY_RING_SIZE / 4)
+#define STREAM_WAIT_MS  1000
+#define STREAM_LINE_BUF 128
+
+static const char *TAG = "usb_telemetry";
+
+typedef struct {
+    RingbufHandle_t ring;
+    vprintf_like_t uart_vprintf;  // log output before the hook
+    FILE *stream;
+    uint32_t msc_chunks;  // read + write chunks at the last poll
+    volatile uint32_t queued;
+    volatile uint32_t sent;
+    volatile uint32_t dropped;
+} usb_telemetry_t;
+
+static usb_telemetry_t s_tel;
+
+static bool connected(void) {
+    return tud_cdc_n_connected(TELEMETRY_ITF);
+}
+
+static bool put(const void *data, size_t len, TickType_t wait) {
+    if (xRingbufferSend(s_tel.ring, data, len, wait) != pdTRUE) {
+        s_tel.dropped += len;
+        return false;
+    }
+    s_tel.queued += len;
+    return true;
+}
+
+// Log hook: never waits, the caller may be any task
+static int log_vprintf(const char *fmt, va_list args) {
+    if (!connected()) {
+        return s_tel.uart_vprintf(fmt, args);
+    }
+    char line[LOG_LINE_MAX];
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    if (len > 0) {
+        put(line, MIN((size_t)len, sizeof(line) - 1), 0);
+    }
+    return len;
+}
+
+static ssize_t stream_write(void *cookie, const char *buf, size_t size) {
+    (void)cookie;
+    for (size_t done = 0; done < size; done += STREAM_CHUNK) {
+        size_t len = MIN(size - done, (size_t)STREAM_CHUNK);
+        if (!connected()) {
+            s_tel.dropped += len;
+            continue;
+        }
+        put(buf + done, len, pdMS_TO_TICKS(STREAM_WAIT_MS));
+    }
+    // what was dropped is counted, stdio need not retry it
+    return size;
+}
+
+// True while the host moved MSC data since the last poll
+static bool msc_busy(void) {
+    static msc_stats_t stats;
+    msc_stats_get(&stats);
+    uint32_t chunks  = stats.read_chunks + stats.write_chunks;
+    bool busy        = chunks != s_tel.msc_chunks;
+    s_tel.msc_chunks = chunks;
+    return busy;
+}
+
+static void drain(size_t budget) {
+    while (budget > 0) {
+        size_t room = tud_cdc_n_write_available(TELEMETRY_ITF);
+        if (room == 0) {
+            break;
+        }
+        size_t len;
+        void *data = xRingbufferReceiveUpTo(s_tel.ring, &len, 0,
+                                            MIN(budget, room));
+        if (data == NULL) {
+            break;
+        }
+        len = tinyusb_cdcacm_write_queue(TELEMETRY_ITF, (const uint8_t *)data,
+                                          len);
+        vRingbufferReturnItem(s_tel.ring, data);
+        s_tel.sent += len;
+        budget -= MIN(budget, len);
+    }
+    tinyusb_cdcacm_write_flush(TELEMETRY_ITF, 0);
+}
+
+static void drain_task(void *arg) {
+    (void)arg;
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(DRAIN_POLL_MS));
+        bool busy = msc_busy();
+        if (!connected()) {
+            continue;
+        }
+        drain(busy ? TELEMETRY_PACKET : TELEMETRY_RING_SIZE);
+    }
+}
+
+esp_err_t usb_telemetry_init(void) {
+    const tinyusb_config_cdcacm_t acm_cfg = {
+        .usb_dev                      = TINYUSB_USBDEV_0,
+        .cdc_port                     = TELEMETRY_ITF,
+        .rx_unread_buf_sz             = 64,
+        .callback_rx                  = NULL,
+        .callback_rx_wanted_char      = NULL,
+        .callback_line_state_changed  = NULL,
+        .callback_line_coding_changed = NULL,
+    };
+    ESP_RETURN_ON_ERROR(tusb_cdc_acm_init(&acm_cfg), TAG,
+                        "could not start CDC-ACM");
+
+    s_tel.ring = xRingbufferCreate(TELEMETRY_RING_SIZE, RINGBUF_TYPE_BYTEBUF);
+    ESP_RETURN_ON_FALSE(s_tel.ring, ESP_ERR_NO_MEM, TAG, "no telemetry ring");
+
+    cookie_io_functions_t io = {
+        .read  = NULL,
+        .write = stream_write,
+        .seek  = NULL,
+        .close = NULL,
+    };
+    s_tel.stream = fopencookie(NULL, "w", io);
+    ESP_RETURN_ON_FALSE(s_tel.stream, ESP_ERR_NO_MEM, TAG,
+                        "no telemetry stream");
+    setvbuf(s_tel.stream, NULL, _IOLBF, STREAM_LINE_BUF);
+
+    BaseType_t ok = xTaskCreatePinnedToCore(
+        drain_task, "usb_telemetry", DRAIN_TASK_STACK_SIZE, NULL,
+        DRAIN_TASK_PRIORITY, NULL, DRAIN_TASK_CORE);
+    ESP_RETURN_ON_FALSE(ok == pdPASS, ESP_ERR_NO_MEM, TAG,
+                        "no telemetry task");
+
+    s_tel.uart_vprintf = esp_log_set_vprintf(log_vprintf);
+    ESP_LOGI(TAG, "CDC-ACM telemetry, %d byte ring", TELEMETRY_RING_SIZE);
+    return ESP_OK;
+}
+
+FILE *usb_telemetry_stream(void) {
+    return s_tel.stream;
+}
+
+void usb_telemetry_get_stats(usb_telemetry_stats_t *stats) {
+    stats->queued  = s_tel.queued;
+    stats->sent    = s_tel.sent;
+    stats->dropped = s_tel.dropped;
+}
@@ -0,0 +1,61 @@
+/*
+ * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Out-of-band telemetry over a CDC-ACM interface next to MSC, enabled with
+ * CONFIG_EXAMPLE_USB_CDC_TELEMETRY. Log output, and the console `stats` and
+ * `trace` dumps on request, go into a RAM ring without ever blocking the
+ * writer; what does not fit is dropped and counted. A low priority task on
+ * the housekeeping core moves the ring to the CDC IN endpoint:
+ * - only while a terminal has the port open (DTR set). Meanwhile log lines
+ *   skip the UART, which is slow and blocks the logging task;
+ * - while the host is moving MSC data, at most one packet per poll, so the
+ *   storage endpoints keep the bus.
+ *
+ * Without CONFIG_EXAMPLE_USB_CDC_TELEMETRY the functions below are no-ops and
+ * the device has the MSC interface only.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+typedef struct {
+    uint32_t queued;   // bytes put into the ring
+    uint32_t sent;     // bytes handed to the CDC endpoint
+    uint32_t dropped;  // bytes that did not fit into the ring
+} usb_telemetry_stats_t;
+
+#if CONFIG_EXAMPLE_USB_CDC_TELEMETRY
+
+// Set up the CDC-ACM port and the ring, start the drain task and take over
+// log output. After tinyusb_driver_install().
+esp_err_t usb_telemetry_init(void);
+
+// Stream into the ring, for dumps from the console. Writes wait a little for
+// room instead of dropping, so long dumps arrive whole while a terminal reads.
+FILE *usb_telemetry_stream(void);
+
+void usb_telemetry_get_stats(usb_telemetry_stats_t *stats);
+
+#else
+
+static inline esp_err_t usb_telemetry_init(void) {
+    return ESP_OK;
+}
+
+static inline FILE *usb_telemetry_stream(void) {
+    return NULL;
+}
+
+static inline void usb_telemetry_get_stats(usb_telemetry_stats_t *stats) {
+    *stats = {};
+}
+
+#endif  // CONFIG_EXAMPLE_USB_CDC_TELEMETRY
@@ -1,20 +1,276 @@
 # SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
 # SPDX-License-Identifier: CC0-1.0
+"""USB MSC smoke test and host-side throughput regression suite.
+
+The throughput test opens the SD card LUN the runner enumerated (found through
+/dev/disk/by-id, so the runner needs read/write access to the block device)
+and runs sequential and random workloads against it with O_DIRECT. Results are
+compared with msc_perf_baseline.json, per build config: the default build
+drives the card over SPI, esp32s3_sdmmc over the 4-bit SDMMC host.
+
+Writes only go to a scratch window in the middle of the card, which is saved
+before and restored after the test. Environment variables:
+- MSC_PERF_TOLERANCE: allowed drop below the baseline, default 0.15
+- MSC_PERF_UPDATE_BASELINE=1: store the measured results as the new baseline
+"""
+import ctypes
+import fcntl
+import glob
+import json
+import mmap
+import os
+import random
+import time
+from typing import Callable, Dict, Iterator, Tuple
+
 import pytest
 from pytest_embedded import Dut
 
+BY_ID_GLOB = '/dev/disk/by-id/usb-M5Stack_AtomS3_SD_Reader*-0:0'
+BASELINE_FILE = os.path.join(os.path.dirname(__file__), 'msc_perf_baseline.json')
+MiB = 1024 * 1024
+RANDOM_BLOCK = 4096
+
+# Workload sizes per build config. The SPI build is slower, so it gets less
+# data to keep the run time comparable.
+PERF_PROFILES = {
+    'default': {'seq_bytes': 4 * MiB, 'random_ops': 256},
+    'esp32s3_sdmmc': {'seq_bytes': 8 * MiB, 'random_ops': 512},
+}
 
-@pytest.mark.esp32s2
+
+@pytest.mark.esp32s3
 @pytest.mark.usb_device
 def test_usb_device_msc_example(dut: Dut) -> None:
-    dut.expect('Mount storage')
     dut.expect('TinyUSB Driver installed')
     dut.expect('USB MSC initialization DONE')
-    dut.write(' help')
-    dut.expect('read')
-    dut.expect('write')
-    dut.expect('size')
-    dut.expect('expose')
-    dut.expect('status')
-    dut.write(' status')
+    dut.expect('Mount storage')
     dut.expect('storage exposed over USB')
+    dut.write(' help')
+    # esp_console lists the commands alphabetically
+    for command in ('bench', 'cache', 'expose', 'freq', 'power', 'settings', 'stats', 'tasks', 'unexpose'):
+        dut.expect(command)
+    dut.write('freq')
+    dut.expect(r'clock \d+ kHz, ceiling \d+ kHz')
+    dut.write('cache')
+    dut.expect(r'read-ahead: \d+ sectors')
+
+
+@pytest.mark.esp32s3
+@pytest.mark.usb_device
+def test_usb_device_msc_eject_without_card(dut: Dut) -> None:
+    # only meaningful on a runner with the card slot empty
+    match = dut.expect(['no card', 'storage exposed over USB'], timeout=60)
+    if b'no card' not in match.group(0):
+        pytest.skip('an SD card is inserted')
+    fd = os.open(find_block_device(), os.O_RDONLY | os.O_NONBLOCK)
+    try:
+        # answered CHECK CONDITION, MEDIUM NOT PRESENT, or GOOD: either way the
+        # device must not fall over
+        for cdb in (START_STOP_EJECT, SYNCHRONIZE_CACHE_10):
+            assert scsi_command(fd, cdb) in (SCSI_GOOD, SCSI_CHECK_CONDITION)
+    finally:
+        os.close(fd)
+    dut.write('stats')
+    dut.expect(r'read:\s+\d+ bytes in \d+ chunks')
+
+
+START_STOP_EJECT = bytes([0x1B, 0, 0, 0, 0x02, 0])
+SYNCHRONIZE_CACHE_10 = bytes([0x35, 0, 0, 0, 0, 0, 0, 0, 0, 0])
+SCSI_GOOD = 0x00
+SCSI_CHECK_CONDITION = 0x02
+SG_IO = 0x2285
+SG_DXFER_NONE = -1
+
+
+class SgIoHdr(ctypes.Structure):
+    _fields_ = [
+        ('interface_id', ctypes.c_int),
+        ('dxfer_direction', ctypes.c_int),
+        ('cmd_len', ctypes.c_ubyte),
+        ('mx_sb_len', ctypes.c_ubyte),
+        ('iovec_count', ctypes.c_ushort),
+        ('dxfer_len', ctypes.c_uint),
+        ('dxferp', ctypes.c_void_p),
+        ('cmdp', ctypes.c_void_p),
+        ('sbp', ctypes.c_void_p),
+        ('timeout', ctypes.c_uint),
+        ('flags', ctypes.c_uint),
+        ('pack_id', ctypes.c_int),
+        ('usr_ptr', ctypes.c_void_p),
+        ('status', ctypes.c_ubyte),
+        ('masked_status', ctypes.c_ubyte),
+        ('msg_status', ctypes.c_ubyte),
+        ('sb_len_wr', ctypes.c_ubyte),
+        ('host_status', ctypes.c_ushort),
+        ('driver_status', ctypes.c_ushort),
+        ('resid', ctypes.c_int),
+        ('duration', ctypes.c_uint),
+        ('info', ctypes.c_uint),
+    ]
+
+
+def scsi_command(fd: int, cdb: bytes) -> int:
+    """Send a CDB without a data phase through SG_IO; returns the SCSI status."""
+    cmd = ctypes.create_string_buffer(cdb, len(cdb))
+    sense = ctypes.create_string_buffer(32)
+    hdr = SgIoHdr(interface_id=ord('S'), dxfer_direction=SG_DXFER_NONE, cmd_len=len(cdb),
+                  mx_sb_len=len(sense), cmdp=ctypes.addressof(cmd), sbp=ctypes.addressof(sense),
+                  timeout=10000)
+    fcntl.ioctl(fd, SG_IO, hdr)
+    assert hdr.host_status == 0, f'USB transport failed ({hdr.host_status:#x})'
+    return hdr.status
+
+
+def find_block_device(timeout: float = 30.0) -> str:
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        paths = glob.glob(BY_ID_GLOB)
+        if paths:
+            return os.path.realpath(paths[0])
+        time.sleep(0.5)
+    raise AssertionError(f'no block device matching {BY_ID_GLOB}')
+
+
+def device_counters(dut: Dut) -> Dict[str, int]:
+    """Counters printed by the `stats` console command."""
+    dut.write('stats')
+    counters = {}
+    match = dut.expect(r'read:\s+(\d+) bytes in (\d+) chunks')
+    counters['read_bytes'], counters['read_chunks'] = int(match.group(1)), int(match.group(2))
+    match = dut.expect(r'write:\s+(\d+) bytes in (\d+) chunks')
+    counters['write_bytes'], counters['write_chunks'] = int(match.group(1)), int(match.group(2))
+    counters['stalls'] = int(dut.expect(r'stalls:\s+(\d+)').group(1))
+    match = dut.expect(r'errors: timeout (\d+), crc (\d+), response (\d+), other (\d+)')
+    counters['card_errors'] = sum(int(match.group(i)) for i in range(1, 5))
+    return counters
+
+
+def aligned_buffer(size: int) -> mmap.mmap:
+    # anonymous mappings are page aligned, as O_DIRECT requires
+    return mmap.mmap(-1, size)
+
+
+def timed(fn: Callable[[], int]) -> Tuple[int, float]:
+    start = time.monotonic()
+    done = fn()
+    return done, time.monotonic() - start
+
+
+def chunks(offset: int, size: int, chunk: int) -> Iterator[int]:
+    for pos in range(offset, offset + size, chunk):
+        yield pos
+
+
+class BlockDevice:
+    def __init__(self, path: str) -> None:
+        self.fd = os.open(path, os.O_RDWR | os.O_DIRECT | os.O_SYNC)
+        self.size = os.lseek(self.fd, 0, os.SEEK_END)
+
+    def close(self) -> None:
+        os.close(self.fd)
+
+    def read(self, buf: mmap.mmap, offset: int) -> int:
+        return os.preadv(self.fd, [buf], offset)
+
+    def write(self, buf: mmap.mmap, offset: int) -> int:
+        return os.pwritev(self.fd, [buf], offset)
+
+
+def seq_read(dev: BlockDevice, offset: int, size: int) -> int:
+    buf = aligned_buffer(MiB)
+    return sum(dev.read(buf, pos) for pos in chunks(offset, size, MiB))
+
+
+def seq_write(dev: BlockDevice, offset: int, size: int) -> int:
+    buf = aligned_buffer(MiB)
+    buf.write(os.urandom(MiB))
+    done = sum(dev.write(buf, pos) for pos in chunks(offset, size, MiB))
+    os.fsync(dev.fd)
+    return done
+
+
+def random_io(dev: BlockDevice, offset: int, size: int, ops: int, write: bool) -> int:
+    buf = aligned_buffer(RANDOM_BLOCK)
+    buf.write(os.urandom(RANDOM_BLOCK))
+    rng = random.Random(0x5D)
+    blocks = size // RANDOM_BLOCK
+    for _ in range(ops):
+        pos = offset + rng.randrange(blocks) * RANDOM_BLOCK
+        if write:
+            dev.write(buf, pos)
+        else:
+            dev.read(buf, pos)
+    if write:
+        os.fsync(dev.fd)
+    return ops
+
+
+def load_baseline(config: str) -> Dict[str, float]:
+    with open(BASELINE_FILE) as f:
+        return json.load(f)[config]
+
+
+def store_baseline(config: str, results: Dict[str, float]) -> None:
+    with open(BASELINE_FILE) as f:
+        baselines = json.load(f)
+    baselines[config] = {k: round(v, 3) for k, v in results.items()}
+    with open(BASELINE_FILE, 'w') as f:
+        json.dump(baselines, f, indent=4, sort_keys=True)
+        f.write('\n')
+
+
+@pytest.mark.esp32s3
+@pytest.mark.usb_device
+@pytest.mark.parametrize('config', ['default', 'esp32s3_sdmmc'], indirect=True)
+def test_usb_device_msc_throughput(dut: Dut, config: str, record_property: Callable) -> None:
+    profile = PERF_PROFILES[config]
+    seq_bytes = profile['seq_bytes']
+
+    dut.expect('storage exposed over USB', timeout=60)
+    dev = BlockDevice(find_block_device())
+    # scratch window in the middle of the card, away from the FAT structures
+    window = max(seq_bytes, 4 * MiB)
+    scratch = (dev.size // 2) // (4 * MiB) * (4 * MiB)
+    saved = aligned_buffer(window)
+    dev.read(saved, scratch)
+    before = device_counters(dut)
+
+    results = {}
+    try:
+        done, secs = timed(lambda: seq_read(dev, 0, seq_bytes))
+        results['seq_read_mbps'] = done / secs / MiB
+        done, secs = timed(lambda: seq_write(dev, scratch, seq_bytes))
+        results['seq_write_mbps'] = done / secs / MiB
+        done, secs = timed(lambda: random_io(dev, 0, dev.size, profile['random_ops'], write=False))
+        results['rand_read_iops'] = done / secs
+        done, secs = timed(lambda: random_io(dev, scratch, window, profile['random_ops'], write=True))
+        results['rand_write_iops'] = done / secs
+    finally:
+        dev.write(saved, scratch)
+        os.fsync(dev.fd)
+        dev.close()
+
+    after = device_counters(dut)
+    for name, value in results.items():
+        print(f'{config} {name}: {value:.3f}')
+        record_property(name, value)
+
+    # the device must have served every byte without failing a command; byte
+    # counters are 32 bit and wrap
+    assert (after['read_bytes'] - before['read_bytes']) % 2**32 >= seq_bytes
+    assert after['stalls'] == before['stalls'], 'commands failed back to the host'
+    assert after['card_errors'] == before['card_errors'], 'card errors during the run'
+
+    if os.environ.get('MSC_PERF_UPDATE_BASELINE') == '1':
+        store_baseline(config, results)
+        return
+
+    tolerance = float(os.environ.get('MSC_PERF_TOLERANCE', '0.15'))
+    baseline = load_baseline(config)
+    regressions = [
+        f'{name}: {results[name]:.3f} < {floor:.3f} * {1 - tolerance:.2f}'
+        for name, floor in baseline.items()
+        if results[name] < floor * (1 - tolerance)
+    ]
+    assert not regressions, 'throughput regressed: ' + ', '.join(regressions)
@@ -0,0 +1,214 @@
+#!/usr/bin/env python
+# SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+# SPDX-License-Identifier: CC0-1.0
+"""Decode MSC trace dumps from the console `trace` command.
+
+Reads a console capture (a file, or stdin with `-`) or, with --port, sends
+`trace` to the device itself (needs pyserial). Every dump between
+MSC_TRACE_BEGIN and MSC_TRACE_END is decoded; the layout is msc_trace_header_t
+and msc_trace_record_t from main/msc_trace.h.
+
+The time of a command is split into the MSC callbacks (which includes waiting
+for the card) and the rest, USB transfers and the host. Card I/O and SD queue
+time are shown next to it: read-ahead and write-behind overlap them with USB.
+
+Prints the slowest commands and the time per opcode. Optionally writes:
+- --chrome FILE: Chrome trace event JSON, for https://ui.perfetto.dev or
+  chrome://tracing. One track per LUN, each command a slice split into its
+  callback and USB parts, with card and queue time as arguments.
+- --folded FILE: folded stacks (`opcode;part microseconds`) for flamegraph.pl.
+"""
+import argparse
+import json
+import struct
+import sys
+from typing import Dict, Iterable, List, NamedTuple, TextIO
+
+HEADER = struct.Struct('<IHHIII')
+RECORD = struct.Struct('<IIIIIIIBBBB')
+MAGIC = 0x5443534d
+VERSION = 1
+FAILED = 0x01
+PHASES = ('callback', 'usb')
+
+OPCODES = {
+    0x00: 'TEST UNIT READY',
+    0x03: 'REQUEST SENSE',
+    0x12: 'INQUIRY',
+    0x1a: 'MODE SENSE(6)',
+    0x1b: 'START STOP UNIT',
+    0x1e: 'PREVENT ALLOW MEDIUM REMOVAL',
+    0x23: 'READ FORMAT CAPACITIES',
+    0x25: 'READ CAPACITY(10)',
+    0x28: 'READ(10)',
+    0x2a: 'WRITE(10)',
+    0x35: 'SYNCHRONIZE CACHE(10)',
+    0x42: 'UNMAP',
+    0x5a: 'MODE SENSE(10)',
+    0x93: 'WRITE SAME(16)',
+    0x9e: 'READ CAPACITY(16)',
+}
+
+
+class Command(NamedTuple):
+    start_us: int  # unwrapped, from the first recorded command
+    total_us: int
+    cb_us: int
+    queue_us: int
+    card_us: int
+    lba: int
+    nbytes: int
+    opcode: int
+    lun: int
+    failed: bool
+
+    @property
+    def name(self) -> str:
+        return OPCODES.get(self.opcode, f'0x{self.opcode:02x}')
+
+    def phases(self) -> Dict[str, int]:
+        cb_us = min(self.cb_us, self.total_us)
+        return {'callback': cb_us, 'usb': self.total_us - cb_us}
+
+
+def dumps(lines: Iterable[str]) -> Iterable[List[bytes]]:
+    block = None
+    for line in lines:
+        line = line.strip()
+        if line.endswith('MSC_TRACE_BEGIN'):
+            block = []
+        elif line.endswith('MSC_TRACE_END'):
+            if block is not None:
+                yield block
+            block = None
+        elif block is not None and line:
+            block.append(bytes.fromhex(line))
+
+
+def decode(lines: Iterable[str]) -> List[Command]:
+    commands = []
+    for block in dumps(lines):
+        magic, version, size, count, dropped, now_us = HEADER.unpack(block[0])
+        if magic != MAGIC or version != VERSION or size != RECORD.size:
+            raise ValueError(f'unknown trace format {magic:08x} v{version}, {size} byte records')
+        if len(block) != count + 1:
+            raise ValueError(f'dump has {len(block) - 1} of {count} records')
+        if dropped:
+            print(f'warning: {dropped} commands not recorded', file=sys.stderr)
+        for raw in block[1:]:
+            start, total, cb, queue, card, lba, nbytes, opcode, lun, flags, _ = RECORD.unpack(raw)
+            # 32 bit microsecond clock: every record is older than its dump
+            start = now_us - ((now_us - start) & 0xffffffff)
+            commands.append(Command(start, total, cb, queue, card, lba, nbytes, opcode, lun,
+                                    bool(flags & FAILED)))
+    if not commands:
+        return []
+    first = min(c.start_us for c in commands)
+    return sorted((c._replace(start_us=c.start_us - first) for c in commands), key=lambda c: c.start_us)
+
+
+def summary(commands: List[Command], slowest: int, out: TextIO) -> None:
+    out.write(f'{len(commands)} commands\n\n')
+    out.write(f'{"opcode":<24} {"count":>6} {"failed":>6} {"avg ms":>8} {"max ms":>8}'
+              + ''.join(f' {p + " %":>10}' for p in PHASES) + f' {"card ms":>8} {"queue ms":>8}\n')
+    by_name: Dict[str, List[Command]] = {}
+    for c in commands:
+        by_name.setdefault(c.name, []).append(c)
+    for name, cmds in sorted(by_name.items(), key=lambda kv: -sum(c.total_us for c in kv[1])):
+        total = sum(c.total_us for c in cmds)
+        phases = {p: sum(c.phases()[p] for c in cmds) for p in PHASES}
+        out.write(f'{name:<24} {len(cmds):>6} {sum(c.failed for c in cmds):>6} '
+                  f'{total / len(cmds) / 1000:>8.2f} {max(c.total_us for c in cmds) / 1000:>8.2f}'
+                  + ''.join(f' {100 * phases[p] / total if total else 0:>10.1f}' for p in PHASES)
+                  + f' {sum(c.card_us for c in cmds) / len(cmds) / 1000:>8.2f}'
+                  f' {sum(c.queue_us for c in cmds) / len(cmds) / 1000:>8.2f}\n')
+
+    out.write(f'\nslowest {slowest}:\n')
+    for c in sorted(commands, key=lambda c: -c.total_us)[:slowest]:
+        detail = ', '.join(f'{p} {us / 1000:.2f}' for p, us in c.phases().items())
+        detail += f', card {c.card_us / 1000:.2f}, queue {c.queue_us / 1000:.2f}'
+        out.write(f'{c.start_us / 1e6:10.6f}s lun{c.lun} {c.name:<20} lba={c.lba:<10} '
+                  f'{c.nbytes:>7} B {c.total_us / 1000:8.2f} ms ({detail})'
+                  + (' FAILED' if c.failed else '') + '\n')
+
+
+def chrome_trace(commands: List[Command]) -> Dict:
+    events = []
+    for c in commands:
+        args = {'lba': c.lba, 'bytes': c.nbytes, 'failed': c.failed,
+                'card_us': c.card_us, 'queue_us': c.queue_us}
+        events.append({'name': c.name, 'ph': 'X', 'pid': 1, 'tid': c.lun,
+                       'ts': c.start_us, 'dur': c.total_us, 'args': args})
+        ts = c.start_us
+        for phase, us in c.phases().items():
+            if us:
+                events.append({'name': phase, 'ph': 'X', 'pid': 1, 'tid': c.lun,
+                               'ts': ts, 'dur': us})
+                ts += us
+    for lun in sorted({c.lun for c in commands}):
+        events.append({'name': 'thread_name', 'ph': 'M', 'pid': 1, 'tid': lun,
+                       'args': {'name': f'LUN{lun}'}})
+    return {'traceEvents': events, 'displayTimeUnit': 'ms'}
+
+
+def folded(commands: List[Command]) -> List[str]:
+    stacks: Dict[str, int] = {}
+    for c in commands:
+        for phase, us in c.phases().items():
+            key = f'{c.name.replace(" ", "_")};{phase}'
+            stacks[key] = stacks.get(key, 0) + us
+    return [f'{k} {v}' for k, v in sorted(stacks.items()) if v]
+
+
+def read_port(port: str, baud: int) -> List[str]:
+    import serial  # pyserial, only needed to talk to the device
+
+    lines = []
+    with serial.Serial(port, baud, timeout=5) as ser:
+        ser.reset_input_buffer()
+        ser.write(b'trace\n')
+        while True:
+            line = ser.readline().decode(errors='replace')
+            if not line:
+                raise TimeoutError('no MSC_TRACE_END from the device')
+            lines.append(line)
+            if line.strip().endswith('MSC_TRACE_END'):
+                return lines
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('log', nargs='?', help='console capture, - for stdin')
+    parser.add_argument('--port', help='serial port of the console, instead of a capture')
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--chrome', help='write Chrome trace event JSON here')
+    parser.add_argument('--folded', help='write folded stacks for flamegraph.pl here')
+    parser.add_argument('--slowest', type=int, default=20, help='number of slowest commands to list')
+    args = parser.parse_args()
+
+    if args.port:
+        lines = read_port(args.port, args.baud)
+    elif args.log == '-':
+        lines = sys.stdin.readlines()
+    elif args.log:
+        with open(args.log, errors='replace') as f:
+            lines = f.readlines()
+    else:
+        parser.error('give a console capture or --port')
+
+    commands = decode(lines)
+    if not commands:
+        print('no trace records found', file=sys.stderr)
+        return 1
+    summary(commands, args.slowest, sys.stdout)
+    if args.chrome:
+        with open(args.chrome, 'w') as f:
+            json.dump(chrome_trace(commands), f)
+    if args.folded:
+        with open(args.folded, 'w') as f:
+            f.write('\n'.join(folded(commands)) + '\n')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,156 @@
+#!/usr/bin/env python
+# SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+# SPDX-License-Identifier: CC0-1.0
+"""Convert a PNG into a run-length encoded RGB565 C header (rle_image_t).
+
+Each scanline is encoded on its own, as runs of up to 255 pixels of one
+colour, so the display can decode any row without a framebuffer. Colours are
+byte swapped RGB565, the order M5GFX pushImage() expects for uint16_t data.
+
+Only the standard library is used: 8 bit truecolour PNGs, with or without
+alpha, non-interlaced. Alpha is ignored.
+"""
+import argparse
+import struct
+import sys
+import zlib
+from typing import List, Tuple
+
+PNG_SIGNATURE = b'\x89PNG\r\n\x1a\n'
+MAX_RUN = 255
+
+
+def paeth(a: int, b: int, c: int) -> int:
+    p = a + b - c
+    pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+    if pa <= pb and pa <= pc:
+        return a
+    return b if pb <= pc else c
+
+
+def read_png(path: str) -> Tuple[int, int, List[List[Tuple[int, int, int]]]]:
+    with open(path, 'rb') as f:
+        data = f.read()
+    if not data.startswith(PNG_SIGNATURE):
+        raise ValueError(f'{path}: not a PNG file')
+
+    pos = len(PNG_SIGNATURE)
+    idat = b''
+    header = None
+    while pos < len(data):
+        length, kind = struct.unpack('>I4s', data[pos:pos + 8])
+        body = data[pos + 8:pos + 8 + length]
+        if kind == b'IHDR':
+            header = struct.unpack('>IIBBBBB', body)
+        elif kind == b'IDAT':
+            idat += body
+        elif kind == b'IEND':
+            break
+        pos += 12 + length
+    if header is None:
+        raise ValueError(f'{path}: no IHDR chunk')
+
+    width, height, depth, colour, _, _, interlace = header
+    if depth != 8 or colour not in (2, 6) or interlace:
+        raise ValueError(f'{path}: only 8 bit RGB/RGBA non-interlaced PNGs are supported')
+    bpp = 4 if colour == 6 else 3
+    stride = width * bpp
+
+    raw = zlib.decompress(idat)
+    rows = []
+    prev = bytearray(stride)
+    for y in range(height):
+        start = y * (stride + 1)
+        kind = raw[start]
+        line = bytearray(raw[start + 1:start + 1 + stride])
+        for x in range(stride):
+            a = line[x - bpp] if x >= bpp else 0
+            b = prev[x]
+            c = prev[x - bpp] if x >= bpp else 0
+            if kind == 1:
+                line[x] = (line[x] + a) & 0xff
+            elif kind == 2:
+                line[x] = (line[x] + b) & 0xff
+            elif kind == 3:
+                line[x] = (line[x] + (a + b) // 2) & 0xff
+            elif kind == 4:
+                line[x] = (line[x] + paeth(a, b, c)) & 0xff
+        rows.append([tuple(line[x * bpp:x * bpp + 3]) for x in range(width)])
+        prev = line
+    return width, height, rows
+
+
+def rgb565_swapped(r: int, g: int, b: int) -> int:
+    value = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3)
+    return ((value >> 8) | (value << 8)) & 0xffff
+
+
+def encode(rows: List[List[Tuple[int, int, int]]]) -> Tuple[List[int], List[int], List[int]]:
+    index = [0]
+    lengths: List[int] = []
+    colours: List[int] = []
+    for row in rows:
+        pixels = [rgb565_swapped(*p) for p in row]
+        x = 0
+        while x < len(pixels):
+            run = 1
+            while x + run < len(pixels) and run < MAX_RUN and pixels[x + run] == pixels[x]:
+                run += 1
+            lengths.append(run)
+            colours.append(pixels[x])
+            x += run
+        index.append(len(lengths))
+    if index[-1] > 0xffff:
+        raise ValueError('too many runs for a 16 bit row index')
+    return index, lengths, colours
+
+
+def c_array(ctype: str, name: str, values: List[int], fmt: str, per_line: int) -> str:
+    lines = []
+    for i in range(0, len(values), per_line):
+        lines.append('    ' + ', '.join(fmt.format(v) for v in values[i:i + per_line]) + ',')
+    return f'static const {ctype} {name}[{len(values)}] = {{\n' + '\n'.join(lines) + '\n};\n'
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('png', help='input image')
+    parser.add_argument('header', help='C header to write')
+    parser.add_argument('--name', required=True, help='C identifier of the image')
+    args = parser.parse_args()
+
+    width, height, rows = read_png(args.png)
+    index, lengths, colours = encode(rows)
+    name = args.name
+    source = args.png.replace('\\', '/').split('/')[-1]
+
+    out = [
+        f'/* Generated by tools/rle_image.py from {source}, do not edit.\n',
+        f' * {width}x{height}, {len(lengths)} runs, '
+        f'{2 * len(index) + 3 * len(lengths)} bytes (raw {2 * width * height}). */\n',
+        '\n',
+        '#pragma once\n',
+        '\n',
+        '#include "rle_image.h"\n',
+        '\n',
+        c_array('uint16_t', f'{name}_rows', index, '{:5d}', 12),
+        '\n',
+        c_array('uint8_t', f'{name}_len', lengths, '{:3d}', 16),
+        '\n',
+        c_array('uint16_t', f'{name}_color', colours, '0x{:04x}', 12),
+        '\n',
+        f'static const rle_image_t {name} = {{\n',
+        f'    .width     = {width},\n',
+        f'    .height    = {height},\n',
+        f'    .row_index = {name}_rows,\n',
+        f'    .run_len   = {name}_len,\n',
+        f'    .run_color = {name}_color,\n',
+        '};\n',
+    ]
+    with open(args.header, 'w') as f:
+        f.write(''.join(out))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())